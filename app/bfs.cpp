@@ -124,6 +124,10 @@ private:
 
       // copy the output back down
       readFromGlobalArg(*output_host_ptr, *output_mem_ptr);
+      // the next iteration reads this as its input, in the original order
+      if (restoreOutputOrder(*output_host_ptr)) {
+        writeToGlobalArg(*output_host_ptr, *output_mem_ptr);
+      }
 
       LOG_DEBUG_INFO("Host vectors after");
       printCharVector<SemiRingType>("Input ", *input_host_ptr);
@@ -140,17 +144,19 @@ private:
       std::swap(input_mem_ptr, output_mem_ptr);
       std::swap(input_host_ptr, output_host_ptr);
 
-      // set the kernel args
-      setGlobalArg(_mem_manager._input_idx, input_mem_ptr);
-      setGlobalArg(_mem_manager._output_idx, output_mem_ptr);
-      // also set the y vector!
-      setGlobalArg(3, input_mem_ptr);
+      // set the kernel args (the input is also the y vector!)
+      bindVectors(input_mem_ptr, input_mem_ptr, output_mem_ptr);
 
       iteration++;
     } while (!should_terminate);
     return runtimes;
   }
 
+  // the kernels' doubleAndOr of an empty (false) dot product
+  virtual SemiRingType emptyRowOutput(SemiRingType y) {
+    return (y != 0 && _args.beta != 0) ? 1 : 0;
+  }
+
   virtual bool should_terminate_iteration(std::vector<char> &input,
                                           std::vector<char> &output) {
     start_timer(should_terminate_iteration, HarnessBFS);
@@ -207,7 +213,7 @@ public:
 };
 
 int main(int argc, char *argv[]) {
-  COMMON_MAIN_PREAMBLE(SemiRingType)
+  COMMON_MAIN_PREAMBLE(SemiRingType, DuplicatePolicy::OR)
 
   // build non-matrix args
   InitialDistancesGeneratorX<SemiRingType> x(0);
@@ -20,6 +20,7 @@
 #include "csds_timer.h"
 #include "csv_utils.h"
 #include "options.h"
+#include "parallel_utils.h"
 
 // [ocl tools]
 #include "harness.h"
@@ -27,6 +28,7 @@
 #include "kernel_utils.h"
 
 // [application specific]
+#include "mtx_parser.h"
 #include "run.h"
 #include "sparse_matrix.h"
 #include "vector_generator.h"
@@ -55,6 +57,29 @@ int main(int argc, char **argv) {
   auto opt_experiment_id = op.addOption<std::string>(
       {'e', "experiment", "An experiment ID for data reporting",
        "null_experiment"});
+  auto opt_threads = op.addOption<unsigned>(
+      {'j', "threads",
+       "Maximum number of parser threads to measure scaling up to (default: "
+       "all hardware threads).",
+       default_thread_count()});
+  auto opt_no_matrix_cache = op.addOption<bool>(
+      {'x', "no_matrix_cache",
+       "Always parse the matrix file, ignoring any binary cache.", false});
+  auto opt_duplicates = op.addOption<std::string>(
+      {'u', "duplicates",
+       "Merge duplicate entries: keep, sum, min, max, or, or default (sum).",
+       "default"});
+  auto opt_drop_self_loops = op.addOption<bool>(
+      {'s', "drop_self_loops", "Drop entries on the matrix diagonal.", false});
+  auto opt_reorder = op.addOption<std::string>(
+      {'o', "reorder",
+       "Renumber the rows and columns of the matrix: none, rcm, degree or bfs.",
+       "none"});
+  auto opt_segment_width = op.addOption<unsigned>(
+      {'g', "segment_width",
+       "Columns in each segment of a segmented matrix (default: the kernel's "
+       "segmentWidth, or as many as fit in half of 32KB of local memory).",
+       0});
   op.parse(argc, argv);
 
   using namespace std;
@@ -64,11 +89,64 @@ int main(int argc, char **argv) {
   std::cerr << "matrix_filename " << matrix_filename << ENDL;
   std::cerr << "kernel_filename " << kernel_filename << ENDL;
 
-  unsigned int one_gb = 1 * 1024 * 1024 * 1024;
+  size_t one_gb = 1024UL * 1024 * 1024;
+
+  // measure the raw parser throughput, and how it scales with threads
+  {
+    start_timer(parser_scaling, main);
+    std::vector<unsigned int> thread_counts;
+    for (unsigned int t = 1; t < opt_threads->get(); t *= 2) {
+      thread_counts.push_back(t);
+    }
+    thread_counts.push_back(std::max(1u, opt_threads->get()));
+
+    double single_thread_seconds = 0.0;
+    for (auto threads : thread_counts) {
+      double best_seconds = std::numeric_limits<double>::max();
+      size_t bytes = 0;
+      for (unsigned int i = 0; i < opt_trials->require(); i++) {
+        auto start = std::chrono::steady_clock::now();
+        MTXParser parser(matrix_filename);
+        std::vector<int> xs;
+        std::vector<int> ys;
+        std::vector<float> vals;
+        parser.parse<float>(xs, ys, vals, threads);
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best_seconds = std::min(best_seconds, elapsed.count());
+        bytes = parser.bytes();
+      }
+      if (threads == 1) {
+        single_thread_seconds = best_seconds;
+      }
+      double mb_per_second = ((double)bytes / (1000.0 * 1000.0)) / best_seconds;
+      std::cout << "PARSER_SCALING(" << threads << ", "
+                << best_seconds * 1000.0 << ", " << mb_per_second << ", "
+                << single_thread_seconds / best_seconds << ")" << ENDL;
+    }
+  }
 
   for (unsigned int i = 0; i < opt_trials->require(); i++) {
-    SparseMatrix<float> matrix(matrix_filename);
     KernelConfig<float> kernel(kernel_filename);
+    SparseMatrix<float> matrix(matrix_filename, !opt_no_matrix_cache->get(),
+                               kernel.getProperties().symmetric);
+    matrix.coalesce(
+        parse_duplicate_policy(opt_duplicates->get(), DuplicatePolicy::SUM),
+        opt_drop_self_loops->get());
+    matrix.reorder(parse_reordering(opt_reorder->get()));
+    if (kernel.getProperties().arrayType == "segmented") {
+      // there's no device to ask, so assume a typical local memory size
+      chooseSegmentWidth(kernel, opt_segment_width->get(), 32 * 1024);
+    }
+    if (kernel.getProperties().arrayType == "bcsr") {
+      chooseBlockSize(kernel, matrix);
+    }
+    if (i == 0) {
+      std::cout << predictFootprint(kernel, matrix)
+                       .makeSqlCommand(matrix_filename, kernel.getName(),
+                                       experiment)
+                << ENDL;
+    }
 
     if (matrix.height() != matrix.width()) {
       std::cout << "Matrix is not square. Failing computation." << ENDL;
@@ -87,7 +165,7 @@ int main(int argc, char **argv) {
     try {
       auto args = executorEncodeMatrix(one_gb, kernel, matrix, 0.0f, onegen,
                                        zerogen, 1.0f, 0.0f);
-    } catch (unsigned int alloc) {
+    } catch (unsigned long alloc) {
       LOG_ERROR("Tried to alloc ", alloc,
                 " bytes of memory on the gpu, when maximum is ", one_gb);
     }
@@ -30,6 +30,7 @@
 // [application specific]
 #include "run.h"
 #include "sparse_matrix.h"
+#include "spmv_gold.h"
 #include "vector_generator.h"
 
 // [OpenCL]
@@ -39,7 +40,12 @@
 #include "CL/cl.h"
 #endif
 
-typedef float SemiRingType;
+// the type of the values, which the build can override (e.g. for a double
+// precision harness, which doesn't stall on float round-off on big graphs)
+#ifndef SEMIRING_TYPE
+#define SEMIRING_TYPE float
+#endif
+typedef SEMIRING_TYPE SemiRingType;
 
 class HarnessPR : public IterativeHarness<std::vector<SqlStat>, SemiRingType> {
 public:
@@ -79,7 +85,7 @@ public:
             [](std::chrono::nanoseconds time, SqlStat stat) {
               return time + stat.getTime();
             });
-        run_runtimes.push_back(SqlStat(total_time, NOT_CHECKED, run.global1,
+        run_runtimes.push_back(SqlStat(total_time, _correctness, run.global1,
                                        run.local1, MULTI_ITERATION_SUM));
 
         // add all the times to the list
@@ -126,6 +132,10 @@ private:
 
       // copy the output back down
       readFromGlobalArg(*output_host_ptr, *output_mem_ptr);
+      // the next iteration reads this as its input, in the original order
+      if (restoreOutputOrder(*output_host_ptr)) {
+        writeToGlobalArg(*output_host_ptr, *output_mem_ptr);
+      }
 
       LOG_DEBUG_INFO("Host vectors after");
       printCharVector<SemiRingType>("Input ", *input_host_ptr);
@@ -142,14 +152,14 @@ private:
       std::swap(input_mem_ptr, output_mem_ptr);
       std::swap(input_host_ptr, output_host_ptr);
 
-      // set the kernel args
-      setGlobalArg(_mem_manager._input_idx, input_mem_ptr);
-      setGlobalArg(_mem_manager._output_idx, output_mem_ptr);
-      // also set the y vector!
-      setGlobalArg(3, input_mem_ptr);
+      // set the kernel args (the input is also the y vector!)
+      bindVectors(input_mem_ptr, input_mem_ptr, output_mem_ptr);
 
       iteration++;
     } while (!should_terminate);
+
+    // (the pointers were swapped, so the last result is the input)
+    _correctness = check_result(gold, *input_host_ptr);
     return runtimes;
   }
 
@@ -174,10 +184,13 @@ private:
 
     return equal;
   }
+
+  // whether the result of the last run matched the gold
+  Correctness _correctness = NOT_CHECKED;
 };
 
 int main(int argc, char *argv[]) {
-  COMMON_MAIN_PREAMBLE(SemiRingType)
+  COMMON_MAIN_PREAMBLE(SemiRingType, DuplicatePolicy::SUM)
 
   SemiRingType dampingFactor = 0.85f;
 
@@ -197,8 +210,8 @@ int main(int argc, char *argv[]) {
   ArgContainer<SemiRingType> args;
   try {
     matrix.pagerank_normalise(dampingFactor, 0.0f);
-    args = executorEncodeMatrix(max_alloc, kernel, matrix, 0.0f, x, y, alpha,
-                                beta);
+    args = executorEncodeMatrix(max_alloc, kernel, matrix, SemiRingType(0), x,
+                                y, alpha, beta);
   } catch (unsigned long attempted_alloc_size) {
     LOG_ERROR("Attempted to allocate: ", attempted_alloc_size,
               " bytes, but this platform's max is ", max_alloc);
@@ -209,7 +222,13 @@ int main(int argc, char *argv[]) {
                     std::chrono::milliseconds(opt_timeout->get()),
                     opt_float_delta->get());
 
-  std::vector<SemiRingType> gold(0, 0.0f);
+  // calculate the gold value (it's expensive, so do it after
+  // the things that might fail)
+  std::vector<double> error_bounds;
+  auto gold = Gold<SemiRingType>::pagerank(matrix, x, y, alpha, beta,
+                                           opt_float_delta->get(),
+                                           args.rounding, &error_bounds);
+  harness.setErrorBounds(std::move(error_bounds));
 
   const std::string &kernel_name = kernel.getName();
   const std::string &host_name = hostname;
@@ -226,5 +245,8 @@ int main(int argc, char *argv[]) {
                                   matrix_name, experiment_id);
       std::cout << command << "\n";
     }
+    std::cout << harness.accuracy().makeSqlCommand(matrix_name, kernel_name,
+                                                   experiment_id)
+              << "\n";
   }
 }
\ No newline at end of file
@@ -126,6 +126,10 @@ private:
 
       // copy the output back down
       readFromGlobalArg(*output_host_ptr, *output_mem_ptr);
+      // the next iteration reads this as its input, in the original order
+      if (restoreOutputOrder(*output_host_ptr)) {
+        writeToGlobalArg(*output_host_ptr, *output_mem_ptr);
+      }
 
       LOG_DEBUG_INFO("Host vectors after");
       printCharVector<SemiRingType>("Input ", *input_host_ptr);
@@ -142,17 +146,22 @@ private:
       std::swap(input_mem_ptr, output_mem_ptr);
       std::swap(input_host_ptr, output_host_ptr);
 
-      // set the kernel args
-      setGlobalArg(_mem_manager._input_idx, input_mem_ptr);
-      setGlobalArg(_mem_manager._output_idx, output_mem_ptr);
-      // also set the y vector!
-      setGlobalArg(3, input_mem_ptr);
+      // set the kernel args (the input is also the y vector!)
+      bindVectors(input_mem_ptr, input_mem_ptr, output_mem_ptr);
 
       iteration++;
     } while (!should_terminate);
     return runtimes;
   }
 
+  // the kernels' doubleMinMax of an empty dot product, which is the
+  // smallest int
+  virtual SemiRingType emptyRowOutput(SemiRingType y) {
+    return std::max(std::min(std::numeric_limits<SemiRingType>::min(),
+                             _args.alpha),
+                    std::min(y, _args.beta));
+  }
+
   virtual bool should_terminate_iteration(std::vector<char> &input,
                                           std::vector<char> &output) {
     start_timer(should_terminate_iteration, HarnessSCC);
@@ -195,7 +204,7 @@ public:
 };
 
 int main(int argc, char *argv[]) {
-  COMMON_MAIN_PREAMBLE(SemiRingType)
+  COMMON_MAIN_PREAMBLE(SemiRingType, DuplicatePolicy::MAX)
 
   // build vector generators
   InitialComponentsGeneratorX<SemiRingType> x;
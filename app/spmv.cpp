@@ -40,16 +40,23 @@
 #include "CL/cl.h"
 #endif
 
-class HarnessSPMV : public Harness<SqlStat, float> {
+// the type of the values, which the build can override (e.g. for a double
+// precision harness)
+#ifndef SEMIRING_TYPE
+#define SEMIRING_TYPE float
+#endif
+typedef SEMIRING_TYPE SemiRingType;
+
+class HarnessSPMV : public Harness<SqlStat, SemiRingType> {
 public:
   HarnessSPMV(std::string &kernel_source, unsigned int platform,
-              unsigned int device, ArgContainer<float> args,
+              unsigned int device, ArgContainer<SemiRingType> args,
               unsigned int trials, std::chrono::milliseconds timeout,
               double delta)
       : Harness(kernel_source, platform, device, args, trials, timeout, delta) {
     allocateBuffers();
   }
-  std::vector<SqlStat> benchmark(Run run, std::vector<float> &gold) {
+  std::vector<SqlStat> benchmark(Run run, std::vector<SemiRingType> &gold) {
 
     start_timer(benchmark, HarnessSPMV);
 
@@ -99,25 +106,27 @@ public:
 
 private:
   virtual SqlStat executeRun(Run run, unsigned int trial,
-                             std::vector<float> &gold) {
+                             std::vector<SemiRingType> &gold) {
     // get the runtime from a single kernel run
     std::chrono::nanoseconds time = executeKernel(run);
 
     // copy the output back down
     readFromGlobalArg(_mem_manager._output_host_buffer, _mem_manager._output);
+    restoreOutputOrder(_mem_manager._output_host_buffer);
     auto correctness = check_result(gold);
     return SqlStat(time, correctness, run.global1, run.local1, RAW_RESULT);
   }
 };
 
 int main(int argc, char *argv[]) {
-  COMMON_MAIN_PREAMBLE(float)
+  COMMON_MAIN_PREAMBLE(SemiRingType, DuplicatePolicy::SUM)
 
   // build non-matrix args
-  ConstXVectorGenerator<float> x(1.0f);
-  ConstYVectorGenerator<float> y(0);
-  float alpha = 1.0f;
-  float beta = 0.0f;
+  ConstXVectorGenerator<SemiRingType> x(1.0f);
+  ConstYVectorGenerator<SemiRingType> y(0);
+  SemiRingType alpha = 1.0f;
+  SemiRingType beta = 0.0f;
+  SemiRingType zero = 0.0f;
 
   // get some arguments
   unsigned long max_alloc =
@@ -125,9 +134,9 @@ int main(int argc, char *argv[]) {
   max_alloc = deviceGetMaxAllocSize(opt_platform->get(), opt_device->get());
   std::cout << "Got max alloc: " << max_alloc << "\n";
 
-  ArgContainer<float> args;
+  ArgContainer<SemiRingType> args;
   try {
-    args = executorEncodeMatrix(max_alloc, kernel, matrix, 0.0f, x, y, alpha,
+    args = executorEncodeMatrix(max_alloc, kernel, matrix, zero, x, y, alpha,
                                 beta);
   } catch (unsigned long attempted_alloc_size) {
     LOG_ERROR("Attempted to allocate: ", attempted_alloc_size,
@@ -141,7 +150,9 @@ int main(int argc, char *argv[]) {
 
   // calculate the gold value (it's expensive, so do it after
   // the things that might fail)
-  auto gold = Gold<float>::spmv(matrix, x, y, alpha, beta, 0.0f);
+  auto gold = Gold<SemiRingType>::spmv(matrix, x, y, alpha, beta, zero);
+  harness.setErrorBounds(
+      Gold<SemiRingType>::spmv_error_bound(matrix, x, alpha, args.rounding));
 
   const std::string &kernel_name = kernel.getName();
   const std::string &host_name = hostname;
@@ -165,5 +176,8 @@ int main(int argc, char *argv[]) {
         SqlStat::makeSqlCommand(runtimes, kernel_name, host_name, device_name,
                                 matrix_name, experiment_id);
     std::cout << command << "\n";
+    std::cout << harness.accuracy().makeSqlCommand(matrix_name, kernel_name,
+                                                   experiment_id)
+              << "\n";
   }
 }
@@ -3,12 +3,20 @@
 #include "csds_timer.h"
 #include <cstdio>
 #include <iostream>
+#include <map>
 #include <string>
 
 class Evaluator {
 public:
-  // static void initialise_variables(int v_MWidth_1, int v_MHeight_2,
-  //                                  int v_VLength_3);
-  static int evaluate(std::string expr, int v_MWidth_1, int v_MHeight_2,
-                      int v_VLength_3);
-};
\ No newline at end of file
+  // the value of each size of a kernel's arguments, by name (e.g. "MHeight")
+  typedef std::map<std::string, long> SizeMap;
+
+  // Evaluate a buffer size expression from a kernel description. Each size
+  // is bound to the variable name the kernels use for it (see variable).
+  // buffer sizes can exceed 2^31 bytes, so evaluate to a 64 bit value
+  static long evaluate(std::string expr, const SizeMap &sizes);
+
+  // the name of the variable for a size in kernel expressions - e.g.
+  // v_MHeight_2 for MHeight. Sizes without a fixed number are just v_<name>.
+  static std::string variable(const std::string &size);
+};
@@ -1,10 +1,43 @@
 #pragma once
 #include "Logger.h"
 #include "csds_timer.h"
+#include <memory>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
-template <typename T> void printc_vec(std::vector<char> &v, int stride) {
+// An allocator that default-initialises (i.e. for trivial types, doesn't
+// initialise) elements that would otherwise be value-initialised. A
+// std::vector<char> with this allocator can be sized without zeroing every
+// byte, which we want for buffers that are about to be overwritten anyway.
+template <typename T, typename A = std::allocator<T>>
+class uninitialised_allocator : public A {
+  typedef std::allocator_traits<A> a_t;
+
+public:
+  template <typename U> struct rebind {
+    using other =
+        uninitialised_allocator<U, typename a_t::template rebind_alloc<U>>;
+  };
+
+  using A::A;
+
+  template <typename U>
+  void construct(U *ptr) noexcept(
+      std::is_nothrow_default_constructible<U>::value) {
+    ::new (static_cast<void *>(ptr)) U;
+  }
+  template <typename U, typename... Args>
+  void construct(U *ptr, Args &&... args) {
+    a_t::construct(static_cast<A &>(*this), ptr, std::forward<Args>(args)...);
+  }
+};
+
+// a byte buffer that is left uninitialised when it is created or resized
+typedef std::vector<char, uninitialised_allocator<char>> raw_buffer;
+
+template <typename T, typename Buffer> void printc_vec(Buffer &v, int stride) {
   start_timer(printc_vec, buffer_utils);
   // get a pointer to the underlying data
   char *cptr = v.data();
@@ -25,8 +58,8 @@ template <typename T> void printc_vec(std::vector<char> &v, int stride) {
   std::cout << "]\n]\n";
 }
 
-template <typename T>
-void print_rsa_matrix(std::vector<char> &v, std::vector<unsigned long> offsets,
+template <typename T, typename Buffer>
+void print_rsa_matrix(Buffer &v, std::vector<unsigned long> offsets,
                       unsigned long last_arr_size) {
   start_timer(print_rsa_matrix, buffer_utils);
   // get a pointer to the underlying data
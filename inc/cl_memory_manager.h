@@ -14,13 +14,34 @@ public:
   ArgContainer<SemiringType> &_args;
   cl_mem _matrix_idxs;
   cl_mem _matrix_vals;
+  std::vector<cl_mem> _matrix_extra;
   cl_mem _x_vect;
   cl_mem _y_vect;
   cl_mem _output;
   std::vector<cl_mem> _temp_global;
 
+  // the buffers of each block, if the matrix has been split into blocks of
+  // rows (see ArgContainer::blocks) - or, if the blocks don't all fit in
+  // device memory at once, the two slots they're streamed through
+  struct BlockBuffers {
+    cl_mem matrix_idxs;
+    cl_mem matrix_vals;
+    std::vector<cl_mem> matrix_extra;
+    cl_mem y_vect;
+    cl_mem output;
+    std::vector<cl_mem> temp_global;
+  };
+  std::vector<BlockBuffers> _blocks;
+  bool _streaming = false;
+  // the whole vectors that the kernel currently reads from (x and y) and
+  // writes to (see Harness::bindVectors)
+  cl_mem _bound_x;
+  cl_mem _bound_y;
+  cl_mem _bound_output;
+
   cl_uint _arg_index = 0;
   cl_uint _input_idx = 2;
+  cl_uint _y_idx = 3;
   cl_uint _output_idx = 0;
 
   std::vector<char> _input_host_buffer;
@@ -2,7 +2,7 @@
 
 #define ENDL "\n"
 
-#define COMMON_MAIN_PREAMBLE(mtype)                                            \
+#define COMMON_MAIN_PREAMBLE(mtype, duplicates)                                \
   start_timer(main, global);                                                   \
   OptParser op("Harness for SPMV sparse matrix dense vector multiplication "   \
                "benchmarks");                                                  \
@@ -30,6 +30,37 @@
   auto opt_timeout = op.addOption<unsigned int>(                               \
       {'t', "timeout",                                                         \
        "Timeout to avoid multiple executions (default 100ms).", 100});         \
+  auto opt_no_matrix_cache = op.addOption<bool>(                               \
+      {'x', "no_matrix_cache",                                                 \
+       "Always parse the matrix file, ignoring any binary cache.", false});    \
+  auto opt_duplicates = op.addOption<std::string>(                             \
+      {'u', "duplicates",                                                      \
+       "Merge duplicate entries: keep, sum, min, max, or, or default (the "    \
+       "application's semiring addition).",                                    \
+       "default"});                                                            \
+  auto opt_drop_self_loops = op.addOption<bool>(                               \
+      {'s', "drop_self_loops", "Drop entries on the matrix diagonal.",         \
+       false});                                                                \
+  auto opt_reorder = op.addOption<std::string>(                                \
+      {'o', "reorder",                                                         \
+       "Renumber the rows and columns of the matrix: none, rcm, degree or "    \
+       "bfs.",                                                                 \
+       "none"});                                                               \
+  auto opt_segment_width = op.addOption<unsigned>(                             \
+      {'g', "segment_width",                                                   \
+       "Columns in each segment of a segmented matrix (default: the "          \
+       "kernel's segmentWidth, or as many as fit in half of local memory).",   \
+       0});                                                                    \
+  auto opt_max_padding = op.addOption<double>(                                 \
+      {'w', "max_padding",                                                     \
+       "Skip the kernel if more than this percentage of its encoded "          \
+       "matrix would be padding (default 0: no limit).",                       \
+       0.0});                                                                  \
+  auto opt_require_fit = op.addOption<bool>(                                   \
+      {'z', "require_fit",                                                     \
+       "Skip the kernel if its encoded matrix wouldn't fit on the device "     \
+       "(rather than running it in blocks of rows).",                          \
+       false});                                                                \
   op.parse(argc, argv);                                                        \
   using namespace std;                                                         \
   const std::string matrix_filename = opt_matrix_file->require();              \
@@ -40,8 +71,60 @@
   const std::string experiment = opt_experiment_id->require();                 \
   std::cerr << "matrix_filename " << matrix_filename << ENDL;                  \
   std::cerr << "kernel_filename " << kernel_filename << ENDL;                  \
-  SparseMatrix<mtype> matrix(matrix_filename);                                 \
   KernelConfig<mtype> kernel(kernel_filename);                                 \
+  const std::string kernel_value_type =                                        \
+      kernelValueType<mtype>(kernel.getProperties());                          \
+  if (kernel_value_type != ValueType<mtype>::name()) {                         \
+    std::cout << "Kernel computes with " << kernel_value_type                  \
+              << " values, not " << ValueType<mtype>::name()                   \
+              << ". Failing computation." << ENDL;                             \
+    std::cerr << "Kernel computes with " << kernel_value_type                  \
+              << " values, not " << ValueType<mtype>::name()                   \
+              << ". Failing computation." << ENDL;                             \
+    std::exit(3);                                                              \
+  }                                                                            \
+  SparseMatrix<mtype> matrix(matrix_filename, !opt_no_matrix_cache->get(),     \
+                             kernel.getProperties().symmetric);                \
+  matrix.coalesce(parse_duplicate_policy(opt_duplicates->get(), duplicates),   \
+                  opt_drop_self_loops->get());                                 \
+  matrix.reorder(parse_reordering(opt_reorder->get()));                        \
+  if (kernel.getProperties().symmetric && !matrix.half_stored()) {             \
+    std::cout << "Symmetric kernel needs a symmetric matrix. Failing "         \
+                 "computation."                                                \
+              << ENDL;                                                         \
+    std::cerr << "Symmetric kernel needs a symmetric matrix. Failing "         \
+                 "computation."                                                \
+              << ENDL;                                                         \
+    std::exit(3);                                                              \
+  }                                                                            \
+  std::cout << matrix.structure_profile().makeSqlCommand(matrix_name,          \
+                                                         experiment)           \
+            << "\n";                                                           \
+  if (kernel.getProperties().arrayType == "segmented") {                       \
+    chooseSegmentWidth(kernel, opt_segment_width->get(),                       \
+                       deviceGetLocalMemSize(opt_platform->get(),              \
+                                             opt_device->get()));              \
+  }                                                                            \
+  if (kernel.getProperties().arrayType == "bcsr") {                            \
+    chooseBlockSize(kernel, matrix);                                           \
+  }                                                                            \
+  auto footprint = predictFootprint(kernel, matrix);                           \
+  std::cout << footprint.makeSqlCommand(matrix_name, kernel.getName(),         \
+                                        experiment)                            \
+            << "\n";                                                           \
+  if (!footprint.fits(opt_max_padding->get(),                                  \
+                      opt_require_fit->get()                                   \
+                          ? deviceGetMaxAllocSize(opt_platform->get(),         \
+                                                  opt_device->get())           \
+                          : 0,                                                 \
+                      opt_require_fit->get()                                   \
+                          ? deviceGetGlobalMemSize(opt_platform->get(),        \
+                                                   opt_device->get())          \
+                          : 0)) {                                              \
+    std::cout << "Skipping kernel. Failing computation." << ENDL;              \
+    std::cerr << "Skipping kernel. Failing computation." << ENDL;              \
+    std::exit(3);                                                              \
+  }                                                                            \
   auto csvlines = CSV::load_csv(runs_filename);                                \
   std::vector<Run> runs;                                                       \
   std::transform(csvlines.begin(), csvlines.end(), std::back_inserter(runs),   \
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <vector>
+
+#include "csds_timer.h"
+#include "parallel_utils.h"
+#include "radix_sort.h"
+
+// Build a CSR (compressed sparse row) matrix from an unsorted coordinate list:
+//  1. the coordinate list is sorted by (row, column) with a parallel LSD
+//     radix sort (see radix_sort_pairs), so its columns and values are
+//     already in CSR order
+//  2. every entry that starts a row sets the pointers of that row, and of
+//     any empty rows before it, so each pointer is written exactly once
+// The sort is stable, so entries with the same row and column stay in input
+// order, and the result is deterministic. A radix sort moves every entry a
+// fixed number of times however the entries are spread over the rows, where
+// scattering into rows and sorting each row leaves the longest rows of a
+// skewed matrix to a single thread (and counting the rows with shared
+// counters has every thread contend for those of the longest rows). The
+// coordinate list is consumed (its columns and values are moved into col_idx
+// and vals). row_ptr has height + 1 elements.
+template <typename V>
+void build_csr(int height, std::vector<int> &coo_rows,
+               std::vector<int> &coo_cols, std::vector<V> &coo_vals,
+               std::vector<size_t> &row_ptr, std::vector<int> &col_idx,
+               std::vector<V> &vals, unsigned int threads = 0) {
+  start_timer(build_csr, csr_builder);
+  const size_t n = coo_rows.size();
+  const size_t h = static_cast<size_t>(height);
+
+  // sort the entries into rows, and by column within each row
+  radix_sort_pairs(coo_rows, coo_cols, coo_vals, threads);
+
+  // find the row boundaries - the rows past the last entry are empty
+  row_ptr.assign(h + 1, n);
+  parallel_for(0, n,
+               [&](size_t i) {
+                 size_t first = i == 0 ? 0 : coo_rows[i - 1] + 1;
+                 for (size_t r = first;
+                      r <= static_cast<size_t>(coo_rows[i]); r++) {
+                   row_ptr[r] = i;
+                 }
+               },
+               threads);
+
+  col_idx.swap(coo_cols);
+  vals.swap(coo_vals);
+  std::vector<int>().swap(coo_rows);
+  std::vector<int>().swap(coo_cols);
+  std::vector<V>().swap(coo_vals);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include "common.h"
+
+// How to treat entries of a matrix with the same coordinates. Graph inputs
+// (e.g. converted edge lists) often contain duplicate edges, which make rows
+// longer, and so the encoded (padded) matrix bigger, for no benefit. Each
+// application merges them with the "addition" of its semiring, so that the
+// results are the same as if the duplicates had been kept.
+enum class DuplicatePolicy { KEEP, SUM, MIN, MAX, OR };
+
+inline const char *duplicate_policy_name(DuplicatePolicy policy) {
+  switch (policy) {
+  case DuplicatePolicy::KEEP:
+    return "keep";
+  case DuplicatePolicy::SUM:
+    return "sum";
+  case DuplicatePolicy::MIN:
+    return "min";
+  case DuplicatePolicy::MAX:
+    return "max";
+  case DuplicatePolicy::OR:
+    return "or";
+  }
+  return "unknown";
+}
+
+// Parse a policy from the command line. "default" gives the policy the
+// application asked for.
+inline DuplicatePolicy parse_duplicate_policy(const std::string &name,
+                                              DuplicatePolicy fallback) {
+  if (name == "default") {
+    return fallback;
+  }
+  for (DuplicatePolicy policy :
+       {DuplicatePolicy::KEEP, DuplicatePolicy::SUM, DuplicatePolicy::MIN,
+        DuplicatePolicy::MAX, DuplicatePolicy::OR}) {
+    if (name == duplicate_policy_name(policy)) {
+      return policy;
+    }
+  }
+  std::cerr << "Unknown duplicate policy " << name
+            << " (expected keep, sum, min, max, or or default)" << ENDL;
+  exit(-1);
+}
+
+// merge the values of two entries with the same coordinates
+template <typename T>
+inline T combine_duplicates(DuplicatePolicy policy, T a, T b) {
+  switch (policy) {
+  case DuplicatePolicy::SUM:
+    return a + b;
+  case DuplicatePolicy::MIN:
+    return std::min(a, b);
+  case DuplicatePolicy::MAX:
+    return std::max(a, b);
+  case DuplicatePolicy::OR:
+    return static_cast<T>(a != static_cast<T>(0) || b != static_cast<T>(0));
+  case DuplicatePolicy::KEEP:
+    break;
+  }
+  return a;
+}
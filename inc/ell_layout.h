@@ -0,0 +1,42 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+
+#include "common.h"
+
+// How the rows of a padded ELLPACK matrix are laid out in memory:
+//  - ROW_MAJOR: each row is contiguous (the default)
+//  - COLUMN_MAJOR: the matrix is transposed, so that entry j of consecutive
+//    rows is contiguous, and neighbouring work items read neighbouring
+//    elements
+//  - INTERLEAVED: rows are grouped into chunks (of the kernel's chunkSize),
+//    and each chunk is stored column major - i.e. entry j of row r is at
+//    ((r / chunk) * width + j) * chunk + (r % chunk)
+// Column major is just interleaved with a single chunk of every row.
+enum class EllLayout { ROW_MAJOR, COLUMN_MAJOR, INTERLEAVED };
+
+inline const char *ell_layout_name(EllLayout layout) {
+  switch (layout) {
+  case EllLayout::ROW_MAJOR:
+    return "row";
+  case EllLayout::COLUMN_MAJOR:
+    return "column";
+  case EllLayout::INTERLEAVED:
+    return "interleaved";
+  }
+  return "unknown";
+}
+
+// Parse a layout from a kernel's properties
+inline EllLayout parse_ell_layout(const std::string &name) {
+  for (EllLayout layout : {EllLayout::ROW_MAJOR, EllLayout::COLUMN_MAJOR,
+                           EllLayout::INTERLEAVED}) {
+    if (name == ell_layout_name(layout)) {
+      return layout;
+    }
+  }
+  std::cerr << "Unknown ELLPACK layout " << name
+            << " (expected row, column or interleaved)" << ENDL;
+  exit(-1);
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+
+// The predicted size of a matrix encoded for a kernel, and of everything the
+// harness allocates on the device to run it (see predictFootprint). This is
+// worked out from the row lengths of the matrix, without encoding it, so
+// that kernels which won't fit on a device (or which would mostly store
+// padding) can be skipped before any encoding work.
+struct EncodingFootprint {
+  // the shape of the encoded matrix
+  long cl_width = 0;
+  long cl_height = 0;
+  // the elements the encoding stores (padding included), and the entries of
+  // the matrix among them - and the entries of the whole matrix, which are
+  // more if only half of a symmetric matrix is stored
+  size_t elements = 0;
+  size_t entries = 0;
+  size_t full_entries = 0;
+  // the bytes of each matrix buffer: "indices", "values", and any extras
+  std::map<std::string, size_t> buffers;
+  // the bytes of the x and y vectors, of the output, and of each temporary
+  // global buffer
+  size_t vector_bytes = 0;
+  size_t output_bytes = 0;
+  std::vector<size_t> temp_globals;
+
+  size_t matrix_bytes() const {
+    size_t bytes = 0;
+    for (auto &buffer : buffers) {
+      bytes += buffer.second;
+    }
+    return bytes;
+  }
+
+  size_t device_bytes() const {
+    size_t bytes = matrix_bytes() + 2 * vector_bytes + output_bytes;
+    for (auto temp : temp_globals) {
+      bytes += temp;
+    }
+    return bytes;
+  }
+
+  // the largest single allocation
+  size_t largest_buffer() const {
+    size_t largest = std::max(vector_bytes, output_bytes);
+    for (auto &buffer : buffers) {
+      largest = std::max(largest, buffer.second);
+    }
+    for (auto temp : temp_globals) {
+      largest = std::max(largest, temp);
+    }
+    return largest;
+  }
+
+  // the percentage of the stored elements that are padding
+  double padding() const {
+    return elements == 0 ? 0.0
+                         : 100.0 * static_cast<double>(elements - entries) /
+                               static_cast<double>(elements);
+  }
+
+  // Whether a kernel with this footprint is worth running: it stores at most
+  // max_padding percent padding, every buffer fits in an allocation of
+  // max_alloc bytes, and all of them fit in global_mem bytes. Zero limits
+  // aren't checked. Reports why, if not.
+  bool fits(double max_padding, size_t max_alloc, size_t global_mem) const {
+    if (max_padding > 0 && padding() > max_padding) {
+      std::cerr << "Encoding would be " << padding()
+                << "% padding, more than the limit of " << max_padding << "%"
+                << ENDL;
+      return false;
+    }
+    if (max_alloc > 0 && largest_buffer() > max_alloc) {
+      std::cerr << "Encoding needs a buffer of " << largest_buffer()
+                << " bytes, but the maximum allocation is " << max_alloc
+                << ENDL;
+      return false;
+    }
+    if (global_mem > 0 && device_bytes() > global_mem) {
+      std::cerr << "Encoding needs " << device_bytes()
+                << " bytes on the device, which only has " << global_mem
+                << ENDL;
+      return false;
+    }
+    return true;
+  }
+
+  static std::string printHeader() {
+    std::ostringstream out;
+    out << "INSERT INTO kernel_footprint (matrix, kernel, experiment_id, "
+        << "cl_width, cl_height, elements, entries, full_entries, padding, "
+        << "matrix_bytes, largest_buffer, device_bytes) VALUES ";
+    return out.str();
+  }
+
+  // An insert of the footprint, to join with the benchmark results (see
+  // SqlStat) on the matrix, kernel and experiment id.
+  std::string makeSqlCommand(const std::string &matrix_name,
+                             const std::string &kernel_name,
+                             const std::string &experiment_id) const {
+    std::ostringstream out;
+    out << printHeader() << "(\"" << matrix_name << "\", \"" << kernel_name
+        << "\", \"" << experiment_id << "\", " << cl_width << ", "
+        << cl_height << ", " << elements << ", " << entries << ", "
+        << full_entries << ", " << padding() << ", " << matrix_bytes()
+        << ", " << largest_buffer() << ", " << device_bytes() << ");";
+    return out.str();
+  }
+};
@@ -4,9 +4,13 @@
 #include "kernel_utils.h"
 #include "opencl_utils.h"
 #include "sql_stat.h"
+#include "value_accuracy.h"
 
 #include "run.h"
 #include <chrono>
+#include <cmath>
+#include <limits>
+#include <type_traits>
 
 template <typename TimingType, typename SemiRingType> class Harness {
 public:
@@ -81,6 +85,12 @@ public:
     checkCLError(_error);
   }
 
+  virtual ~Harness() {
+    if (_transfer_queue != nullptr) {
+      clReleaseCommandQueue(_transfer_queue);
+    }
+  }
+
   virtual std::vector<TimingType>
   benchmark(Run run, std::vector<SemiRingType> &gold) = 0;
 
@@ -97,6 +107,14 @@ public:
     }
   }
 
+  cl_ulong getDeviceGlobalMemSize() {
+    cl_ulong size;
+    _error = clGetDeviceInfo(_deviceIds[_device], CL_DEVICE_GLOBAL_MEM_SIZE,
+                             sizeof(size), &size, NULL);
+    checkCLError(_error);
+    return size;
+  }
+
   std::string getDeviceName() {
     char name[10240];
     LOG_DEBUG_INFO("Getting device name from device ", _device_id);
@@ -106,39 +124,96 @@ public:
     return std::string(name);
   }
 
+  // how closely the output matched the gold, the last time it was checked
+  const ValueAccuracy &accuracy() { return _accuracy; }
+
+  // How far each value of the output (in the order of the gold) may be from
+  // the gold, on top of the delta, because of the precision it's computed
+  // in - see Gold::spmv_error_bound. Without bounds, only the delta is
+  // allowed.
+  void setErrorBounds(std::vector<double> bounds) {
+    _error_bounds = std::move(bounds);
+  }
+
 protected:
   virtual TimingType executeRun(Run run, unsigned int trial,
                                 std::vector<SemiRingType> &gold) = 0;
 
   Correctness check_result(std::vector<SemiRingType> &gold) {
+    return check_result(gold, _mem_manager._output_host_buffer);
+  }
+
+  // check a host buffer other than the output (e.g. the last result of an
+  // iterative harness, which swaps its buffers around)
+  Correctness check_result(std::vector<SemiRingType> &gold,
+                           std::vector<char> &result) {
     if (gold.size() == 0) {
       std::cout << "Got gold of size " << gold.size() << " \n";
       return NOT_CHECKED;
     }
 
-    unsigned int output_length =
-        (_mem_manager._output_host_buffer.size() * sizeof(char)) /
-        sizeof(SemiRingType);
+    // the gold is in the original order, so undo any reordering
+    std::vector<char> reordered;
+    std::vector<char> &output = _args.reorder.empty() ? result : reordered;
+    if (!_args.reorder.empty()) {
+      reordered = result;
+      unpermuteRows(reordered, _args.reorder);
+    }
+
+    size_t output_length =
+        (output.size() * sizeof(char)) / sizeof(SemiRingType);
     // recast the output host buffer as a float pointer
-    SemiRingType *res_ptr = reinterpret_cast<SemiRingType *>(
-        _mem_manager._output_host_buffer.data());
+    SemiRingType *res_ptr = reinterpret_cast<SemiRingType *>(output.data());
 
     if (output_length < gold.size()) {
       return BAD_LENGTH;
     }
 
-    // iterate over and check
+    // iterate over and check - floating point values to within the delta,
+    // plus the row's error bound (see setErrorBounds), and the rest exactly
+    _accuracy = ValueAccuracy();
+    _accuracy.precision = _args.precision;
+    _accuracy.tolerance =
+        std::is_floating_point<SemiRingType>::value ? _delta : 0.0;
     int error_count = 0;
     int max_errors = 20;
-    for (unsigned int i = 0; i < gold.size(); i++) {
-      if (gold[i] != res_ptr[i]) {
-        LOG_ERROR("Expected gold value ", gold[i], " at index ", i, " found ",
-                  res_ptr[i], " instead");
+    double error_sum = 0.0;
+    for (size_t i = 0; i < gold.size(); i++) {
+      double expected = static_cast<double>(gold[i]);
+      double found = static_cast<double>(res_ptr[i]);
+      double scale = std::max(1.0, std::fabs(expected));
+      double error = std::fabs(found - expected) / scale;
+      // (infinite gold values - e.g. unreachable vertices - must match)
+      if (found == expected) {
+        error = 0.0;
+      }
+      double allowed = _accuracy.tolerance;
+      if (i < _error_bounds.size()) {
+        allowed += _error_bounds[i] / scale;
+      }
+      _accuracy.checked++;
+      if (!(error <= allowed)) {
+        _accuracy.wrong++;
+        if (error_count < max_errors) {
+          LOG_ERROR("Expected gold value ", gold[i], " at index ", i,
+                    " found ", res_ptr[i], " instead");
+        }
         error_count++;
-        if (error_count == max_errors)
-          break;
+      }
+      if (!std::isnan(error)) {
+        _accuracy.max_error = std::max(_accuracy.max_error, error);
+        error_sum += error;
       }
     }
+    _accuracy.mean_error =
+        _accuracy.checked == 0 ? 0.0 : error_sum / _accuracy.checked;
+    std::cerr << "Accuracy (" << _accuracy.precision << "): " << _accuracy.wrong
+              << " of " << _accuracy.checked << " values off by more than "
+              << _accuracy.tolerance
+              << (_error_bounds.empty() ? "" : " (plus their error bounds)")
+              << ", largest error "
+              << _accuracy.max_error << ", mean " << _accuracy.mean_error
+              << ENDL;
     if (error_count > 0) {
       return BAD_VALUES;
     }
@@ -146,8 +221,261 @@ protected:
     return CORRECT;
   }
 
+  // If the encoding permuted the rows of the matrix, the kernel writes its
+  // output in the permuted order: put it back in the original order, ready to
+  // check (or feed into the next iteration). Returns whether it did anything.
+  bool restoreOutputOrder(std::vector<char> &output) {
+    if (_args.output_perm.empty()) {
+      return false;
+    }
+    start_timer(restoreOutputOrder, harness);
+    if (_args.compact_rows) {
+      scatterRows(output);
+    } else {
+      unpermuteRows(output, _args.output_perm);
+    }
+    return true;
+  }
+
+  // The output of a row with no entries, given its value of y: what the
+  // kernels compute from an empty dot product. This is alpha * 0 + beta * y
+  // for the multiply-add semiring - applications with other semirings
+  // override it.
+  virtual SemiRingType emptyRowOutput(SemiRingType y) {
+    return static_cast<SemiRingType>(_args.beta * y);
+  }
+
+  // Scatter the output of a compacted (DCSR) matrix, which only has the rows
+  // with entries, back to the whole output, and fill in the empty rows from
+  // the y vector the kernel read.
+  void scatterRows(std::vector<char> &output) {
+    std::vector<char> y(_args.y_vect.size(), 0);
+    readFromGlobalArg(y, _mem_manager._bound_y);
+    std::vector<char> compact(output);
+    size_t output_length = output.size() / sizeof(SemiRingType);
+    size_t y_length = y.size() / sizeof(SemiRingType);
+    const SemiRingType *src =
+        reinterpret_cast<const SemiRingType *>(compact.data());
+    const SemiRingType *ys = reinterpret_cast<const SemiRingType *>(y.data());
+    SemiRingType *dst = reinterpret_cast<SemiRingType *>(output.data());
+    for (size_t row = 0; row < std::min(output_length, y_length); row++) {
+      dst[row] = emptyRowOutput(ys[row]);
+    }
+    size_t rows = std::min(_args.output_perm.size(), output_length);
+    for (size_t i = 0; i < rows; i++) {
+      size_t row = static_cast<size_t>(_args.output_perm[i]);
+      if (row < output_length) {
+        dst[row] = src[i];
+      }
+    }
+  }
+
+  // move the i'th row of an output to row perm[i]
+  static void unpermuteRows(std::vector<char> &output,
+                            const std::vector<int> &perm) {
+    size_t output_length = output.size() / sizeof(SemiRingType);
+    size_t rows = std::min(perm.size(), output_length);
+    std::vector<char> permuted(output);
+    const SemiRingType *src =
+        reinterpret_cast<const SemiRingType *>(permuted.data());
+    SemiRingType *dst = reinterpret_cast<SemiRingType *>(output.data());
+    for (size_t i = 0; i < rows; i++) {
+      size_t row = static_cast<size_t>(perm[i]);
+      if (row < output_length) {
+        dst[row] = src[i];
+      }
+    }
+  }
+
+  // Point the kernel at the (whole) x, y and output vectors. If the matrix
+  // has been split into blocks, the arguments are set per block when the
+  // kernel is launched, so we only remember the buffers here.
+  void bindVectors(cl_mem *x, cl_mem *y, cl_mem *output) {
+    _mem_manager._bound_x = *x;
+    _mem_manager._bound_y = *y;
+    _mem_manager._bound_output = *output;
+    if (_args.blocks.empty()) {
+      setGlobalArg(_mem_manager._input_idx, x);
+      setGlobalArg(_mem_manager._y_idx, y);
+      setGlobalArg(_mem_manager._output_idx, output);
+    }
+  }
+
   std::chrono::nanoseconds executeKernel(Run run) {
+    if (_args.blocks.empty()) {
+      if (_args.accumulate_output) {
+        fillOutput(_args.zero);
+      }
+      return launchKernel(run);
+    }
+    if (_mem_manager._streaming) {
+      return streamBlocks(run);
+    }
     start_timer(executeKernel, harness);
+    // run the kernel over each block in turn, and stitch the outputs together
+    std::chrono::nanoseconds elapsed_ns(0);
+    for (size_t b = 0; b < _args.blocks.size(); b++) {
+      auto &block = _args.blocks[b];
+      auto &buffers = _mem_manager._blocks[b];
+      size_t row_bytes = block.rows * sizeof(SemiRingType);
+      copyGlobalArg(_mem_manager._bound_y, buffers.y_vect,
+                    block.row_begin * sizeof(SemiRingType), 0,
+                    std::min(row_bytes, block.y_vect));
+      setBlockArgs(b, buffers);
+      elapsed_ns += launchKernel(run);
+      if (block.output_perm.empty()) {
+        copyGlobalArg(buffers.output, _mem_manager._bound_output, 0,
+                      block.row_begin * sizeof(SemiRingType),
+                      std::min(row_bytes, block.output));
+      } else {
+        std::vector<char> output(block.output, 0);
+        readFromGlobalArg(output, buffers.output);
+        unpermuteRows(output, block.output_perm);
+        writeToGlobalArgAt(output.data(), std::min(row_bytes, block.output),
+                           block.row_begin * sizeof(SemiRingType),
+                           _mem_manager._bound_output);
+      }
+    }
+    return elapsed_ns;
+  }
+
+  // Stream the blocks through the two slots on the device: while the kernel
+  // runs on one block, the next block is uploaded into the other slot on the
+  // transfer queue. Returns the time from the first upload starting to the
+  // last kernel finishing, and reports how much the two overlapped.
+  std::chrono::nanoseconds streamBlocks(Run run) {
+    start_timer(streamBlocks, harness);
+    const size_t global_range[3] = {run.global1, run.global2, run.global3};
+    const size_t local_range[3] = {run.local1, run.local2, run.local3};
+    const size_t count = _args.blocks.size();
+
+    std::vector<cl_event> uploads;
+    std::vector<cl_event> kernels(count);
+    // the last upload of each block
+    std::vector<cl_event> ready(count);
+    ready[0] = enqueueBlockUpload(0, _mem_manager._blocks[0], NULL, uploads);
+    for (size_t b = 0; b < count; b++) {
+      auto &block = _args.blocks[b];
+      auto &slot = _mem_manager._blocks[b % 2];
+      size_t row_bytes = block.rows * sizeof(SemiRingType);
+      size_t y_bytes = std::min(row_bytes, block.y_vect);
+      if (y_bytes > 0) {
+        checkCLError(clEnqueueCopyBuffer(
+            _queue, _mem_manager._bound_y, slot.y_vect,
+            block.row_begin * sizeof(SemiRingType), 0, y_bytes, 0, NULL, NULL));
+      }
+      char pattern = 0;
+      for (size_t t = 0; t < slot.temp_global.size(); t++) {
+        checkCLError(clEnqueueFillBuffer(_queue, slot.temp_global[t], &pattern,
+                                         sizeof(char), 0,
+                                         block.temp_globals[t], 0, NULL, NULL));
+      }
+      setBlockArgs(b, slot);
+      checkCLError(clEnqueueNDRangeKernel(_queue, _kernel, 3, NULL,
+                                          global_range, local_range, 1,
+                                          &ready[b], &kernels[b]));
+      clFlush(_queue);
+
+      // upload the next block into the other slot, once the kernel that was
+      // reading it has finished
+      if (b + 1 < count) {
+        ready[b + 1] =
+            enqueueBlockUpload(b + 1, _mem_manager._blocks[(b + 1) % 2],
+                               b > 0 ? &kernels[b - 1] : NULL, uploads);
+      }
+
+      // and stitch this block's output into place
+      if (block.output_perm.empty()) {
+        checkCLError(clEnqueueCopyBuffer(
+            _queue, slot.output, _mem_manager._bound_output, 0,
+            block.row_begin * sizeof(SemiRingType),
+            std::min(row_bytes, block.output), 0, NULL, NULL));
+      } else {
+        std::vector<char> output(block.output, 0);
+        checkCLError(clEnqueueReadBuffer(_queue, slot.output, CL_TRUE, 0,
+                                         block.output, output.data(), 0, NULL,
+                                         NULL));
+        unpermuteRows(output, block.output_perm);
+        checkCLError(clEnqueueWriteBuffer(
+            _queue, _mem_manager._bound_output, CL_TRUE,
+            block.row_begin * sizeof(SemiRingType),
+            std::min(row_bytes, block.output), output.data(), 0, NULL, NULL));
+      }
+    }
+    clFinish(_transfer_queue);
+    clFinish(_queue);
+
+    // add up the time spent uploading and computing, and find how long the
+    // whole thing took
+    cl_ulong first = CL_ULONG_MAX;
+    cl_ulong last = 0;
+    auto accumulate = [&](std::vector<cl_event> &events) {
+      cl_ulong total = 0;
+      for (auto ev : events) {
+        cl_ulong start;
+        cl_ulong end;
+        checkCLError(clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+                                             sizeof(cl_ulong), (void *)&start,
+                                             NULL));
+        checkCLError(clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+                                             sizeof(cl_ulong), (void *)&end,
+                                             NULL));
+        total += end - start;
+        first = std::min(first, start);
+        last = std::max(last, end);
+        clReleaseEvent(ev);
+      }
+      return total;
+    };
+    cl_ulong transfer = accumulate(uploads);
+    cl_ulong compute = accumulate(kernels);
+    cl_ulong elapsed = last - first;
+    report_timing(clEnqueueWriteBuffer, streamBlocks, transfer);
+    report_timing(clEnqueueNDRangeKernel, streamBlocks, compute);
+
+    // the fraction of the shorter of the two that was hidden behind the other
+    cl_ulong hidden = transfer + compute > elapsed
+                          ? transfer + compute - elapsed
+                          : 0;
+    double overlap =
+        std::min(transfer, compute) > 0
+            ? 100.0 * hidden / static_cast<double>(std::min(transfer, compute))
+            : 0.0;
+    std::cout << "Streamed " << count << " blocks: uploads " << transfer / 1e6
+              << " ms, kernels " << compute / 1e6 << " ms, elapsed "
+              << elapsed / 1e6 << " ms, overlap " << overlap << "%\n";
+
+    return std::chrono::nanoseconds(elapsed);
+  }
+
+  // Enqueue (without waiting for) the upload of a block's matrix buffers into
+  // a slot, on the transfer queue. The upload waits for `after`, if given.
+  // Appends the events of the writes to `events`, and returns the last.
+  cl_event enqueueBlockUpload(size_t b,
+                              typename CLMemoryManager<
+                                  SemiRingType>::BlockBuffers &slot,
+                              cl_event *after, std::vector<cl_event> &events) {
+    auto &block = _args.blocks[b];
+    auto write = [&](raw_buffer &data, cl_mem buffer) {
+      cl_event ev;
+      bool first = after != NULL;
+      checkCLError(clEnqueueWriteBuffer(_transfer_queue, buffer, CL_FALSE, 0,
+                                        data.size(), data.data(),
+                                        first ? 1 : 0, after, &ev));
+      after = NULL;
+      events.push_back(ev);
+    };
+    write(block.m_idxs, slot.matrix_idxs);
+    write(block.m_vals, slot.matrix_vals);
+    for (size_t e = 0; e < block.m_extra.size(); e++) {
+      write(block.m_extra[e], slot.matrix_extra[e]);
+    }
+    clFlush(_transfer_queue);
+    return events.back();
+  }
+
+  std::chrono::nanoseconds launchKernel(Run run) {
+    start_timer(launchKernel, harness);
 
     cl_event ev;
     const size_t global_range[3] = {run.global1, run.global2, run.global3};
@@ -195,6 +523,10 @@ protected:
   }
 
   void allocateBuffers() {
+    if (!_args.blocks.empty()) {
+      allocateBlockBuffers();
+      return;
+    }
     start_timer(allocateBuffers, Harness);
     cl_uint arg_index = 0;
     // build the matrix arguments
@@ -205,11 +537,21 @@ protected:
     _mem_manager._matrix_vals = createAndUploadGlobalArg(_args.m_vals);
     setGlobalArg(arg_index++, &_mem_manager._matrix_vals);
 
+    // and any extra matrix buffers (e.g. slice pointers)
+    _mem_manager._matrix_extra.resize(_args.m_extra.size());
+    for (size_t e = 0; e < _args.m_extra.size(); e++) {
+      _mem_manager._matrix_extra[e] =
+          createAndUploadGlobalArg(_args.m_extra[e]);
+      setGlobalArg(arg_index++, &_mem_manager._matrix_extra[e]);
+    }
+
     // build the vector arguments
     LOG_DEBUG_INFO("setting vector arguments");
+    _mem_manager._input_idx = arg_index;
     _mem_manager._x_vect = createAndUploadGlobalArg(_args.x_vect, true);
     setGlobalArg(arg_index++, &_mem_manager._x_vect);
 
+    _mem_manager._y_idx = arg_index;
     _mem_manager._y_vect = createAndUploadGlobalArg(_args.y_vect, true);
     setGlobalArg(arg_index++, &_mem_manager._y_vect);
 
@@ -223,6 +565,9 @@ protected:
     _mem_manager._output_idx = arg_index;
     _mem_manager._output = createGlobalArg(_args.output);
     setGlobalArg(arg_index++, &_mem_manager._output);
+    _mem_manager._bound_x = _mem_manager._x_vect;
+    _mem_manager._bound_y = _mem_manager._y_vect;
+    _mem_manager._bound_output = _mem_manager._output;
 
     // set the temp globals and write zeros into them
     LOG_DEBUG_INFO("setting ", _args.temp_globals.size(),
@@ -244,9 +589,140 @@ protected:
 
     // set the size arguments
     LOG_DEBUG_INFO("setting size arguments");
-    for (auto size : _args.size_args) {
-      setValueArg<unsigned int>(arg_index++, &(size));
+    setSizeArgs(arg_index, _args.size_args, _args.wide_size_args);
+  }
+
+  // Allocate the whole x, y and output vectors, and the buffers of each
+  // block. Every block must fit in device memory at once - the arguments
+  // are set block by block when the kernel is launched (see setBlockArgs).
+  void allocateBlockBuffers() {
+    start_timer(allocateBlockBuffers, Harness);
+    LOG_DEBUG_INFO("allocating buffers for ", _args.blocks.size(),
+                   " blocks");
+    _mem_manager._x_vect = createAndUploadGlobalArg(_args.x_vect, true);
+    _mem_manager._y_vect = createAndUploadGlobalArg(_args.y_vect, true);
+    _mem_manager._output = createGlobalArg(_args.output);
+    _mem_manager._bound_x = _mem_manager._x_vect;
+    _mem_manager._bound_y = _mem_manager._y_vect;
+    _mem_manager._bound_output = _mem_manager._output;
+
+    // the argument indices are the same for every block
+    cl_uint extras = static_cast<cl_uint>(_args.blocks.front().m_extra.size());
+    _mem_manager._input_idx = 2 + extras;
+    _mem_manager._y_idx = _mem_manager._input_idx + 1;
+    _mem_manager._output_idx = _mem_manager._y_idx + 3;
+
+    // if the blocks don't all fit on the device, stream them through two
+    // slots, each big enough for any block
+    size_t resident_bytes =
+        _args.x_vect.size() + _args.y_vect.size() + _args.output;
+    for (auto &block : _args.blocks) {
+      resident_bytes += block.m_idxs.size() + block.m_vals.size() +
+                        block.y_vect + block.output;
+      for (auto &extra : block.m_extra) {
+        resident_bytes += extra.size();
+      }
+      for (auto size : block.temp_globals) {
+        resident_bytes += size;
+      }
     }
+    cl_ulong device_bytes = getDeviceGlobalMemSize();
+    if (resident_bytes > device_bytes && _args.blocks.size() > 2) {
+      allocateStreamingSlots();
+      LOG_WARNING("Blocks need ", resident_bytes, " bytes, but the device has ",
+                  device_bytes, ": streaming them through two slots");
+      return;
+    }
+
+    _mem_manager._blocks.resize(_args.blocks.size());
+    for (size_t b = 0; b < _args.blocks.size(); b++) {
+      auto &block = _args.blocks[b];
+      auto &buffers = _mem_manager._blocks[b];
+      buffers.matrix_idxs = createAndUploadGlobalArg(block.m_idxs);
+      buffers.matrix_vals = createAndUploadGlobalArg(block.m_vals);
+      buffers.matrix_extra.resize(block.m_extra.size());
+      for (size_t e = 0; e < block.m_extra.size(); e++) {
+        buffers.matrix_extra[e] = createAndUploadGlobalArg(block.m_extra[e]);
+      }
+      buffers.y_vect = createGlobalArg(block.y_vect);
+      fillGlobalArg(block.y_vect, buffers.y_vect);
+      buffers.output = createGlobalArg(block.output);
+      for (auto size : block.temp_globals) {
+        buffers.temp_global.push_back(createGlobalArg(size));
+        fillGlobalArg(size, buffers.temp_global.back());
+      }
+    }
+  }
+
+  // allocate two slots that can each hold any block, and the queue to upload
+  // blocks into them on
+  void allocateStreamingSlots() {
+    start_timer(allocateStreamingSlots, Harness);
+    // the largest size of each buffer, over all the blocks
+    auto &front = _args.blocks.front();
+    size_t idxs_bytes = 0;
+    size_t vals_bytes = 0;
+    std::vector<size_t> extra_bytes(front.m_extra.size(), 0);
+    size_t y_bytes = 0;
+    size_t output_bytes = 0;
+    std::vector<size_t> temp_bytes(front.temp_globals.size(), 0);
+    for (auto &block : _args.blocks) {
+      idxs_bytes = std::max(idxs_bytes, block.m_idxs.size());
+      vals_bytes = std::max(vals_bytes, block.m_vals.size());
+      for (size_t e = 0; e < extra_bytes.size(); e++) {
+        extra_bytes[e] = std::max(extra_bytes[e], block.m_extra[e].size());
+      }
+      y_bytes = std::max(y_bytes, block.y_vect);
+      output_bytes = std::max(output_bytes, block.output);
+      for (size_t t = 0; t < temp_bytes.size(); t++) {
+        temp_bytes[t] = std::max(temp_bytes[t], block.temp_globals[t]);
+      }
+    }
+
+    _mem_manager._streaming = true;
+    _mem_manager._blocks.resize(2);
+    for (auto &slot : _mem_manager._blocks) {
+      slot.matrix_idxs = createGlobalArg(idxs_bytes);
+      slot.matrix_vals = createGlobalArg(vals_bytes);
+      for (auto size : extra_bytes) {
+        slot.matrix_extra.push_back(createGlobalArg(size));
+      }
+      slot.y_vect = createGlobalArg(y_bytes);
+      slot.output = createGlobalArg(output_bytes);
+      for (auto size : temp_bytes) {
+        slot.temp_global.push_back(createGlobalArg(size));
+      }
+    }
+
+    _transfer_queue = clCreateCommandQueue(_context, _deviceIds[_device],
+                                           CL_QUEUE_PROFILING_ENABLE, &_error);
+    checkCLError(_error);
+  }
+
+  // set the kernel arguments for a block (in some buffers on the device),
+  // reading from the bound x vector
+  void setBlockArgs(
+      size_t b, typename CLMemoryManager<SemiRingType>::BlockBuffers &buffers) {
+    start_timer(setBlockArgs, Harness);
+    auto &block = _args.blocks[b];
+    cl_uint arg_index = 0;
+    setGlobalArg(arg_index++, &buffers.matrix_idxs);
+    setGlobalArg(arg_index++, &buffers.matrix_vals);
+    for (auto &extra : buffers.matrix_extra) {
+      setGlobalArg(arg_index++, &extra);
+    }
+    setGlobalArg(arg_index++, &_mem_manager._bound_x);
+    setGlobalArg(arg_index++, &buffers.y_vect);
+    setValueArg<SemiRingType>(arg_index++, &(_args.alpha));
+    setValueArg<SemiRingType>(arg_index++, &(_args.beta));
+    setGlobalArg(arg_index++, &buffers.output);
+    for (auto &temp : buffers.temp_global) {
+      setGlobalArg(arg_index++, &temp);
+    }
+    for (auto size : block.temp_locals) {
+      setLocalArg(arg_index++, size);
+    }
+    setSizeArgs(arg_index, block.size_args, block.wide_size_args);
   }
 
   void resetPointers() {}
@@ -261,9 +737,19 @@ protected:
       fillGlobalArg(_args.temp_globals[temp_index], arg);
       temp_index++;
     }
+    // (streamed blocks are zeroed as they're launched)
+    for (size_t b = 0; b < _args.blocks.size() && !_mem_manager._streaming;
+         b++) {
+      auto &sizes = _args.blocks[b].temp_globals;
+      auto &buffers = _mem_manager._blocks[b].temp_global;
+      for (size_t t = 0; t < buffers.size(); t++) {
+        fillGlobalArg(sizes[t], buffers[t]);
+      }
+    }
   }
 
-  cl_mem createAndUploadGlobalArg(std::vector<char> &arg, bool output = false) {
+  template <typename Buffer>
+  cl_mem createAndUploadGlobalArg(Buffer &arg, bool output = false) {
     start_timer(createAndUploadGlobalArg, harness);
     // get a pointer to the underlying arg:
     char *data = arg.data();
@@ -297,7 +783,7 @@ protected:
     return buffer;
   }
 
-  void writeToGlobalArg(std::vector<char> &arg, cl_mem buffer) {
+  template <typename Buffer> void writeToGlobalArg(Buffer &arg, cl_mem buffer) {
     start_timer(writeToGlobalArg, harness);
     // get a pointer to the underlying arg:
     char *data = arg.data();
@@ -325,6 +811,58 @@ protected:
     report_timing(clEnqueueWriteBuffer, writeToGlobalArg, end - start);
   }
 
+  // write len bytes into a buffer, starting at a byte offset
+  void writeToGlobalArgAt(const char *data, size_t len, size_t offset,
+                          cl_mem buffer) {
+    start_timer(writeToGlobalArgAt, harness);
+    LOG_DEBUG_INFO("uploading ", len, " bytes at offset ", offset);
+
+    cl_event ev;
+    checkCLError(clEnqueueWriteBuffer(_queue, buffer, CL_TRUE, offset, len,
+                                      data, 0, NULL, &ev));
+
+    clWaitForEvents(1, &ev);
+
+    // find how long the copy took.
+    cl_ulong start;
+    cl_ulong end;
+    checkCLError(clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+                                         sizeof(cl_ulong), (void *)&start,
+                                         NULL));
+    checkCLError(clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+                                         sizeof(cl_ulong), (void *)&end, NULL));
+
+    report_timing(clEnqueueWriteBuffer, writeToGlobalArgAt, end - start);
+  }
+
+  // copy len bytes between two buffers on the device
+  void copyGlobalArg(cl_mem src, cl_mem dst, size_t src_offset,
+                     size_t dst_offset, size_t len) {
+    start_timer(copyGlobalArg, harness);
+    LOG_DEBUG_INFO("copying ", len, " bytes from offset ", src_offset,
+                   " to offset ", dst_offset);
+    if (len == 0) {
+      return;
+    }
+
+    cl_event ev;
+    checkCLError(clEnqueueCopyBuffer(_queue, src, dst, src_offset, dst_offset,
+                                     len, 0, NULL, &ev));
+
+    clWaitForEvents(1, &ev);
+
+    // find how long the copy took.
+    cl_ulong start;
+    cl_ulong end;
+    checkCLError(clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START,
+                                         sizeof(cl_ulong), (void *)&start,
+                                         NULL));
+    checkCLError(clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END,
+                                         sizeof(cl_ulong), (void *)&end, NULL));
+
+    report_timing(clEnqueueCopyBuffer, copyGlobalArg, end - start);
+  }
+
   // NOTE - THIS DEPENDS ON OpenCL 1.2 functionality and therefore may not
   // work on some NVIDIA platforms. See problems such as this:
   // https://stackoverflow.com/questions/32145522/compiling-opencl-1-2-codes-on-nvidia-gpus
@@ -353,6 +891,16 @@ protected:
     report_timing(clEnqueueFillBuffer, fillGlobalArg, end - start);
   }
 
+  // fill the (bound) output with a value, for a kernel to accumulate into
+  // (this also needs clEnqueueFillBuffer, from OpenCL 1.2 - see above)
+  void fillOutput(SemiRingType value) {
+    start_timer(fillOutput, harness);
+    checkCLError(clEnqueueFillBuffer(_queue, _mem_manager._bound_output,
+                                     &value, sizeof(SemiRingType), 0,
+                                     _args.output, 0, NULL, NULL));
+    clFinish(_queue);
+  }
+
   void readFromGlobalArg(std::vector<char> &arg, cl_mem buffer) {
     start_timer(readFromGlobalArg, harness);
     // get a pointer to the underlying arg:
@@ -379,12 +927,12 @@ protected:
     report_timing(clEnqueueReadBuffer, readFromGlobalArg, end - start);
   }
 
-  cl_mem createGlobalArg(unsigned int size) {
+  cl_mem createGlobalArg(size_t size) {
     start_timer(createGlobalArg, harness);
     LOG_DEBUG_INFO("creating global arg of size ", size);
 
-    cl_mem buffer = clCreateBuffer(_context, CL_MEM_READ_WRITE, (size_t)size,
-                                   NULL, &_error);
+    cl_mem buffer =
+        clCreateBuffer(_context, CL_MEM_READ_WRITE, size, NULL, &_error);
     checkCLError(_error);
 
     return buffer;
@@ -403,6 +951,21 @@ protected:
     checkCLError(clSetKernelArg(_kernel, arg, sizeof(ValueType), val));
   }
 
+  // set the size args from arg_index on - as longs for kernels with 64 bit
+  // indices, and as ints otherwise (setSizedArgs checks that they fit)
+  void setSizeArgs(cl_uint &arg_index, const std::vector<int64_t> &sizes,
+                   bool wide) {
+    for (auto size : sizes) {
+      if (wide) {
+        cl_long value = static_cast<cl_long>(size);
+        setValueArg<cl_long>(arg_index++, &value);
+      } else {
+        cl_int value = static_cast<cl_int>(size);
+        setValueArg<cl_int>(arg_index++, &value);
+      }
+    }
+  }
+
   void setLocalArg(cl_uint arg, size_t size) {
     start_timer(setLocalArg, harness);
     LOG_DEBUG_INFO("setting local arg of size ", size);
@@ -417,6 +980,9 @@ protected:
   cl_uint _deviceIdCount;
   cl_uint _device;
   cl_command_queue _queue;
+  // blocks of the matrix are uploaded on this queue while the kernel runs, if
+  // they're streamed (and null if they aren't)
+  cl_command_queue _transfer_queue = nullptr;
 
   cl_device_id _device_id;
   std::vector<cl_device_id> _deviceIds;
@@ -433,6 +999,8 @@ protected:
   unsigned int _trials;
   std::chrono::milliseconds _timeout;
   double _delta;
+  ValueAccuracy _accuracy;
+  std::vector<double> _error_bounds;
 };
 
 // template <typename T> class IterativeHarness : public
@@ -456,45 +1024,37 @@ protected:
     start_timer(allocateBuffers, Harness);
     // build the matrix arguments
     LOG_DEBUG_INFO("setting matrix arguments");
-    // _mem_manager._matrix_idxs = createAndUploadGlobalArg(_args.m_idxs);
-    // setGlobalArg(arg_index++, &_mem_manager._matrix_idxs);
-    this->writeToGlobalArg(this->_args.m_idxs, this->_mem_manager._matrix_idxs);
-
-    // this->_mem_manager._matrix_vals =
-    // createAndUploadGlobalArg(Harness<TimingType,
-    // SemiRingType>::_args.m_vals);
-    // setGlobalArg(arg_index++, &Harness<TimingType,
-    // SemiRingType>::_mem_manager._matrix_vals);
-    this->writeToGlobalArg(this->_args.m_vals, this->_mem_manager._matrix_vals);
+    if (this->_args.blocks.empty()) {
+      this->writeToGlobalArg(this->_args.m_idxs,
+                             this->_mem_manager._matrix_idxs);
+      this->writeToGlobalArg(this->_args.m_vals,
+                             this->_mem_manager._matrix_vals);
+      for (size_t e = 0; e < this->_args.m_extra.size(); e++) {
+        this->writeToGlobalArg(this->_args.m_extra[e],
+                               this->_mem_manager._matrix_extra[e]);
+      }
+    }
+    // (streamed blocks are uploaded as they're launched)
+    for (size_t b = 0;
+         b < this->_args.blocks.size() && !this->_mem_manager._streaming; b++) {
+      auto &block = this->_args.blocks[b];
+      auto &buffers = this->_mem_manager._blocks[b];
+      this->writeToGlobalArg(block.m_idxs, buffers.matrix_idxs);
+      this->writeToGlobalArg(block.m_vals, buffers.matrix_vals);
+      for (size_t e = 0; e < block.m_extra.size(); e++) {
+        this->writeToGlobalArg(block.m_extra[e], buffers.matrix_extra[e]);
+      }
+    }
 
     // build the vector arguments
     LOG_DEBUG_INFO("setting vector arguments");
-    // this->_mem_manager._x_vect =
-    // createAndUploadGlobalArg(Harness<TimingType,
-    // SemiRingType>::_args.x_vect, true);
-    this->setGlobalArg(2, &this->_mem_manager._x_vect);
+    this->bindVectors(&this->_mem_manager._x_vect, &this->_mem_manager._y_vect,
+                      &this->_mem_manager._output);
     this->writeToGlobalArg(this->_args.x_vect, this->_mem_manager._x_vect);
-
-    // this->_mem_manager._y_vect =
-    // createAndUploadGlobalArg(Harness<TimingType,
-    // SemiRingType>::_args.y_vect, true);
-    this->setGlobalArg(3, &this->_mem_manager._y_vect);
     this->writeToGlobalArg(this->_args.y_vect, this->_mem_manager._y_vect);
 
-    // build the constant arguments
-    // LOG_DEBUG_INFO("setting constant arguments");
-    // setValueArg<float>(arg_index++, &(Harness<TimingType,
-    // SemiRingType>::_args.alpha));
-    // setValueArg<float>(arg_index++, &(Harness<TimingType,
-    // SemiRingType>::_args.beta));
-
     // set the output arg
     LOG_DEBUG_INFO("setting the output argument");
-    // this->_mem_manager._output_idx = arg_index;
-    // this->_mem_manager._output =
-    // createGlobalArg(Harness<TimingType,
-    // SemiRingType>::_args.output);
-    this->setGlobalArg(6, &this->_mem_manager._output);
     this->fillGlobalArg(this->_args.output, this->_mem_manager._output);
 
     this->resetTempBuffers();
@@ -22,13 +22,56 @@ public:
   KernelProperties(std::string kname);
   KernelProperties(std::string outerMap, std::string innerMap,
                    std::string innerMap2, std::string arrayType, int splitSize,
-                   int chunkSize);
+                   int chunkSize, int indexBits);
   std::string outerMap;
   std::string innerMap;
   std::string innerMap2;
   std::string arrayType;
   int splitSize;
   int chunkSize;
+  // width of the matrix indices (and RSA offsets) the kernel expects. Kernels
+  // with 64 bit indices also take their size args as longs, not ints.
+  int indexBits = 32;
+  // the layout of a padded ELLPACK matrix: "row" (major), "column" (major),
+  // or "interleaved" (column major within chunks of chunkSize rows)
+  std::string layout = "row";
+  // for "sliced" (SELL-C-sigma) kernels: the number of rows in a slice (C),
+  // and the window of rows that are sorted by length (sigma)
+  int sliceHeight = 32;
+  int sortWindow = 256;
+  // for "hybrid" (ELL + COO) kernels: the fraction of the non-zeros that the
+  // ELL part should hold, or a fixed ELL width (if not -1). The rest spill
+  // into a COO tail.
+  double hybridCoverage = 0.95;
+  int hybridWidth = -1;
+  // for "segmented" kernels: the number of columns in each segment. If -1,
+  // it's chosen when the harness starts (see chooseSegmentWidth).
+  int segmentWidth = -1;
+  // for "dia" kernels: the fraction of the non-zeros that the stored
+  // diagonals should hold (densest diagonals first), or -1 to store the
+  // diagonals that are full enough to be worth it. The rest spill into a
+  // COO tail.
+  double diagonalCoverage = -1;
+  // for "bcsr" kernels: the rows and columns of each dense block. If -1,
+  // they're chosen when the harness starts (see chooseBlockSize).
+  int blockRows = -1;
+  int blockCols = -1;
+  // whether the kernel takes just the lower triangle of a symmetric matrix
+  // (see SparseMatrix::half_stored), adding each entry off the diagonal into
+  // both its row and its column of the output. The output is reset to the
+  // semiring zero before each launch, for the kernel to accumulate into.
+  bool symmetric = false;
+  // how the matrix values are stored: "plain", "dictionary" (codeBits wide
+  // codes into a "valueDict" buffer of the distinct values), "pattern"
+  // (a single value for every entry), or rounded to "half" or "bfloat16" -
+  // see ValueEncoding
+  std::string valueEncoding = "plain";
+  int codeBits = 8;
+  // the type of the values (and vectors) the kernel computes with, e.g.
+  // "float" or "double", which the harness must be built for (see
+  // ValueType) - if unset, float on a floating point harness (see
+  // kernelValueType)
+  std::string valueType = "";
 
 private:
   std::string argcache;
@@ -49,8 +92,15 @@ public:
   std::vector<ArgDescr> getTempGlobals();
   std::vector<ArgDescr> getTempLocals();
   std::vector<std::string> getParamVars();
+  // names of any extra matrix buffers (e.g. slice pointers) the kernel takes,
+  // in order - these come straight after the indices and values
+  std::vector<std::string> getExtraMatrixArgs();
   ArgDescr *getOutputArg();
   KernelProperties getProperties();
+  // fix the segment width of a "segmented" kernel
+  void setSegmentWidth(int columns);
+  // fix the block size of a "bcsr" kernel
+  void setBlockSize(int rows, int cols);
 
 private:
   std::string source;
@@ -59,6 +109,7 @@ private:
   std::vector<ArgDescr> tempGlobals;
   std::vector<ArgDescr> tempLocals;
   std::vector<std::string> paramVars;
+  std::vector<std::string> extraMatrixArgs;
   ArgDescr *outputArg;
   KernelProperties kprops;
 };
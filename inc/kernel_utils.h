@@ -1,13 +1,17 @@
 #pragma once
 
+#include <cstdint>
 #include <functional>
+#include <limits>
 #include <map>
+#include <type_traits>
 
 #include "Logger.h"
 #include "arithexpr_evaluator.h"
 #include "buffer_utils.h"
 #include "common.h"
 #include "csds_timer.h"
+#include "encoding_footprint.h"
 #include "kernel_config.h"
 #include "sparse_matrix.h"
 #include "vector_generator.h"
@@ -15,100 +19,611 @@
 
 typedef std::vector<char> raw_arg;
 
+// The arguments for a block of rows of a matrix that is too big for a single
+// allocation: the block's own encoded matrix, and the sizes of the buffers
+// (and size args) that depend on it.
+template <typename T> class MatrixBlock {
+public:
+  // the rows of the whole matrix in this block
+  size_t row_begin = 0;
+  size_t rows = 0;
+  raw_buffer m_idxs;
+  raw_buffer m_vals;
+  std::vector<raw_buffer> m_extra;
+  std::vector<int> output_perm;
+  // sizes ready for allocation - the block's slice of the y vector, and its
+  // output, are separate buffers, which are copied from/to the whole vectors
+  size_t y_vect;
+  std::vector<size_t> temp_globals;
+  size_t output;
+  std::vector<size_t> temp_locals;
+  std::vector<int64_t> size_args;
+  bool wide_size_args = false;
+};
+
 template <typename T> class ArgContainer {
 public:
-  raw_arg m_idxs;
-  raw_arg m_vals;
+  raw_buffer m_idxs;
+  raw_buffer m_vals;
+  // any extra matrix buffers, in the order the kernel takes them
+  std::vector<raw_buffer> m_extra;
+  // if the encoding permutes the rows, the original row of each row of the
+  // output (empty if it doesn't)
+  std::vector<int> output_perm;
+  // whether the encoding only holds the rows with entries (DCSR) - the
+  // output then only has those rows, in the order of output_perm
+  bool compact_rows = false;
+  // whether the kernel accumulates into the output (symmetric kernels add
+  // each entry into two rows), which must then start from the semiring zero
+  bool accumulate_output = false;
+  T zero;
+  // the precision of the matrix values on the device (e.g. "float", or
+  // "half/float" for half values accumulated in float), and the relative
+  // error of rounding them to it (see value_rounding)
+  std::string precision = ValueType<T>::name();
+  double rounding = 0.0;
+  // if the matrix was reordered before encoding, the original row (and
+  // column) of each row - the vectors on the device are in the new order
+  std::vector<int> reorder;
   raw_arg x_vect;
   raw_arg y_vect;
   T alpha;
   T beta;
   // the rest are just sizes ready for allocation!
-  std::vector<unsigned int> temp_globals;
-  unsigned int output;
-  std::vector<unsigned int> temp_locals;
-  std::vector<unsigned int> size_args;
+  std::vector<size_t> temp_globals;
+  size_t output;
+  std::vector<size_t> temp_locals;
+  // the size args, and whether the kernel takes them as longs (kernels with
+  // 64 bit indices) rather than ints (see setSizedArgs)
+  std::vector<int64_t> size_args;
+  bool wide_size_args = false;
+  // If the matrix didn't fit in a single allocation, it's split into blocks
+  // of rows, and the kernel is run once per block. The matrix buffers, and
+  // sizes, above are then unused, and the vectors (and output) are those of
+  // the whole matrix.
+  std::vector<MatrixBlock<T>> blocks;
 };
 
-// given a loaded sparse matrix, encode it in a form that we can use in the
-// executor - i.e. as a set of kernel arguments
+// encode the structure of a matrix in the form a kernel expects
 template <typename T>
-ArgContainer<T>
-executorEncodeMatrix(unsigned int device_max_alloc_bytes,
-                     KernelConfig<T> kernel, SparseMatrix<T> matrix, T zero,
-                     // std::vector<T> xvector, std::vector<T> yvector) {
-                     XVectorGenerator<T> &xgen, YVectorGenerator<T> &ygen,
-                     // int v_MWidth_1, int v_MHeight_2, int v_VLength_3,
-                     T alpha = static_cast<T>(1), T beta = static_cast<T>(1)) {
-  start_timer(executorEncodeMatrix, kernel_utils);
-  // get the configuration patterns of the kernel
-  auto kprops = kernel.getProperties();
-
-  auto cl_matrix = matrix.cl_encode(
+CL_matrix encodeStructure(size_t device_max_alloc_bytes,
+                          KernelProperties &kprops, SparseMatrix<T> &matrix,
+                          T zero) {
+  auto layout = parse_ell_layout(kprops.layout);
+  if (kprops.arrayType == "sliced") {
+    return matrix.cl_encode_sliced(
+        device_max_alloc_bytes, // the maximum size of a byte buffer
+        zero,                   // the semiring zero value
+        kprops.sliceHeight,     // the rows in each slice
+        kprops.sortWindow,      // the window of rows to sort
+        kprops.indexBits        // the width of the indices
+    );
+  }
+  if (kprops.arrayType == "csr") {
+    return matrix.cl_encode_csr(
+        device_max_alloc_bytes, // the maximum size of a byte buffer
+        kprops.indexBits        // the width of the indices
+    );
+  }
+  if (kprops.arrayType == "dcsr") {
+    return matrix.cl_encode_dcsr(
+        device_max_alloc_bytes, // the maximum size of a byte buffer
+        kprops.indexBits        // the width of the indices
+    );
+  }
+  if (kprops.arrayType == "delta") {
+    return matrix.cl_encode_delta(
+        device_max_alloc_bytes, // the maximum size of a byte buffer
+        kprops.indexBits        // the width of the row pointers
+    );
+  }
+  if (kprops.arrayType == "segmented") {
+    return matrix.cl_encode_segmented(
+        device_max_alloc_bytes, // the maximum size of a byte buffer
+        zero,                   // the semiring zero value
+        kprops.segmentWidth,    // the columns in each segment
+        kprops.chunkSize != -1, // whether to chunk the input
+        kprops.chunkSize,       // the chunk size
+        kprops.indexBits        // the width of the indices
+    );
+  }
+  if (kprops.arrayType == "dia") {
+    return matrix.cl_encode_dia(
+        device_max_alloc_bytes,  // the maximum size of a byte buffer
+        zero,                    // the semiring zero value
+        kprops.diagonalCoverage, // the non-zeros the diagonals should hold
+        kprops.chunkSize != -1,  // whether to chunk the input
+        kprops.chunkSize,        // the chunk size
+        kprops.indexBits         // the width of the COO tail indices
+    );
+  }
+  if (kprops.arrayType == "bcsr") {
+    return matrix.cl_encode_bcsr(
+        device_max_alloc_bytes, // the maximum size of a byte buffer
+        zero,                   // the semiring zero value
+        kprops.blockRows,       // the rows in each block
+        kprops.blockCols,       // the columns in each block
+        kprops.indexBits        // the width of the indices
+    );
+  }
+  if (kprops.arrayType == "hybrid") {
+    // a fixed ELL width, or one that covers enough of the non-zeros
+    int ell_width = kprops.hybridWidth != -1
+                        ? kprops.hybridWidth
+                        : matrix.hybrid_width(kprops.hybridCoverage);
+    return matrix.cl_encode_hybrid(
+        device_max_alloc_bytes, // the maximum size of a byte buffer
+        zero,                   // the semiring zero value
+        kprops.chunkSize != -1, // whether to chunk the input
+        kprops.splitSize != -1, // whether to split rows into even chunks
+        kprops.chunkSize,       // the chunk size
+        kprops.splitSize,       // the split size
+        ell_width,              // the width of the ELL part
+        kprops.indexBits,       // the width of the indices
+        layout                  // the layout of the ELL part
+    );
+  }
+  return matrix.cl_encode(
       device_max_alloc_bytes,       // the maximum size of a byte buffer
       zero,                         // the semiring zero value
       kprops.chunkSize != -1,       // whether to chunk the input
       kprops.splitSize != -1,       // whether to split rows into even chunks
       kprops.arrayType == "ragged", // whether to encode the array "raggedly"
       kprops.chunkSize,             // the chunk size
-      kprops.splitSize              // the split size
+      kprops.splitSize,             // the split size
+      kprops.indexBits,             // the width of the indices
+      layout                        // the layout of the padded matrix
   );
+}
+
+// The type of the values a kernel computes with: its valueType, if it says.
+// Kernels that don't are taken to compute with float on a floating point
+// harness (as every kernel did before double harnesses), and with the
+// harness's own type otherwise (e.g. the int and bool graph kernels).
+template <typename T>
+std::string kernelValueType(const KernelProperties &kprops) {
+  if (!kprops.valueType.empty()) {
+    return kprops.valueType;
+  }
+  return std::is_floating_point<T>::value ? ValueType<float>::name()
+                                          : ValueType<T>::name();
+}
+
+// encode a matrix in the form a kernel expects - its structure, then its
+// values (see ValueEncoding)
+template <typename T>
+CL_matrix encodeForKernel(size_t device_max_alloc_bytes,
+                          KernelProperties &kprops, SparseMatrix<T> &matrix,
+                          T zero) {
+  auto value_encoding = parse_value_encoding(kprops.valueEncoding);
+  if (value_encoding != ValueEncoding::PLAIN && kprops.arrayType == "ragged") {
+    std::cerr << "The " << value_encoding_name(value_encoding)
+              << " value encoding needs a value per element, which a ragged "
+                 "matrix doesn't have"
+              << ENDL;
+    exit(-1);
+  }
+  // the padding of a DIA (or BCSR) matrix is only marked by its zero values
+  if (value_encoding == ValueEncoding::PATTERN &&
+      (kprops.arrayType == "dia" || kprops.arrayType == "bcsr")) {
+    std::cerr << "The pattern value encoding can't mark the padding of a "
+              << kprops.arrayType << " matrix" << ENDL;
+    exit(-1);
+  }
+  CL_matrix cl_matrix =
+      encodeStructure(device_max_alloc_bytes, kprops, matrix, zero);
+  matrix.compress_values(cl_matrix, zero, value_encoding, kprops.codeBits);
+  return cl_matrix;
+}
 
+// every size that argument sizes, and size args, can refer to, for a matrix
+// (or block) encoded with the given shape - v_VLength_3 is the length of the
+// x vector, and v_RowOffset_8 the first row of the block
+template <typename T>
+Evaluator::SizeMap shapeSizes(KernelProperties &kprops,
+                              SparseMatrix<T> &matrix, long cl_width,
+                              long cl_height, long v_VLength_3,
+                              long v_RowOffset_8, long v_CooLength_5,
+                              long v_DictLength_11, long v_EscapeLength_12,
+                              long v_SegmentRows_15 = 0) {
   auto v_MWidth_1 = kprops.arrayType == "ragged"
                         ? matrix.width()
-                        : cl_matrix.cl_width / abs(kprops.splitSize);
+                        : cl_width / abs(kprops.splitSize);
   // change it if we're ragged
   // auto v_MHeight_2 = (int)(cl_matrix.cl_height / kprops.chunkSize);
   // auto v_MHeight_2 =
   // kprops.arrayType == "ragged" ? matrix.height() : cl_matrix.cl_height;
-  auto v_MHeight_2 = cl_matrix.cl_height;
-  auto v_VLength_3 = cl_matrix.cl_height;
+  auto v_MHeight_2 = cl_height;
+
+  // the number of stored entries, and of row pointers (for CSR kernels -
+  // DCSR only has pointers to the non-empty rows)
+  long v_Nnz_6 = matrix.entries();
+  long v_RowPtrLength_7 =
+      (kprops.arrayType == "dcsr" ? cl_height : matrix.height()) + 1;
+
+  // the column segments (for segmented kernels)
+  long v_SegmentWidth_9 = kprops.segmentWidth > 0 ? kprops.segmentWidth : 0;
+  long v_SegmentCount_10 =
+      v_SegmentWidth_9 > 0
+          ? std::max(1L, (matrix.width() + v_SegmentWidth_9 - 1) /
+                             v_SegmentWidth_9)
+          : 1;
+  // (and the rows of all the segments, counting a row once for each segment
+  // it has entries in)
+
+  // the block size (for BCSR kernels - otherwise every element is a block)
+  long v_BlockRows_13 = kprops.blockRows > 0 ? kprops.blockRows : 1;
+  long v_BlockCols_14 = kprops.blockCols > 0 ? kprops.blockCols : 1;
+
+  return Evaluator::SizeMap{
+      {"MWidthC", v_MWidth_1},
+      {"MHeight", v_MHeight_2},
+      {"VLength", v_VLength_3},
+      {"SliceHeight", kprops.sliceHeight},
+      {"CooLength", v_CooLength_5},
+      {"Nnz", v_Nnz_6},
+      {"RowPtrLength", v_RowPtrLength_7},
+      {"RowOffset", v_RowOffset_8},
+      {"SegmentWidth", v_SegmentWidth_9},
+      {"SegmentCount", v_SegmentCount_10},
+      {"DictLength", v_DictLength_11},
+      {"EscapeLength", v_EscapeLength_12},
+      {"BlockRows", v_BlockRows_13},
+      {"BlockCols", v_BlockCols_14},
+      {"SegmentRows", v_SegmentRows_15},
+  };
+}
+
+// every size that argument sizes, and size args, can refer to, for an
+// encoded matrix (or block) - v_VLength_3 is the length of the x vector,
+// and v_RowOffset_8 the first row of the block
+template <typename T>
+Evaluator::SizeMap kernelSizes(KernelProperties &kprops,
+                               SparseMatrix<T> &matrix, CL_matrix &cl_matrix,
+                               long v_VLength_3, long v_RowOffset_8 = 0) {
+  // the length of the COO tail of a hybrid matrix
+  auto coo_vals = cl_matrix.extras.find("cooVals");
+  long v_CooLength_5 = coo_vals == cl_matrix.extras.end()
+                           ? 0
+                           : coo_vals->second.size() / sizeof(T);
+
+  // the distinct values (for dictionary encoded values)
+  auto value_dict = cl_matrix.extras.find("valueDict");
+  long v_DictLength_11 = value_dict == cl_matrix.extras.end()
+                             ? 0
+                             : value_dict->second.size() / sizeof(T);
+
+  // the escaped columns (for delta encoded indices)
+  auto escape_cols = cl_matrix.extras.find("escapeCols");
+  long v_EscapeLength_12 = escape_cols == cl_matrix.extras.end()
+                               ? 0
+                               : escape_cols->second.size() / sizeof(int);
+
+  // the rows of the column segments (for segmented kernels)
+  auto segment_rows = cl_matrix.extras.find("segmentRows");
+  long v_SegmentRows_15 = segment_rows == cl_matrix.extras.end()
+                              ? 0
+                              : segment_rows->second.size() / sizeof(int);
+
+  auto sizes = shapeSizes(kprops, matrix, cl_matrix.cl_width,
+                          cl_matrix.cl_height, v_VLength_3, v_RowOffset_8,
+                          v_CooLength_5, v_DictLength_11, v_EscapeLength_12,
+                          v_SegmentRows_15);
 
   std::cerr << "Encoding matrix with sizes:"
-            << "\n\tv_MWidth_1 = " << v_MWidth_1
-            << "\n\tv_MHeight_2 = " << v_MHeight_2
-            << "\n\tv_VLength_3 = " << v_VLength_3 << "\n";
+            << "\n\tv_MWidth_1 = " << sizes["MWidthC"]
+            << "\n\tv_MHeight_2 = " << sizes["MHeight"]
+            << "\n\tv_VLength_3 = " << sizes["VLength"]
+            << "\n\tv_CooLength_5 = " << sizes["CooLength"]
+            << "\n\tv_Nnz_6 = " << sizes["Nnz"]
+            << "\n\tv_RowPtrLength_7 = " << sizes["RowPtrLength"]
+            << "\n\tv_RowOffset_8 = " << sizes["RowOffset"]
+            << "\n\tv_SegmentWidth_9 = " << sizes["SegmentWidth"]
+            << "\n\tv_SegmentCount_10 = " << sizes["SegmentCount"]
+            << "\n\tv_DictLength_11 = " << sizes["DictLength"]
+            << "\n\tv_EscapeLength_12 = " << sizes["EscapeLength"]
+            << "\n\tv_BlockRows_13 = " << sizes["BlockRows"]
+            << "\n\tv_BlockCols_14 = " << sizes["BlockCols"]
+            << "\n\tv_SegmentRows_15 = " << sizes["SegmentRows"] << "\n";
+  return sizes;
+}
 
-  // generate the vector inputs
-  std::cerr << "Filling with these sizes: \n\tx = " << matrix.height()
-            << " \n\ty = " << cl_matrix.cl_height << ENDL;
-  std::vector<T> xvector = xgen.generate(v_VLength_3);
-  std::vector<T> yvector = ygen.generate(v_VLength_3);
+// Predict the footprint of a matrix encoded for a kernel (see
+// EncodingFootprint) from its row lengths, following the padding rules of
+// each encoding, without building the encoding. Segmented, delta, DIA and
+// BCSR encoded matrices also need the columns of each row - to find the
+// rows of each segment, the gaps that need escapes, the entries off
+// the stored diagonals, and the occupied blocks - but nothing is allocated
+// per element. The size of a value dictionary isn't known without counting
+// the distinct values, so we assume it's full.
+template <typename T>
+EncodingFootprint predictFootprint(KernelConfig<T> &kernel,
+                                   SparseMatrix<T> &matrix) {
+  start_timer(predictFootprint, kernel_utils);
+  auto kprops = kernel.getProperties();
+  auto rows = matrix.ellpack_encode();
+  const size_t h = rows.size();
+  size_t max_row = 0;
+  for (size_t r = 0; r < h; r++) {
+    max_row = std::max(max_row, rows[r].size());
+  }
+  const size_t index_size =
+      kprops.indexBits == 64 ? sizeof(int64_t) : sizeof(int);
+  // cl_encode pads to the next multiple of the chunk (or split) size - which
+  // is a whole extra chunk, if the length is a multiple already
+  auto pad = [](size_t length, int modulo) {
+    return modulo == -1 ? length
+                        : length + (modulo - length % static_cast<size_t>(
+                                                   modulo));
+  };
 
-  // ---- CREATE THE ACTUAL ARGS ----
-  // Args must be in this order:
-  //  1) inputs (globals + values)
-  //  2) temporary/intermediate global values
-  //  3) output buffer
-  //  4) temporary locals
-  //  5) size args
+  EncodingFootprint footprint;
+  footprint.entries = matrix.entries();
+  footprint.full_entries = matrix.full_entries();
+  auto &buffers = footprint.buffers;
+  long coo_length = 0;
+  long escape_length = 0;
+  long segment_rows = 0;
+  if (kprops.arrayType == "sliced") {
+    const size_t c = static_cast<size_t>(kprops.sliceHeight);
+    const size_t slices = (h + c - 1) / c;
+    footprint.elements =
+        matrix.sliced_elements(kprops.sliceHeight, kprops.sortWindow);
+    footprint.cl_width = static_cast<long>(max_row);
+    footprint.cl_height = static_cast<long>(slices * c);
+    buffers["slicePtr"] = (slices + 1) * index_size;
+    buffers["rowPerm"] = slices * c * sizeof(int);
+  } else if (kprops.arrayType == "dcsr") {
+    size_t nonempty = 0;
+    for (size_t r = 0; r < h; r++) {
+      nonempty += rows[r].size() > 0 ? 1 : 0;
+    }
+    footprint.elements = footprint.entries;
+    footprint.cl_width = static_cast<long>(max_row);
+    footprint.cl_height = static_cast<long>(nonempty);
+    buffers["rowPtr"] = (nonempty + 1) * index_size;
+    buffers["rowIds"] = nonempty * sizeof(int);
+  } else if (kprops.arrayType == "csr" || kprops.arrayType == "delta") {
+    footprint.elements = footprint.entries;
+    footprint.cl_width = static_cast<long>(max_row);
+    footprint.cl_height = static_cast<long>(h);
+    buffers["rowPtr"] = (h + 1) * index_size;
+    if (kprops.arrayType == "delta") {
+      escape_length = static_cast<long>(matrix.delta_escapes()[h]);
+      buffers["escapePtr"] = (h + 1) * index_size;
+      buffers["rowBase"] = h * sizeof(int);
+      buffers["escapeCols"] = escape_length * sizeof(int);
+    }
+  } else if (kprops.arrayType == "segmented") {
+    auto segments = matrix.segment_rows(kprops.segmentWidth);
+    const size_t m =
+        kprops.chunkSize != -1 ? static_cast<size_t>(kprops.chunkSize) : 1;
+    const size_t padded_height = ((h + m - 1) / m) * m;
+    segment_rows = std::accumulate(segments.begin(), segments.end(), (size_t)0);
+    footprint.elements = footprint.entries;
+    footprint.cl_width = static_cast<long>(max_row);
+    footprint.cl_height = static_cast<long>(padded_height);
+    buffers["segmentPtr"] = (segments.size() + 1) * index_size;
+    buffers["segmentRows"] = segment_rows * sizeof(int);
+    buffers["segmentRowPtr"] = (segment_rows + 1) * index_size;
+  } else if (kprops.arrayType == "dia") {
+    // the entries off the stored diagonals (or duplicating an entry on them)
+    // go into the COO tail
+    auto offsets = matrix.dia_offsets(kprops.diagonalCoverage);
+    std::vector<char> kept(h + matrix.width(), 0);
+    for (auto offset : offsets) {
+      kept[offset + (h - 1)] = 1;
+    }
+    size_t tail = 0;
+    for (size_t r = 0; r < h; r++) {
+      auto row = rows[r];
+      for (size_t j = 0; j < row.size(); j++) {
+        if ((j > 0 && row[j].first == row[j - 1].first) ||
+            !kept[row[j].first + (h - 1) - r]) {
+          tail++;
+        }
+      }
+    }
+    const size_t m =
+        kprops.chunkSize != -1 ? static_cast<size_t>(kprops.chunkSize) : 1;
+    footprint.cl_width = static_cast<long>(offsets.size());
+    footprint.cl_height = static_cast<long>(((h + m - 1) / m) * m);
+    footprint.elements = footprint.cl_width * footprint.cl_height + tail;
+    coo_length = static_cast<long>(tail);
+    buffers["cooRows"] = tail * index_size;
+    buffers["cooCols"] = tail * index_size;
+    buffers["cooVals"] = tail * sizeof(T);
+  } else if (kprops.arrayType == "bcsr") {
+    const size_t r = static_cast<size_t>(kprops.blockRows);
+    const size_t c = static_cast<size_t>(kprops.blockCols);
+    auto blocks = matrix.bcsr_blocks(kprops.blockRows, kprops.blockCols);
+    footprint.elements =
+        std::accumulate(blocks.begin(), blocks.end(), (size_t)0) * r * c;
+    footprint.cl_width =
+        blocks.empty() ? 0
+                       : static_cast<long>(
+                             *std::max_element(blocks.begin(), blocks.end()));
+    footprint.cl_height = static_cast<long>(blocks.size() * r);
+    buffers["blockPtr"] = (blocks.size() + 1) * index_size;
+  } else if (kprops.arrayType == "ragged") {
+    // no padding, but each row has an offset and two header indices in
+    // both arrays
+    footprint.elements = footprint.entries;
+    footprint.cl_width = -1;
+    footprint.cl_height = static_cast<long>(pad(h, kprops.chunkSize));
+    size_t headers = footprint.cl_height * 3 * index_size;
+    buffers["indices"] = headers + footprint.entries * index_size;
+    buffers["values"] = headers + footprint.entries * sizeof(T);
+  } else {
+    // ELLPACK, or the ELL part (and COO tail) of a hybrid matrix
+    size_t width = max_row;
+    size_t tail = 0;
+    if (kprops.arrayType == "hybrid") {
+      width = std::min(width, static_cast<size_t>(
+                                  kprops.hybridWidth != -1
+                                      ? kprops.hybridWidth
+                                      : matrix.hybrid_width(
+                                            kprops.hybridCoverage)));
+      for (size_t r = 0; r < h; r++) {
+        tail += rows[r].size() > width ? rows[r].size() - width : 0;
+      }
+      coo_length = static_cast<long>(tail);
+      buffers["cooRows"] = tail * index_size;
+      buffers["cooCols"] = tail * index_size;
+      buffers["cooVals"] = tail * sizeof(T);
+    }
+    footprint.cl_width = static_cast<long>(pad(width, kprops.splitSize));
+    footprint.cl_height = static_cast<long>(pad(h, kprops.chunkSize));
+    footprint.elements = footprint.cl_width * footprint.cl_height + tail;
+  }
 
-  // create an arg container!
-  ArgContainer<T> arg_cnt;
+  // the element arrays - other than the COO tail, which isn't re-encoded
+  const size_t stored = footprint.elements - coo_length;
+  long dict_length = 0;
+  if (kprops.arrayType != "ragged") {
+    // (a DIA matrix only has an index per diagonal, and a BCSR matrix one
+    // per block)
+    if (kprops.arrayType == "dia") {
+      buffers["indices"] = footprint.cl_width * sizeof(int);
+    } else if (kprops.arrayType == "bcsr") {
+      buffers["indices"] =
+          stored / (kprops.blockRows * kprops.blockCols) * index_size;
+    } else {
+      buffers["indices"] = stored * (kprops.arrayType == "delta"
+                                         ? sizeof(uint16_t)
+                                         : index_size);
+    }
+    buffers["values"] = stored * sizeof(T);
+    switch (parse_value_encoding(kprops.valueEncoding)) {
+    case ValueEncoding::PLAIN:
+      break;
+    case ValueEncoding::DICTIONARY:
+      dict_length = std::min<long>(1L << kprops.codeBits,
+                                   static_cast<long>(footprint.entries) + 1);
+      buffers["values"] = stored * (kprops.codeBits / 8);
+      buffers["valueDict"] = dict_length * sizeof(T);
+      break;
+    case ValueEncoding::PATTERN:
+      buffers["values"] = sizeof(T);
+      break;
+    case ValueEncoding::HALF:
+    case ValueEncoding::BFLOAT16:
+      buffers["values"] = stored * sizeof(uint16_t);
+      break;
+    }
+  }
 
-  arg_cnt.m_idxs = std::move(cl_matrix.indices);
-  arg_cnt.m_vals = std::move(cl_matrix.values);
+  // and everything else the harness allocates - the kernel reads the whole
+  // (padded) vectors
+  long vector_length = kprops.arrayType == "dcsr"
+                           ? static_cast<long>(h)
+                           : footprint.cl_height;
+  auto sizes = shapeSizes(kprops, matrix, footprint.cl_width,
+                          footprint.cl_height, vector_length, 0, coo_length,
+                          dict_length, escape_length, segment_rows);
+  footprint.vector_bytes = vector_length * sizeof(T);
+  footprint.output_bytes =
+      Evaluator::evaluate(kernel.getOutputArg()->size, sizes);
+  for (auto arg : kernel.getTempGlobals()) {
+    footprint.temp_globals.push_back(Evaluator::evaluate(arg.size, sizes));
+  }
 
-  // create args for the vector inputs
-  // TODO: do we actually need to make the x vector bigger when we pad
-  // vertically?
-  LOG_DEBUG("Input vector arg: ", (size_t)xvector.size() * sizeof(T));
-  LOG_DEBUG("Input vector arg: ", (size_t)yvector.size() * sizeof(T));
+  std::cerr << "Predicted footprint of the " << kprops.arrayType
+            << " encoding: " << footprint.elements << " elements for "
+            << footprint.entries << " entries (" << footprint.padding()
+            << "% padding), " << footprint.matrix_bytes()
+            << " bytes of matrix, " << footprint.device_bytes()
+            << " bytes on the device, largest buffer "
+            << footprint.largest_buffer() << " bytes" << ENDL;
+  if (matrix.half_stored()) {
+    std::cerr << "(half storage of a symmetric matrix of "
+              << footprint.full_entries << " entries)" << ENDL;
+  }
+  return footprint;
+}
 
-  arg_cnt.x_vect = enchar<T>(xvector);
-  arg_cnt.y_vect = enchar<T>(yvector);
+// Fix the number of columns in each segment of a "segmented" kernel: the
+// number given on the command line (if not 0), otherwise the kernel's own
+// segmentWidth, otherwise the largest power of two number of x values that
+// fits in half of local memory (leaving the rest for the kernel's other
+// locals, and for the occupancy of the compute units).
+template <typename T>
+void chooseSegmentWidth(KernelConfig<T> &kernel, unsigned int columns,
+                        unsigned long local_mem_bytes) {
+  auto kprops = kernel.getProperties();
+  if (columns == 0 && kprops.segmentWidth > 0) {
+    columns = static_cast<unsigned int>(kprops.segmentWidth);
+  }
+  if (columns == 0) {
+    const unsigned long fit = local_mem_bytes / 2 / sizeof(T);
+    columns = 1;
+    while (columns * 2UL <= fit) {
+      columns *= 2;
+    }
+  }
+  std::cerr << "Using segments of " << columns << " columns" << ENDL;
+  kernel.setSegmentWidth(static_cast<int>(columns));
+}
 
-  // create the alpha and beta args
-  arg_cnt.alpha = alpha;
-  arg_cnt.beta = beta;
+// Fix the block size of a "bcsr" kernel: the kernel's own blockRows and
+// blockCols, if it has them, otherwise the block size with the smallest
+// encoding of the matrix (see SparseMatrix::bcsr_block_size).
+template <typename T>
+void chooseBlockSize(KernelConfig<T> &kernel, SparseMatrix<T> &matrix) {
+  auto kprops = kernel.getProperties();
+  auto size = kprops.blockRows > 0 && kprops.blockCols > 0
+                  ? std::make_pair(kprops.blockRows, kprops.blockCols)
+                  : matrix.bcsr_block_size(kprops.indexBits);
+  std::cerr << "Using blocks of " << size.first << "x" << size.second
+            << ENDL;
+  kernel.setBlockSize(size.first, size.second);
+}
+
+// move the buffers of an encoded matrix into an argument (or block) container
+template <typename T, typename Container>
+void setMatrixArgs(Container &args, KernelConfig<T> &kernel,
+                   CL_matrix &cl_matrix) {
+  args.m_idxs = std::move(cl_matrix.indices);
+  args.m_vals = std::move(cl_matrix.values);
+  // keep the row permutation (or the rows of a compacted matrix), so that we
+  // can put the output back in order
+  auto perm = cl_matrix.extras.find("rowPerm");
+  if (perm == cl_matrix.extras.end()) {
+    perm = cl_matrix.extras.find("rowIds");
+  }
+  if (perm != cl_matrix.extras.end()) {
+    args.output_perm.resize(perm->second.size() / sizeof(int));
+    memcpy(args.output_perm.data(), perm->second.data(), perm->second.size());
+  }
+  for (auto &name : kernel.getExtraMatrixArgs()) {
+    auto extra = cl_matrix.extras.find(name);
+    if (extra == cl_matrix.extras.end()) {
+      std::cerr << "Kernel expects a matrix argument \"" << name
+                << "\", which the " << kernel.getProperties().arrayType
+                << " encoding doesn't provide" << ENDL;
+      exit(-1);
+    }
+    // OpenCL doesn't allow empty buffers (e.g. an empty COO tail), so give
+    // those a placeholder element - their size args will still be zero
+    if (extra->second.empty()) {
+      extra->second.resize(sizeof(int64_t), 0);
+    }
+    args.m_extra.push_back(std::move(extra->second));
+  }
+}
 
+// calculate the sizes of the output and temporary buffers, and the size
+// args, of an argument (or block) container
+template <typename T, typename Container>
+void setSizedArgs(Container &args, KernelConfig<T> &kernel,
+                  Evaluator::SizeMap &sizeMap) {
   // create output buffer
   {
     start_timer(outputBuffer, executorEncodeMatrix);
     {
-      int memsize = Evaluator::evaluate(kernel.getOutputArg()->size, v_MWidth_1,
-                                        v_MHeight_2, v_VLength_3);
-      arg_cnt.output = memsize;
+      size_t memsize =
+          Evaluator::evaluate(kernel.getOutputArg()->size, sizeMap);
+      args.output = memsize;
       LOG_DEBUG("Global output arg - arg: ", kernel.getOutputArg()->variable,
                 ", address space: ", kernel.getOutputArg()->addressSpace,
                 ", size:", kernel.getOutputArg()->size,
@@ -118,9 +633,8 @@ executorEncodeMatrix(unsigned int device_max_alloc_bytes,
   {
     start_timer(tempGlobal, executorEncodeMatrix);
     for (auto arg : kernel.getTempGlobals()) {
-      int memsize =
-          Evaluator::evaluate(arg.size, v_MWidth_1, v_MHeight_2, v_VLength_3);
-      arg_cnt.temp_globals.push_back(memsize);
+      size_t memsize = Evaluator::evaluate(arg.size, sizeMap);
+      args.temp_globals.push_back(memsize);
       LOG_DEBUG("Global temp arg - arg: ", arg.variable,
                 ", address space: ", arg.addressSpace, ", size:", arg.size,
                 ", realsize: ", memsize);
@@ -131,9 +645,8 @@ executorEncodeMatrix(unsigned int device_max_alloc_bytes,
   {
     start_timer(tempLocal, executorEncodeMatrix);
     for (auto arg : kernel.getTempLocals()) {
-      int memsize =
-          Evaluator::evaluate(arg.size, v_MWidth_1, v_MHeight_2, v_VLength_3);
-      arg_cnt.temp_locals.push_back(memsize);
+      size_t memsize = Evaluator::evaluate(arg.size, sizeMap);
+      args.temp_locals.push_back(memsize);
       LOG_DEBUG("Local temp arg - arg: ", arg.variable,
                 ", address space: ", arg.addressSpace, ", size:", arg.size,
                 ", realsize: ", memsize);
@@ -141,24 +654,191 @@ executorEncodeMatrix(unsigned int device_max_alloc_bytes,
   }
 
   // create size buffers
-  // match the paramvars to the buffers
-  auto sizeMap = std::map<std::string, int>{
-      {"MWidthC", v_MWidth_1},
-      {"MHeight", v_MHeight_2},
-      {"VLength", v_VLength_3},
-  };
-
+  // match the paramvars to the sizes
   // iterate over the size args, and do a lookup for each of them.
   // this should keep the order correct, and also correctly provide the total
-  // amount that we need, rather than overspecifying when we don't need some
+  // amount that we need, rather than overspecifying when we don't need some.
+  // Kernels with 64 bit indices take the sizes as longs, and the rest as
+  // ints, so a size that doesn't fit in an int needs a 64 bit kernel.
   {
     start_timer(sizeArgs, executorEncodeMatrix);
+    args.wide_size_args = kernel.getProperties().indexBits == 64;
     for (auto sizeArg : kernel.getParamVars()) {
-      int size = sizeMap[sizeArg];
+      long size = sizeMap[sizeArg];
       LOG_DEBUG("Size argument - name: ", sizeArg, " value: ", size);
-      arg_cnt.size_args.push_back(size);
+      if (!args.wide_size_args &&
+          (size < 0 || size > std::numeric_limits<int>::max())) {
+        std::cerr << "Size argument " << sizeArg << " (" << size
+                  << ") doesn't fit in a 32 bit int - use a kernel with 64 "
+                  << "bit indices (indexBits: 64), which takes its sizes as "
+                  << "longs" << ENDL;
+        exit(-1);
+      }
+      args.size_args.push_back(static_cast<int64_t>(size));
+    }
+  }
+}
+
+// Split a matrix that is too big to encode in a single allocation into
+// blocks of rows that each fit, and encode each of them. We start with as
+// many (even) blocks as the failed encoding suggests, and halve any block
+// that still doesn't fit. Blocks are a whole number of chunks (or slices),
+// so that they're padded the same way as the whole matrix.
+template <typename T>
+std::vector<MatrixBlock<T>>
+encodeMatrixBlocks(size_t device_max_alloc_bytes, size_t attempted_alloc_size,
+                   KernelConfig<T> &kernel, SparseMatrix<T> &matrix, T zero) {
+  start_timer(encodeMatrixBlocks, kernel_utils);
+  auto kprops = kernel.getProperties();
+  // (DCSR is as small as the matrix gets, so there's no point - and a BCSR
+  // block of rows is still padded to the width of the whole matrix)
+  if (kprops.arrayType == "dcsr" || kprops.arrayType == "bcsr") {
+    std::cerr << "A " << kprops.arrayType
+              << " matrix can't be split into blocks" << ENDL;
+    exit(-1);
+  }
+  // (the mirror of an entry is in another row, so maybe another block)
+  if (kprops.symmetric) {
+    std::cerr << "The matrix of a symmetric kernel can't be split into blocks"
+              << ENDL;
+    exit(-1);
+  }
+  const size_t height = static_cast<size_t>(matrix.height());
+  const size_t alignment =
+      kprops.arrayType == "sliced"
+          ? static_cast<size_t>(kprops.sliceHeight)
+          : (kprops.chunkSize > 0 ? static_cast<size_t>(kprops.chunkSize) : 1);
+  auto align = [&](size_t row) {
+    return std::min(height, row - row % alignment);
+  };
+
+  // the ranges of rows still to encode, last first
+  std::vector<std::pair<size_t, size_t>> pending;
+  size_t count = attempted_alloc_size / device_max_alloc_bytes + 1;
+  for (size_t b = count; b > 0; b--) {
+    size_t begin = align(height * (b - 1) / count);
+    size_t end = b == count ? height : align(height * b / count);
+    pending.push_back(std::make_pair(begin, end));
+  }
+
+  std::vector<MatrixBlock<T>> blocks;
+  while (!pending.empty()) {
+    size_t begin = pending.back().first;
+    size_t end = pending.back().second;
+    pending.pop_back();
+    if (begin >= end) {
+      continue;
+    }
+    SparseMatrix<T> block_matrix = matrix.row_block(begin, end);
+    try {
+      CL_matrix cl_matrix =
+          encodeForKernel(device_max_alloc_bytes, kprops, block_matrix, zero);
+      MatrixBlock<T> block;
+      block.row_begin = begin;
+      block.rows = end - begin;
+      block.y_vect = static_cast<size_t>(cl_matrix.cl_height) * sizeof(T);
+      // the kernel reads the whole x vector
+      auto sizeMap = kernelSizes(kprops, block_matrix, cl_matrix,
+                                 matrix.height(), static_cast<long>(begin));
+      setMatrixArgs(block, kernel, cl_matrix);
+      setSizedArgs(block, kernel, sizeMap);
+      blocks.push_back(std::move(block));
+    } catch (unsigned long block_alloc_size) {
+      size_t middle = align(begin + (end - begin) / 2);
+      if (middle <= begin) {
+        LOG_ERROR("Rows ", begin, " to ", end, " need ", block_alloc_size,
+                  " bytes, and can't be split any further");
+        throw;
+      }
+      pending.push_back(std::make_pair(middle, end));
+      pending.push_back(std::make_pair(begin, middle));
     }
   }
+  std::cerr << "Split matrix into " << blocks.size()
+            << " blocks of rows, to fit allocations of "
+            << device_max_alloc_bytes << " bytes" << ENDL;
+  return blocks;
+}
+
+// given a loaded sparse matrix, encode it in a form that we can use in the
+// executor - i.e. as a set of kernel arguments
+template <typename T>
+ArgContainer<T>
+executorEncodeMatrix(size_t device_max_alloc_bytes, KernelConfig<T> &kernel,
+                     SparseMatrix<T> &matrix, T zero,
+                     // std::vector<T> xvector, std::vector<T> yvector) {
+                     XVectorGenerator<T> &xgen, YVectorGenerator<T> &ygen,
+                     // int v_MWidth_1, int v_MHeight_2, int v_VLength_3,
+                     T alpha = static_cast<T>(1), T beta = static_cast<T>(1)) {
+  start_timer(executorEncodeMatrix, kernel_utils);
+  // get the configuration patterns of the kernel
+  auto kprops = kernel.getProperties();
+
+  // ---- CREATE THE ACTUAL ARGS ----
+  // Args must be in this order:
+  //  1) inputs (globals + values)
+  //  2) temporary/intermediate global values
+  //  3) output buffer
+  //  4) temporary locals
+  //  5) size args
+
+  // create an arg container!
+  ArgContainer<T> arg_cnt;
+  auto value_encoding = parse_value_encoding(kprops.valueEncoding);
+  arg_cnt.rounding = value_rounding(value_encoding);
+  if (arg_cnt.rounding > 0) {
+    arg_cnt.precision =
+        std::string(value_encoding_name(value_encoding)) + "/" +
+        ValueType<T>::name();
+  }
+  // the length of the vectors
+  long v_VLength_3;
+  try {
+    auto cl_matrix = encodeForKernel(device_max_alloc_bytes, kprops, matrix,
+                                     zero);
+    // (a DCSR matrix is only as high as its non-empty rows, but the vectors
+    // are whole)
+    v_VLength_3 = kprops.arrayType == "dcsr" ? matrix.height()
+                                             : cl_matrix.cl_height;
+    arg_cnt.compact_rows = kprops.arrayType == "dcsr";
+    arg_cnt.accumulate_output = kprops.symmetric;
+    auto sizeMap = kernelSizes(kprops, matrix, cl_matrix, v_VLength_3);
+    setMatrixArgs(arg_cnt, kernel, cl_matrix);
+    setSizedArgs(arg_cnt, kernel, sizeMap);
+  } catch (unsigned long attempted_alloc_size) {
+    LOG_WARNING("Encoding the matrix needs ", attempted_alloc_size,
+                " bytes, but the maximum allocation is ",
+                device_max_alloc_bytes, " - splitting it into blocks");
+    arg_cnt.blocks = encodeMatrixBlocks(
+        device_max_alloc_bytes, attempted_alloc_size, kernel, matrix, zero);
+    v_VLength_3 = matrix.height();
+  }
+
+  // generate the vector inputs
+  std::cerr << "Filling with these sizes: \n\tx = " << matrix.height()
+            << " \n\ty = " << v_VLength_3 << ENDL;
+  arg_cnt.reorder = matrix.ordering();
+  std::vector<T> xvector = xgen.generate(v_VLength_3, arg_cnt.reorder);
+  std::vector<T> yvector = ygen.generate(v_VLength_3, arg_cnt.reorder);
+
+  // create args for the vector inputs
+  // TODO: do we actually need to make the x vector bigger when we pad
+  // vertically?
+  LOG_DEBUG("Input vector arg: ", (size_t)xvector.size() * sizeof(T));
+  LOG_DEBUG("Input vector arg: ", (size_t)yvector.size() * sizeof(T));
+
+  arg_cnt.x_vect = enchar<T>(xvector);
+  arg_cnt.y_vect = enchar<T>(yvector);
+
+  // the blocks' outputs are stitched into an output for the whole matrix
+  if (!arg_cnt.blocks.empty()) {
+    arg_cnt.output = arg_cnt.x_vect.size();
+  }
+
+  // create the alpha and beta args
+  arg_cnt.alpha = alpha;
+  arg_cnt.beta = beta;
+  arg_cnt.zero = zero;
 
   // arg_cnt.size_args.push_back(v_MHeight_2);
   // arg_cnt.size_args.push_back(v_MWidth_1);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// A read-only memory mapping of a whole file. The mapping is released when
+// the object goes out of scope.
+class MappedFile {
+public:
+  MappedFile(const std::string &filename);
+  ~MappedFile();
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // whether the file could be opened and mapped
+  bool valid() const { return _data != nullptr; }
+
+  const char *data() const { return _data; }
+  size_t size() const { return _size; }
+
+  // hint to the kernel that we're going to stream through the mapping
+  void adviseSequential();
+
+private:
+  int _fd;
+  const char *_data;
+  size_t _size;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// Support for binary "sidecar" caches that live next to the files they're
+// derived from. A cache records the identity (size, modification time and a
+// content fingerprint) of its source file, so that stale caches are ignored.
+
+// bump this whenever the layout of a cache file changes
+#define MATRIX_CACHE_VERSION 5
+
+// 64 bit hash of a block of memory (a simple multiply/rotate mix, eight bytes
+// at a time - this only has to be good enough to spot changed files)
+uint64_t hash_bytes(const char *data, size_t length, uint64_t seed = 0);
+
+// mix a value into a running hash
+uint64_t hash_combine(uint64_t hash, uint64_t value);
+
+class FileIdentity {
+public:
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  uint64_t fingerprint = 0;
+
+  // Stat the file, and fingerprint its contents. The fingerprint hashes the
+  // head and tail of the file, and a fixed number of blocks spread evenly
+  // through it, so that it costs the same for a 1MB or 100GB file.
+  // Returns false if the file couldn't be read.
+  static bool of(const std::string &filename, FileIdentity &identity);
+
+  bool operator==(const FileIdentity &other) const {
+    return size == other.size && mtime_ns == other.mtime_ns &&
+           fingerprint == other.fingerprint;
+  }
+};
+
+// The fixed size header at the start of every matrix cache file. The arrays
+// of the cached matrix follow, each starting on an 8 byte boundary.
+struct MatrixCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t value_size;
+  char value_type[16];
+  // identity of the matrix market file we were built from
+  uint64_t source_size;
+  int64_t source_mtime_ns;
+  uint64_t source_fingerprint;
+  // matrix information
+  int32_t rows;
+  int32_t cols;
+  int32_t nonz;
+  uint32_t flags;
+  uint64_t entries;
+};
+
+#define MATRIX_CACHE_SYMMETRIC 0x1
+#define MATRIX_CACHE_PATTERN 0x2
+
+// The header of a cache of an encoded (i.e. ready to upload) matrix. The key
+// identifies both the matrix - its source file, and whatever has been done
+// to it since loading - and the parameters it was encoded with. A table of
+// the extra (named) buffers follows, then the encoded index and value
+// buffers, then the extra buffers.
+struct EncodedCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t value_size;
+  char value_type[16];
+  uint64_t key;
+  int32_t cl_width;
+  int32_t cl_height;
+  uint64_t indices_bytes;
+  uint64_t values_bytes;
+  uint32_t extra_count;
+  uint32_t reserved;
+};
+
+struct EncodedCacheExtra {
+  char name[24];
+  uint64_t bytes;
+};
+
+// Helpers for building/reading cache files.
+namespace MatrixCache {
+
+// initialise a header for the current version, and a given source file
+MatrixCacheHeader make_header(const FileIdentity &source, const char *type,
+                              uint32_t value_size);
+
+// check that a header matches the current version, type and source file
+bool header_matches(const MatrixCacheHeader &header,
+                    const FileIdentity &source, const char *type,
+                    uint32_t value_size);
+
+// initialise/check an encoded matrix header for the current version, type
+// and key
+EncodedCacheHeader make_encoded_header(uint64_t key, const char *type,
+                                       uint32_t value_size);
+bool encoded_header_matches(const EncodedCacheHeader &header, uint64_t key,
+                            const char *type, uint32_t value_size);
+
+// the name of the cache file for a matrix encoded with a given key
+std::string encoded_filename(const std::string &matrix_filename,
+                             const char *type, uint64_t key);
+
+// round a byte offset up to the alignment used between arrays
+inline size_t align(size_t offset) { return (offset + 7) & ~size_t(7); }
+
+// Write a cache file atomically: the data is written to a temporary file
+// which is renamed into place, so that concurrent harness runs never see a
+// partially written cache. Each element of `arrays` is a (pointer, length)
+// pair, written after the header in order.
+bool write(const std::string &filename, const void *header,
+           size_t header_size,
+           const std::vector<std::pair<const void *, size_t>> &arrays);
+
+inline bool write(const std::string &filename, const MatrixCacheHeader &header,
+                  const std::vector<std::pair<const void *, size_t>> &arrays) {
+  return write(filename, &header, sizeof(header), arrays);
+}
+
+inline bool write(const std::string &filename,
+                  const EncodedCacheHeader &header,
+                  const std::vector<std::pair<const void *, size_t>> &arrays) {
+  return write(filename, &header, sizeof(header), arrays);
+}
+
+} // namespace MatrixCache
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+// the number of buckets in the row length histogram of a MatrixProfile
+#define PROFILE_HISTOGRAM_BUCKETS 33
+
+// Structural statistics of a matrix, to correlate kernel performance with
+// the structure of the matrices it ran on (see SparseMatrix::
+// structure_profile). This is a plain struct, so that it can be cached as is.
+struct MatrixProfile {
+  int32_t rows;
+  int32_t cols;
+  uint64_t entries;
+  // the distribution of row lengths (the Gini coefficient is 0 if every row
+  // is the same length, and approaches 1 as the entries concentrate in a
+  // few rows)
+  uint64_t max_row;
+  double mean_row;
+  double stddev_row;
+  double gini_row;
+  // the fraction of rows with no entries
+  double empty_rows;
+  // bucket 0 counts the empty rows, and bucket b > 0 the rows with between
+  // 2^(b-1) and 2^b - 1 entries
+  uint64_t row_histogram[PROFILE_HISTOGRAM_BUCKETS];
+  // see SparseMatrix::bandwidth and SparseMatrix::profile
+  uint64_t bandwidth;
+  uint64_t profile;
+  // the fraction of rows whose diagonal entry is at least the sum of the
+  // rest of the row (in magnitude)
+  double diagonal_dominance;
+  // the elements each encoding stores, per non-zero: ELLPACK, sliced
+  // ELLPACK (with the default slice height and sort window) and hybrid
+  // ELL + COO (with the default coverage)
+  double ellpack_padding;
+  double sliced_padding;
+  double hybrid_padding;
+
+  static std::string printHeader() {
+    std::ostringstream out;
+    out << "INSERT INTO matrix_profile (matrix, experiment_id, rows, cols, "
+        << "entries, max_row, mean_row, stddev_row, gini_row, empty_rows, "
+        << "row_histogram, bandwidth, profile, diagonal_dominance, "
+        << "ellpack_padding, sliced_padding, hybrid_padding) VALUES ";
+    return out.str();
+  }
+
+  // An insert of the profile, to join with the benchmark results (see
+  // SqlStat) on the matrix name and experiment id. The histogram is written
+  // as a list, up to its last non-empty bucket.
+  std::string makeSqlCommand(const std::string &matrix_name,
+                             const std::string &experiment_id) const {
+    int last = PROFILE_HISTOGRAM_BUCKETS - 1;
+    while (last > 0 && row_histogram[last] == 0) {
+      last--;
+    }
+    std::ostringstream histogram;
+    histogram << "[";
+    for (int b = 0; b <= last; b++) {
+      histogram << (b == 0 ? "" : ",") << row_histogram[b];
+    }
+    histogram << "]";
+
+    std::ostringstream out;
+    out << printHeader() << "(\"" << matrix_name << "\", \"" << experiment_id
+        << "\", " << rows << ", " << cols << ", " << entries << ", " << max_row
+        << ", " << mean_row << ", " << stddev_row << ", " << gini_row << ", "
+        << empty_rows << ", \"" << histogram.str() << "\", " << bandwidth
+        << ", " << profile << ", " << diagonal_dominance << ", "
+        << ellpack_padding << ", " << sliced_padding << ", " << hybrid_padding
+        << ");";
+    return out.str();
+  }
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+#include "mmio.h"
+
+// A parallel Matrix Market (coordinate format) parser. The banner and size
+// line are read with mmio, then the body of the file is memory mapped, split
+// into newline-aligned chunks, and each chunk is scanned by its own thread.
+class MTXParser {
+public:
+  MTXParser(const std::string &filename);
+
+  // header information
+  int rows() const { return _rows; }
+  int cols() const { return _cols; }
+  int nonZeros() const { return _nonz; }
+  bool pattern() const { return mm_is_pattern(_matcode); }
+  bool symmetric() const { return mm_is_symmetric(_matcode); }
+  // size of the whole file in bytes
+  size_t bytes() const { return _file.size(); }
+
+  // Parse the body of the file into coordinate arrays, adjusted to be zero
+  // based. Entries are emitted in file order, and for symmetric matrices each
+  // off-diagonal entry (I, J) is immediately followed by its mirror (J, I) -
+  // unless mirror is false, in which case only the stored triangle is
+  // emitted. Pattern matrices skip value parsing entirely, and get a value
+  // of one.
+  template <typename T>
+  void parse(std::vector<int> &xs, std::vector<int> &ys, std::vector<T> &vals,
+             unsigned int threads = 0, bool mirror = true);
+
+private:
+  MappedFile _file;
+  MM_typecode _matcode;
+  int _rows;
+  int _cols;
+  int _nonz;
+  size_t _body_offset;
+};
@@ -225,6 +225,30 @@ unsigned long deviceGetMaxAllocSize(unsigned int platform,
   return size;
 }
 
+unsigned long deviceGetLocalMemSize(unsigned int platform,
+                                    unsigned int device) {
+
+  cl_device_id device_id = getDeviceId(platform, device);
+  // perform the actual query
+  cl_ulong size;
+  LOG_DEBUG_INFO("Getting device local memory size from device", device_id);
+  checkCLError(clGetDeviceInfo(device_id, CL_DEVICE_LOCAL_MEM_SIZE,
+                               sizeof(size), &size, NULL));
+  return size;
+}
+
+unsigned long deviceGetGlobalMemSize(unsigned int platform,
+                                     unsigned int device) {
+
+  cl_device_id device_id = getDeviceId(platform, device);
+  // perform the actual query
+  cl_ulong size;
+  LOG_DEBUG_INFO("Getting device global memory size from device", device_id);
+  checkCLError(clGetDeviceInfo(device_id, CL_DEVICE_GLOBAL_MEM_SIZE,
+                               sizeof(size), &size, NULL));
+  return size;
+}
+
 template <typename T>
 void printCharVector(const std::string &name, std::vector<char> &v) {
   // get the underlying pointer, and the length in terms of t
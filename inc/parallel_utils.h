@@ -0,0 +1,80 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Small helpers for the host-side parallel passes (parsing, sorting,
+// encoding). We just use std::thread, as the passes are all coarse grained
+// and embarrassingly parallel over contiguous blocks.
+
+// don't bother spawning threads for less work than this
+#define PARALLEL_MIN_GRAIN 4096
+
+// the number of threads to use when the caller doesn't specify
+inline unsigned int default_thread_count() {
+  unsigned int hw = std::thread::hardware_concurrency();
+  return hw == 0 ? 1 : hw;
+}
+
+// std::vector<bool> packs its elements into shared words, so it can't be
+// written from several threads at once - passes that write value arrays use
+// this to fall back to a single thread for bool matrices
+template <typename T>
+unsigned int value_thread_count(unsigned int threads = 0) {
+  return std::is_same<T, bool>::value ? 1 : threads;
+}
+
+// the number of blocks that parallel_for_blocks will split [begin, end) into
+inline unsigned int block_count(size_t begin, size_t end,
+                                unsigned int threads = 0) {
+  if (threads == 0) {
+    threads = default_thread_count();
+  }
+  size_t length = end > begin ? end - begin : 0;
+  size_t max_blocks = (length + PARALLEL_MIN_GRAIN - 1) / PARALLEL_MIN_GRAIN;
+  return static_cast<unsigned int>(
+      std::max<size_t>(1, std::min<size_t>(threads, max_blocks)));
+}
+
+// split [begin, end) into contiguous blocks (in order, so that block k covers
+// a lower range than block k+1), and call f(block_begin, block_end, block_id)
+// for each of them on its own thread. The last block runs on the caller.
+template <typename F>
+void parallel_for_blocks(size_t begin, size_t end, F f,
+                         unsigned int threads = 0) {
+  unsigned int blocks = block_count(begin, end, threads);
+  size_t length = end > begin ? end - begin : 0;
+  if (blocks == 1) {
+    f(begin, end, 0u);
+    return;
+  }
+  std::vector<std::thread> workers;
+  workers.reserve(blocks - 1);
+  for (unsigned int b = 0; b < blocks; b++) {
+    size_t block_begin = begin + (length * b) / blocks;
+    size_t block_end = begin + (length * (b + 1)) / blocks;
+    if (b == blocks - 1) {
+      f(block_begin, block_end, b);
+    } else {
+      workers.emplace_back(f, block_begin, block_end, b);
+    }
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
+// element-wise convenience wrapper: call f(i) for every i in [begin, end)
+template <typename F>
+void parallel_for(size_t begin, size_t end, F f, unsigned int threads = 0) {
+  parallel_for_blocks(begin, end,
+                      [&f](size_t b, size_t e, unsigned int) {
+                        for (size_t i = b; i < e; i++) {
+                          f(i);
+                        }
+                      },
+                      threads);
+}
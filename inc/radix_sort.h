@@ -0,0 +1,136 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "csds_timer.h"
+#include "parallel_utils.h"
+
+#define RADIX_BITS 8
+#define RADIX_BUCKETS (1 << RADIX_BITS)
+
+// Parallel LSD radix sort of a coordinate list held as a structure of arrays,
+// by (major, minor) ascending. Indices are treated as unsigned, and the sort
+// is stable. Each pass sorts by one 8 bit digit: every thread builds a
+// histogram of its block, the histograms are scanned into per-thread output
+// offsets, and then every thread scatters its block. Passes over digits where
+// every key is the same (e.g. the high bytes of small matrices) are skipped.
+template <typename V>
+void radix_sort_pairs(std::vector<int> &major, std::vector<int> &minor,
+                      std::vector<V> &vals, unsigned int threads = 0) {
+  start_timer(radix_sort_pairs, radix_sort);
+  const size_t n = major.size();
+  threads = value_thread_count<V>(threads);
+  const unsigned int blocks = block_count(0, n, threads);
+
+  // find the largest key in each array, so that we know how many passes
+  std::vector<uint32_t> block_major_max(blocks, 0);
+  std::vector<uint32_t> block_minor_max(blocks, 0);
+  parallel_for_blocks(0, n,
+                      [&](size_t begin, size_t end, unsigned int b) {
+                        uint32_t mj = 0;
+                        uint32_t mn = 0;
+                        for (size_t i = begin; i < end; i++) {
+                          mj = std::max(mj, static_cast<uint32_t>(major[i]));
+                          mn = std::max(mn, static_cast<uint32_t>(minor[i]));
+                        }
+                        block_major_max[b] = mj;
+                        block_minor_max[b] = mn;
+                      },
+                      threads);
+  uint32_t major_max =
+      *std::max_element(block_major_max.begin(), block_major_max.end());
+  uint32_t minor_max =
+      *std::max_element(block_minor_max.begin(), block_minor_max.end());
+
+  // a pass is a (key array, shift) pair - least significant digits first
+  std::vector<std::pair<bool, unsigned int>> passes;
+  for (unsigned int shift = 0; shift < 32 && (minor_max >> shift) != 0;
+       shift += RADIX_BITS) {
+    passes.push_back(std::make_pair(false, shift));
+  }
+  for (unsigned int shift = 0; shift < 32 && (major_max >> shift) != 0;
+       shift += RADIX_BITS) {
+    passes.push_back(std::make_pair(true, shift));
+  }
+  if (passes.empty() || n < 2) {
+    return;
+  }
+
+  std::vector<int> major_tmp(n);
+  std::vector<int> minor_tmp(n);
+  std::vector<V> vals_tmp(n);
+  std::vector<int> *major_src = &major, *major_dst = &major_tmp;
+  std::vector<int> *minor_src = &minor, *minor_dst = &minor_tmp;
+  std::vector<V> *vals_src = &vals, *vals_dst = &vals_tmp;
+
+  std::vector<size_t> counts(blocks * RADIX_BUCKETS);
+  for (auto pass : passes) {
+    const unsigned int shift = pass.second;
+    const bool by_major = pass.first;
+    auto digit = [&](size_t i) -> unsigned int {
+      uint32_t key = static_cast<uint32_t>(by_major ? (*major_src)[i]
+                                                     : (*minor_src)[i]);
+      return (key >> shift) & (RADIX_BUCKETS - 1);
+    };
+
+    // histogram each block
+    std::fill(counts.begin(), counts.end(), 0);
+    parallel_for_blocks(0, n,
+                        [&](size_t begin, size_t end, unsigned int b) {
+                          size_t *c = counts.data() + b * RADIX_BUCKETS;
+                          for (size_t i = begin; i < end; i++) {
+                            c[digit(i)]++;
+                          }
+                        },
+                        threads);
+
+    // skip the pass if every key has the same digit
+    bool trivial = false;
+    for (unsigned int d = 0; d < RADIX_BUCKETS && !trivial; d++) {
+      size_t total = 0;
+      for (unsigned int b = 0; b < blocks; b++) {
+        total += counts[b * RADIX_BUCKETS + d];
+      }
+      trivial = total == n;
+    }
+    if (trivial) {
+      continue;
+    }
+
+    // exclusive scan, digit major, so that block b's keys with digit d land
+    // after all of the smaller digits, and after blocks < b with digit d
+    size_t running = 0;
+    for (unsigned int d = 0; d < RADIX_BUCKETS; d++) {
+      for (unsigned int b = 0; b < blocks; b++) {
+        size_t c = counts[b * RADIX_BUCKETS + d];
+        counts[b * RADIX_BUCKETS + d] = running;
+        running += c;
+      }
+    }
+
+    // scatter
+    parallel_for_blocks(0, n,
+                        [&](size_t begin, size_t end, unsigned int b) {
+                          size_t *offsets = counts.data() + b * RADIX_BUCKETS;
+                          for (size_t i = begin; i < end; i++) {
+                            size_t o = offsets[digit(i)]++;
+                            (*major_dst)[o] = (*major_src)[i];
+                            (*minor_dst)[o] = (*minor_src)[i];
+                            (*vals_dst)[o] = (*vals_src)[i];
+                          }
+                        },
+                        threads);
+    std::swap(major_src, major_dst);
+    std::swap(minor_src, minor_dst);
+    std::swap(vals_src, vals_dst);
+  }
+
+  // if the result ended up in the temporaries, move it back
+  if (major_src != &major) {
+    major.swap(major_tmp);
+    minor.swap(minor_tmp);
+    vals.swap(vals_tmp);
+  }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+
+#include "common.h"
+
+// Symmetric reorderings of a (square) matrix, applied before encoding. The
+// kernels read x at the column of every entry, so for graphs with no
+// particular vertex order those reads are essentially random; renumbering
+// the vertices so that neighbours get nearby numbers makes them far more
+// local.
+//  - RCM: reverse Cuthill-McKee, which minimises the bandwidth
+//  - DEGREE: vertices sorted by degree, highest first
+//  - BFS: breadth first order from the highest degree vertex, which keeps
+//    neighbourhoods together (a cheap stand in for Gorder)
+enum class Reordering { NONE, RCM, DEGREE, BFS };
+
+inline const char *reordering_name(Reordering reordering) {
+  switch (reordering) {
+  case Reordering::NONE:
+    return "none";
+  case Reordering::RCM:
+    return "rcm";
+  case Reordering::DEGREE:
+    return "degree";
+  case Reordering::BFS:
+    return "bfs";
+  }
+  return "unknown";
+}
+
+// parse a reordering from the command line
+inline Reordering parse_reordering(const std::string &name) {
+  for (Reordering reordering : {Reordering::NONE, Reordering::RCM,
+                                Reordering::DEGREE, Reordering::BFS}) {
+    if (name == reordering_name(reordering)) {
+      return reordering;
+    }
+  }
+  std::cerr << "Unknown reordering " << name
+            << " (expected none, rcm, degree or bfs)" << ENDL;
+  exit(-1);
+}
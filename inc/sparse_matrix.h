@@ -6,12 +6,16 @@
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 
 #include <algorithm>
 #include <fstream>
 #include <functional>
 #include <iostream>
 #include <iterator>
+#include <initializer_list>
+#include <limits>
+#include <map>
 #include <numeric>
 #include <tuple>
 #include <vector>
@@ -19,40 +23,285 @@
 #include "buffer_utils.h"
 #include "common.h"
 #include "csds_timer.h"
+#include "csr_builder.h"
+#include "duplicates.h"
+#include "ell_layout.h"
+#include "matrix_cache.h"
+#include "matrix_profile.h"
+#include "mtx_parser.h"
+#include "parallel_utils.h"
+#include "reordering.h"
+#include "value_encoding.h"
+#include "value_types.h"
 
 class CL_matrix {
 public:
-  CL_matrix(unsigned int ixs_arr_size, unsigned int vals_arr_size, int _width,
-            int _height)
+  CL_matrix(size_t ixs_arr_size, size_t vals_arr_size, int _width, int _height)
       : indices(ixs_arr_size), values(vals_arr_size), cl_width(_width),
         cl_height(_height) {}
-  std::vector<char> indices;
-  std::vector<char> values;
+  raw_buffer indices;
+  raw_buffer values;
+  // any other buffers the encoding needs (e.g. slice offsets), by name
+  std::map<std::string, raw_buffer> extras;
   int cl_width;
   int cl_height;
 };
 
+// A read only view of a single row of a sparse matrix, which looks (enough)
+// like a std::vector<std::pair<int, T>> of (column, value) pairs
+template <typename T> class EllpackRowView {
+public:
+  EllpackRowView(const std::vector<int> &cols, const std::vector<T> &vals,
+                 size_t begin, size_t end)
+      : _cols(&cols), _vals(&vals), _begin(begin), _end(end) {}
+
+  size_t size() const { return _end - _begin; }
+  std::pair<int, T> operator[](size_t i) const {
+    return std::pair<int, T>((*_cols)[_begin + i], (*_vals)[_begin + i]);
+  }
+
+private:
+  const std::vector<int> *_cols;
+  const std::vector<T> *_vals;
+  size_t _begin;
+  size_t _end;
+};
+
+// A read only view of a whole sparse matrix as a ragged array of rows
+template <typename T> class EllpackView {
+public:
+  EllpackView(const std::vector<int> &cols, const std::vector<T> &vals,
+              const std::vector<size_t> &row_ptr)
+      : _cols(&cols), _vals(&vals), _row_ptr(&row_ptr) {}
+
+  size_t size() const { return _row_ptr->size() - 1; }
+  EllpackRowView<T> operator[](size_t row) const {
+    return EllpackRowView<T>(*_cols, *_vals, (*_row_ptr)[row],
+                             (*_row_ptr)[row + 1]);
+  }
+
+private:
+  const std::vector<int> *_cols;
+  const std::vector<T> *_vals;
+  const std::vector<size_t> *_row_ptr;
+};
+
 template <typename EType> class SparseMatrix {
 public:
   // Constructors
-  SparseMatrix(std::string filename);
+  // Load a matrix market file. Unless use_cache is false, the parsed matrix
+  // is kept in a binary sidecar file next to the original, and later loads
+  // of the same (unchanged) file read the sidecar instead of parsing.
+  // Likewise, every encoding of the matrix is cached (see cl_encode).
+  // With half_storage, a symmetric matrix is kept as just its lower
+  // triangle (the diagonal included), from parsing onwards - see
+  // half_stored.
+  SparseMatrix(std::string filename, bool use_cache = true,
+               bool half_storage = false);
   // SparseMatrix(float lo, float hi, int length, int elements);
 
   // readers
-  template <typename T> using ellpack_row = std::vector<std::pair<int, T>>;
-  template <typename T> using ellpack_matrix = std::vector<ellpack_row<T>>;
+  using ellpack_matrix_view = EllpackView<EType>;
 
-  template <typename T>
-  using soa_ellpack_matrix =
-      std::pair<std::vector<std::vector<int>>, std::vector<std::vector<T>>>;
+  using cl_arg = raw_buffer;
 
-  using cl_arg = std::vector<char>;
-
-  CL_matrix cl_encode(unsigned int device_max_alloc_bytes, EType zero,
+  // Encode the matrix as a pair of buffers ready to upload. If caching is
+  // enabled, the result is cached on disk, keyed by the matrix (its source
+  // file, and any transformations since loading) and the encoding
+  // parameters, so that later runs with the same parameters skip encoding.
+  // Column indices (and, for RSA, the row offsets and lengths) are written
+  // as index_bits (32 or 64) wide integers. Padded (non RSA) matrices can be
+  // laid out column major, or interleaved in chunks of height_pad_modulo
+  // rows (see EllLayout).
+  CL_matrix cl_encode(size_t device_max_alloc_bytes, EType zero,
                       bool pad_height, bool pad_width, bool rsa,
-                      int height_pad_modulo, int width_pad_modulo);
+                      int height_pad_modulo, int width_pad_modulo,
+                      int index_bits = 32,
+                      EllLayout layout = EllLayout::ROW_MAJOR);
+
+  // Encode the matrix in sliced ELLPACK (SELL-C-sigma) form: within each
+  // window of sort_window rows, rows are sorted by length (longest first),
+  // and each slice of slice_height consecutive (sorted) rows is padded only
+  // to the length of its own longest row. Within a slice, elements are
+  // stored column major. Two extra buffers are produced: "slicePtr", the
+  // element offset of each slice (slices + 1 index_bits wide integers), and
+  // "rowPerm", the original row of each encoded row (ints). cl_height is the
+  // padded height (a multiple of slice_height), and cl_width the widest
+  // slice. Cached like cl_encode.
+  CL_matrix cl_encode_sliced(size_t device_max_alloc_bytes, EType zero,
+                             int slice_height, int sort_window,
+                             int index_bits = 32);
+
+  // Encode the matrix as ELLPACK rows of (at most) ell_width entries, plus a
+  // COO tail holding the entries that don't fit. The ELL part is exactly
+  // what cl_encode would produce (without RSA) for a matrix whose rows were
+  // cut to ell_width, and is padded and laid out the same way. The tail is
+  // three extra buffers, in row (then column) order: "cooRows" and
+  // "cooCols" (index_bits wide integers) and "cooVals". Cached like
+  // cl_encode.
+  CL_matrix cl_encode_hybrid(size_t device_max_alloc_bytes, EType zero,
+                             bool pad_height, bool pad_width,
+                             int height_pad_modulo, int width_pad_modulo,
+                             int ell_width, int index_bits = 32,
+                             EllLayout layout = EllLayout::ROW_MAJOR);
+
+  // Encode the matrix in register blocked CSR (BCSR) form, for matrices
+  // made of small dense blocks: the rows are grouped into block rows of
+  // block_rows rows, and each block row holds a dense block_rows x
+  // block_cols block for every block column (of block_cols columns) in
+  // which it has an entry. The indices buffer holds the block column of
+  // each block (index_bits wide), so there's one index per block rather
+  // than per non-zero, and the values buffer the blocks themselves, each
+  // row major, with zero for missing entries. The extra buffer "blockPtr"
+  // holds the start of each block row within the blocks (block rows + 1
+  // index_bits wide integers). cl_width is the most blocks in a block row,
+  // and cl_height the padded height (see bcsr_padded_height). The matrix
+  // must not have duplicate entries. Cached like cl_encode.
+  CL_matrix cl_encode_bcsr(size_t device_max_alloc_bytes, EType zero,
+                           int block_rows, int block_cols,
+                           int index_bits = 32);
+
+  // The BCSR block size (rows, columns) whose encoding is smallest - the
+  // values of the blocks, and their indices - from a set of candidates
+  // (including 1x1, i.e. plain CSR). Reports the fill ratio of each.
+  std::pair<int, int> bcsr_block_size(int index_bits = 32);
+
+  // Encode the matrix in plain CSR form: the indices buffer holds the column
+  // of each non-zero, the values buffer its value, and the extra buffer
+  // "rowPtr" the start of each row within them (height + 1 entries). Columns
+  // and row pointers are index_bits wide integers. There's no padding, so
+  // this is just a copy of the matrix, and isn't cached.
+  CL_matrix cl_encode_csr(size_t device_max_alloc_bytes, int index_bits = 32);
+
+  // Encode the matrix as doubly compressed CSR (DCSR), for hypersparse
+  // matrices: CSR over just the rows with entries. The indices and values
+  // buffers are those of cl_encode_csr, "rowPtr" holds the start of each
+  // non-empty row (rows + 1 index_bits wide integers), and "rowIds" the
+  // original row of each (ints). cl_height is the number of non-empty rows,
+  // so kernels only launch work for those - their output is compacted the
+  // same way, and scattered back by the harness. Like CSR, this isn't
+  // cached.
+  CL_matrix cl_encode_dcsr(size_t device_max_alloc_bytes, int index_bits = 32);
+
+  // Encode the matrix as CSR with delta encoded columns: the indices buffer
+  // holds a 16 bit delta per non-zero, from the previous column of its row
+  // (or, for the first non-zero of a row, from the row's base column). A gap
+  // that doesn't fit is escaped - its delta is 0xFFFF, and its column is the
+  // next entry of the row's escapes. The extra buffers are "rowPtr" and
+  // "escapePtr" (the start of each row within the non-zeros, and within the
+  // escapes - height + 1 index_bits wide integers each), "rowBase" (the
+  // first column of each row, as ints) and "escapeCols" (the escaped
+  // columns, as ints). Like CSR, this isn't cached.
+  CL_matrix cl_encode_delta(size_t device_max_alloc_bytes,
+                            int index_bits = 32);
+
+  // the fraction of the non-empty rows whose column gaps all fit in a 16 bit
+  // delta (i.e. that need no escapes in cl_encode_delta)
+  double narrow_delta_rows();
+
+  // Encode the matrix as a sequence of column segments: segment s holds the
+  // entries in columns [s * segment_width, (s + 1) * segment_width), as a
+  // CSR matrix of just the rows with entries in the segment (as in
+  // cl_encode_dcsr), whose column indices are relative to the start of the
+  // segment - so nothing is padded, and a long row only costs its own
+  // entries. Kernels can stage each segment of x in local memory, and
+  // accumulate each row over the segments in turn. The indices and values
+  // are in order of segment, then row. The extra buffers are
+  // "segmentPtr", the first of the segment rows of each segment (segments
+  // + 1 index_bits wide integers), "segmentRows", the row of each segment
+  // row (ints, increasing within each segment), and "segmentRowPtr", the
+  // first entry of each segment row (segment rows + 1 index_bits wide
+  // integers). cl_width is the longest row, and cl_height the (optionally
+  // chunk padded) height. Cached like cl_encode.
+  CL_matrix cl_encode_segmented(size_t device_max_alloc_bytes, EType zero,
+                                int segment_width, bool pad_height,
+                                int height_pad_modulo, int index_bits = 32);
+
+  // Encode the matrix by diagonals (DIA): the indices buffer holds the
+  // offset (column - row) of each stored diagonal, as ints, in increasing
+  // order, and the values buffer the diagonals themselves - element r of
+  // diagonal d, at d * cl_height + r, is the entry in row r and column
+  // r + offset[d], or zero if there isn't one. There are no per-element
+  // indices. The diagonals stored are those chosen by dia_offsets for the
+  // given coverage (or automatically), and any entries off them go into a
+  // COO tail, as in cl_encode_hybrid ("cooRows", "cooCols" and "cooVals").
+  // cl_width is the number of diagonals, and cl_height the (optionally chunk
+  // padded) height. Cached like cl_encode.
+  CL_matrix cl_encode_dia(size_t device_max_alloc_bytes, EType zero,
+                          double coverage, bool pad_height,
+                          int height_pad_modulo, int index_bits = 32);
+
+  // The offsets (column - row), in increasing order, of the fewest
+  // diagonals which hold at least the given fraction of the non-zeros
+  // (densest first) - or, if coverage is negative, of every diagonal that's
+  // full enough to be smaller stored densely than as COO entries. Reports
+  // how concentrated the entries are on their diagonals.
+  std::vector<int> dia_offsets(double coverage);
+
+  // Sizes of encodings, for predicting their footprint without building
+  // them (see predictFootprint):
+  // the elements a sliced ELLPACK encoding with the given parameters stores
+  size_t sliced_elements(int slice_height, int sort_window);
+  // the number of rows with entries in each column segment of a segmented
+  // encoding
+  std::vector<size_t> segment_rows(int segment_width);
+  // the number of escaped column gaps before each row of a delta encoding
+  // (height + 1 entries)
+  std::vector<size_t> delta_escapes();
+  // the number of blocks in each block row of a BCSR encoding with the given
+  // block size
+  std::vector<size_t> bcsr_blocks(int block_rows, int block_cols);
+  // the height of a BCSR encoding (and of the vectors it's multiplied with),
+  // padded to whole block rows, and to the end of the last block column
+  size_t bcsr_padded_height(int block_rows, int block_cols);
+
+  // The smallest ELL width which holds at least the given fraction of the
+  // non-zeros, from the histogram of row lengths.
+  int hybrid_width(double coverage);
+
+  // The distinct values of the entries (in order of their bit patterns), if
+  // there are at most limit of them - otherwise empty.
+  std::vector<EType> distinct_values(size_t limit);
+
+  // Re-encode the values buffer of an encoded matrix (see ValueEncoding).
+  // The values buffer must hold a value per element - i.e. anything but an
+  // RSA matrix - and only that buffer is changed (e.g. the COO tail of a
+  // hybrid matrix keeps its values). Dictionary codes are code_bits (8 or
+  // 16) wide. Exits if the matrix has too many distinct values for the
+  // encoding, or if the encoding rounds values to a reduced precision and
+  // they aren't floating point, or are too big for it.
+  void compress_values(CL_matrix &matrix, EType zero, ValueEncoding encoding,
+                       int code_bits = 8);
+
+  ellpack_matrix_view ellpack_encode(void);
+
+  // A copy of rows [begin, end) of the matrix, as a matrix of its own (with
+  // the same width). Encodings of the block are cached separately from
+  // those of the whole matrix.
+  SparseMatrix row_block(size_t begin, size_t end);
+
+  // Merge entries with the same coordinates using the given policy, and
+  // optionally drop entries on the diagonal (self loops). Reports (on
+  // stderr) how much smaller that makes the entries, and the padded ELLPACK
+  // encoding.
+  void coalesce(DuplicatePolicy policy, bool drop_self_loops);
+
+  // Renumber the rows and columns of the matrix (symmetrically) with the
+  // given reordering, and report how long that took, and what it did to the
+  // bandwidth and profile. Reorderings compose.
+  void reorder(Reordering reordering);
+  // the original row (and column) of each row of the matrix, if it has been
+  // reordered - otherwise empty
+  const std::vector<int> &ordering() { return row_order; }
+  // the largest distance of an entry from the diagonal, and the sum of that
+  // distance over the rows
+  size_t bandwidth();
+  size_t profile();
 
-  SparseMatrix::ellpack_matrix<EType> &ellpack_encode(void);
+  // Structural statistics of the matrix (see MatrixProfile), calculated in a
+  // parallel pass over the rows. Cached (if caching is enabled) alongside
+  // the encodings of the matrix.
+  MatrixProfile structure_profile();
 
   void pagerank_normalise(float dampingFactor, EType zero);
   void scc_normalise();
@@ -65,30 +314,107 @@ public:
   inline int height();
   int width();
   int nonZeros();
+  // the number of entries actually stored (i.e. after expanding symmetric
+  // matrices, and coalescing)
+  size_t entries();
+  // Whether only the lower triangle of a symmetric matrix is stored. Every
+  // entry off the diagonal then stands for itself and its mirror, so
+  // encodings of the matrix are only correct for kernels which add each
+  // such entry into both its row and its column (see
+  // KernelProperties::symmetric). Transformations which would make the
+  // matrix unsymmetric (i.e. normalisation) aren't allowed.
+  bool half_stored() { return lower_only; }
+  // the number of entries of the whole matrix - i.e. counting the mirrors
+  // of a half stored matrix
+  size_t full_entries();
   void printMatrix();
 
 private:
+  // an empty matrix, for row_block to fill
+  SparseMatrix() {}
   // private initialisers
-  void load_from_file(std::string filename);
+  void load_from_file(std::string filename, bool half_storage);
+  bool load_from_cache(const std::string &cache_filename,
+                       const FileIdentity &source);
+  void write_cache(const std::string &cache_filename,
+                   const FileIdentity &source);
+  CL_matrix encode(size_t device_max_alloc_bytes, EType zero, bool pad_height,
+                   bool pad_width, bool rsa, int height_pad_modulo,
+                   int width_pad_modulo, int index_bits, EllLayout layout,
+                   size_t ell_width = std::numeric_limits<size_t>::max());
+  CL_matrix encode_hybrid(size_t device_max_alloc_bytes, EType zero,
+                          bool pad_height, bool pad_width,
+                          int height_pad_modulo, int width_pad_modulo,
+                          int ell_width, int index_bits, EllLayout layout);
+  CL_matrix encode_sliced(size_t device_max_alloc_bytes, EType zero,
+                          int slice_height, int sort_window, int index_bits);
+  CL_matrix encode_segmented(size_t device_max_alloc_bytes, EType zero,
+                             int segment_width, bool pad_height,
+                             int height_pad_modulo, int index_bits);
+  // the rows with entries in (and the entries of) each column segment, in
+  // each block of rows (as split by parallel_for_blocks)
+  void segment_block_counts(int segment_width,
+                            std::vector<std::vector<size_t>> &rows,
+                            std::vector<std::vector<size_t>> &entries);
+  CL_matrix encode_dia(size_t device_max_alloc_bytes, EType zero,
+                       double coverage, bool pad_height,
+                       int height_pad_modulo, int index_bits);
+  CL_matrix encode_bcsr(size_t device_max_alloc_bytes, EType zero,
+                        int block_rows, int block_cols, int index_bits);
+  // the block columns (in order) of a block row of a BCSR encoding
+  std::vector<int> bcsr_block_columns(size_t block_row, int block_rows,
+                                      int block_cols);
+  // the cache key of an encoding of the matrix with the given parameters
+  uint64_t encoding_key(EType zero, std::initializer_list<uint64_t> parameters);
+  // load an encoding from the cache, or run the encoder and cache the result
+  template <typename Encoder>
+  CL_matrix cached_encode(uint64_t key, size_t device_max_alloc_bytes,
+                          Encoder encoder);
+  bool load_encoded(const std::string &encoded_filename, uint64_t key,
+                    size_t device_max_alloc_bytes, CL_matrix &matrix);
+  void write_encoded(const std::string &encoded_filename, uint64_t key,
+                     const CL_matrix &matrix);
+  // mix a transformation of the matrix (e.g. normalisation) into the content
+  // hash, so that we don't reuse encodings of the untransformed matrix
+  void record_transform(uint64_t transform, uint64_t parameter);
   void calculate_ellpack();
   void calculate_transposed_sum();
+  // move any entries above the diagonal to their mirror below it (after
+  // renumbering a half stored matrix)
+  void fold_lower_triangle();
+  // exit if the matrix is half stored, as the given transformation needs the
+  // whole matrix
+  void check_whole(const std::string &transform);
+  MatrixProfile calculate_profile();
 
-  // tuples are: x, y, value
-  // various members used to load from a file
-  std::vector<std::tuple<int, int, EType>> nz_entries;
+  // The non-zero entries, in CSR form: the entries of row r are
+  // [row_ptr[r], row_ptr[r+1]) of col_idx/vals, sorted by column.
+  // Note that (as throughout the harness) rows are indexed by the *second*
+  // coordinate of each matrix market entry, and columns by the first.
+  std::vector<size_t> row_ptr;
+  std::vector<int> col_idx;
+  std::vector<EType> vals;
   int rows;
   int cols;
   int nonz;
+  bool symmetric = false;
+  bool pattern = false;
+  // see half_stored()
+  bool lower_only = false;
 
   // ellpack data
   bool ellpack_calculated = false;
   std::vector<unsigned int> row_lengths;
   std::vector<EType> column_sums;
   unsigned int max_width = 0;
-  SparseMatrix::ellpack_matrix<EType> ellpackMatrix;
 
   // file data
   std::string filename;
+  bool use_cache;
+  // hash of the source file, and of everything done to the matrix since
+  uint64_t content_hash = 0;
+  // see ordering()
+  std::vector<int> row_order;
 };
 
 #endif
\ No newline at end of file
@@ -1,16 +1,23 @@
 #pragma once
 
+#include <cmath>
+#include <limits>
+#include <type_traits>
+
 #include "sparse_matrix.h"
 #include "vector_generator.h"
 #include "csds_timer.h"
 
 template <typename T> class Gold {
 public:
-  static std::vector<T> spmv(SparseMatrix<T> A, XVectorGenerator<T> &x,
+  static std::vector<T> spmv(SparseMatrix<T> &A, XVectorGenerator<T> &x,
                              YVectorGenerator<T> &y, T alpha, T beta, T zero) {
     start_timer(spmv, gold);
     // get the matrix in ellpack format
     auto ellpack_a = A.ellpack_encode();
+    // if the matrix has been reordered, work in the original order
+    auto &order = A.ordering();
+    auto original = [&](int ix) { return order.empty() ? ix : order[ix]; };
     // // create a vector of the right height
     std::vector<T> result(ellpack_a.size(), 0);
     // iterate over the rows
@@ -19,14 +26,142 @@ public:
       T acc = zero;
       for (unsigned int j = 0; j < ellpack_a[i].size(); j++) {
         auto elem = ellpack_a[i][j];
-        acc += (alpha * (x.get(elem.first) * elem.second)) +
+        acc += (alpha * (x.get(original(elem.first)) * elem.second)) +
                (beta * y.get(elem.second));
       }
-      result[i] = acc;
+      result[original(i)] = acc;
+    }
+    // the entries of a half stored symmetric matrix stand for their mirrors
+    // too
+    if (A.half_stored()) {
+      for (unsigned int i = 0; i < ellpack_a.size(); i++) {
+        for (unsigned int j = 0; j < ellpack_a[i].size(); j++) {
+          auto elem = ellpack_a[i][j];
+          if (elem.first != static_cast<int>(i)) {
+            result[original(elem.first)] +=
+                (alpha * (x.get(original(i)) * elem.second)) +
+                (beta * y.get(elem.second));
+          }
+        }
+      }
     }
     return result;
   }
 
+  // The result the pr harness iterates to: each iteration computes alpha *
+  // A x + beta * y, which becomes both the x and the y of the next, until no
+  // value changes by delta or more. This iterates in double whatever T is,
+  // so that the gold itself isn't held back by round-off.
+  //
+  // If bound isn't null, it's set to how far a correct kernel's output may
+  // be from the gold, in each row (in the original order). Each iteration
+  // adds the rounding error of its SpMV (as in spmv_error_bound, with that
+  // iteration's input) to the error of its input, carried through |alpha A|
+  // and |beta|. The error has to be followed iteration by iteration, as
+  // the values shrink as they converge, and the errors of the earlier (and
+  // larger) iterations stay behind in them.
+  static std::vector<T> pagerank(SparseMatrix<T> &A, XVectorGenerator<T> &x,
+                                 YVectorGenerator<T> &y, T alpha, T beta,
+                                 double delta, double rounding = 0.0,
+                                 std::vector<double> *bound = nullptr) {
+    start_timer(pagerank, gold);
+    const double epsilon = std::is_floating_point<T>::value
+                               ? std::numeric_limits<T>::epsilon() / 2
+                               : 0.0;
+    auto ellpack_a = A.ellpack_encode();
+    auto &order = A.ordering();
+    auto original = [&](int ix) { return order.empty() ? ix : order[ix]; };
+    // (in the original order)
+    std::vector<double> input(ellpack_a.size());
+    std::vector<double> bias(ellpack_a.size());
+    std::vector<double> output(ellpack_a.size());
+    std::vector<double> input_error(bound ? ellpack_a.size() : 0, 0.0);
+    std::vector<double> output_error(input_error.size());
+    for (size_t i = 0; i < input.size(); i++) {
+      input[i] = static_cast<double>(x.get(i));
+      bias[i] = static_cast<double>(y.get(i));
+    }
+    const double a = std::fabs(static_cast<double>(alpha));
+    const double b = std::fabs(static_cast<double>(beta));
+    bool converged = false;
+    while (!converged) {
+      converged = true;
+      for (unsigned int i = 0; i < ellpack_a.size(); i++) {
+        double acc = 0.0;
+        double magnitude = 0.0;
+        double carried = 0.0;
+        for (unsigned int j = 0; j < ellpack_a[i].size(); j++) {
+          int col = original(ellpack_a[i][j].first);
+          double value = static_cast<double>(ellpack_a[i][j].second);
+          acc += input[col] * value;
+          if (bound) {
+            magnitude += std::fabs(input[col] * value);
+            carried += std::fabs(value) * input_error[col];
+          }
+        }
+        double result = static_cast<double>(alpha) * acc +
+                        static_cast<double>(beta) * bias[original(i)];
+        converged =
+            converged && std::fabs(input[original(i)] - result) < delta;
+        output[original(i)] = result;
+        if (bound) {
+          // (the bias is the previous input, so it has the same error)
+          output_error[original(i)] =
+              (rounding + ellpack_a[i].size() * epsilon) * a * magnitude +
+              epsilon * std::fabs(result) + a * carried +
+              b * input_error[original(i)];
+        }
+      }
+      input.swap(output);
+      input_error.swap(output_error);
+      bias = input;
+    }
+    if (bound) {
+      bound->swap(input_error);
+    }
+    return std::vector<T>(input.begin(), input.end());
+  }
+
+  // How far a correct kernel's output may be from the gold, in each row (in
+  // the original order): rounding each value to a reduced precision (see
+  // value_rounding), and rounding each addition of the row in T, moves a
+  // dot product by up to that much of the sum of the magnitudes of its
+  // products - which, with mixed signs, can be far more than the result.
+  static std::vector<double> spmv_error_bound(SparseMatrix<T> &A,
+                                              XVectorGenerator<T> &x, T alpha,
+                                              double rounding) {
+    start_timer(spmv_error_bound, gold);
+    const double epsilon = std::is_floating_point<T>::value
+                               ? std::numeric_limits<T>::epsilon() / 2
+                               : 0.0;
+    auto ellpack_a = A.ellpack_encode();
+    auto &order = A.ordering();
+    auto original = [&](int ix) { return order.empty() ? ix : order[ix]; };
+    std::vector<double> magnitude(ellpack_a.size(), 0.0);
+    std::vector<size_t> length(ellpack_a.size(), 0);
+    auto add = [&](int row, int col, T value) {
+      magnitude[original(row)] +=
+          std::fabs(static_cast<double>(x.get(original(col))) *
+                    static_cast<double>(value));
+      length[original(row)]++;
+    };
+    for (unsigned int i = 0; i < ellpack_a.size(); i++) {
+      for (unsigned int j = 0; j < ellpack_a[i].size(); j++) {
+        add(i, ellpack_a[i][j].first, ellpack_a[i][j].second);
+        // (and the mirrors of a half stored symmetric matrix)
+        if (A.half_stored() && ellpack_a[i][j].first != static_cast<int>(i)) {
+          add(ellpack_a[i][j].first, i, ellpack_a[i][j].second);
+        }
+      }
+    }
+    std::vector<double> bound(ellpack_a.size());
+    for (size_t i = 0; i < bound.size(); i++) {
+      bound[i] = (rounding + length[i] * epsilon) *
+                 std::fabs(static_cast<double>(alpha)) * magnitude[i];
+    }
+    return bound;
+  }
+
 private:
   Gold() {}
 };
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+
+// How closely the output of a kernel matched the gold, for the precision its
+// values were stored and computed in (see Harness::check_result). Errors
+// are relative to the gold value - or absolute, for gold values smaller
+// than one - and an output is wrong if its error is more than the
+// tolerance, plus the error bound of its row (see Harness::setErrorBounds).
+struct ValueAccuracy {
+  // e.g. "float", "double", or "half/float" for half values accumulated in
+  // float (see ArgContainer::precision)
+  std::string precision;
+  double tolerance = 0.0;
+  size_t checked = 0;
+  size_t wrong = 0;
+  double max_error = 0.0;
+  double mean_error = 0.0;
+
+  static std::string printHeader() {
+    std::ostringstream out;
+    out << "INSERT INTO value_accuracy (matrix, kernel, experiment_id, "
+        << "precision, tolerance, checked, wrong, max_error, mean_error) "
+        << "VALUES ";
+    return out.str();
+  }
+
+  // An insert of the accuracy, to join with the benchmark results (see
+  // SqlStat) on the matrix, kernel and experiment id.
+  std::string makeSqlCommand(const std::string &matrix_name,
+                             const std::string &kernel_name,
+                             const std::string &experiment_id) const {
+    std::ostringstream out;
+    out << printHeader() << "(\"" << matrix_name << "\", \"" << kernel_name
+        << "\", \"" << experiment_id << "\", \"" << precision << "\", "
+        << tolerance << ", " << checked << ", " << wrong << ", " << max_error
+        << ", " << mean_error << ");";
+    return out.str();
+  }
+};
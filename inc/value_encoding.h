@@ -0,0 +1,147 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "common.h"
+
+// How the values of an encoded matrix are stored. Many matrices only have a
+// handful of distinct values (pattern matrices are all one, and after
+// PageRank normalisation every entry of a column has the same value), so a
+// full value per non-zero wastes most of the bandwidth of the values stream.
+//  - PLAIN: a value per element (the default)
+//  - DICTIONARY: the distinct values (and the zero used for padding) in an
+//    extra buffer, "valueDict", and an 8 or 16 bit code per element - the
+//    index of its value in the dictionary
+//  - PATTERN: every entry has the same value, so the values buffer holds
+//    just that one value
+//  - HALF: a 16 bit IEEE half precision value per element (rounded to
+//    nearest), which the kernel reads with vload_half and accumulates in
+//    full precision
+//  - BFLOAT16: the top 16 bits of the single precision value per element
+//    (rounded to nearest), which the kernel shifts back up into a float
+// The first three are exact, and the reduced precisions only apply to
+// floating point matrices.
+enum class ValueEncoding { PLAIN, DICTIONARY, PATTERN, HALF, BFLOAT16 };
+
+inline const char *value_encoding_name(ValueEncoding encoding) {
+  switch (encoding) {
+  case ValueEncoding::PLAIN:
+    return "plain";
+  case ValueEncoding::DICTIONARY:
+    return "dictionary";
+  case ValueEncoding::PATTERN:
+    return "pattern";
+  case ValueEncoding::HALF:
+    return "half";
+  case ValueEncoding::BFLOAT16:
+    return "bfloat16";
+  }
+  return "unknown";
+}
+
+// Parse a value encoding from a kernel's properties
+inline ValueEncoding parse_value_encoding(const std::string &name) {
+  for (ValueEncoding encoding : {ValueEncoding::PLAIN,
+                                 ValueEncoding::DICTIONARY,
+                                 ValueEncoding::PATTERN, ValueEncoding::HALF,
+                                 ValueEncoding::BFLOAT16}) {
+    if (name == value_encoding_name(encoding)) {
+      return encoding;
+    }
+  }
+  std::cerr << "Unknown value encoding " << name
+            << " (expected plain, dictionary, pattern, half or bfloat16)"
+            << ENDL;
+  exit(-1);
+}
+
+// The relative error of rounding a value to the precision of an encoding
+// (its unit roundoff) - zero for the exact encodings
+inline double value_rounding(ValueEncoding encoding) {
+  switch (encoding) {
+  case ValueEncoding::HALF:
+    return std::ldexp(1.0, -11);
+  case ValueEncoding::BFLOAT16:
+    return std::ldexp(1.0, -8);
+  default:
+    return 0.0;
+  }
+}
+
+// Round a float to the nearest IEEE half (ties to even). Values too big for
+// a half become infinite, and values too small become subnormal, or zero.
+inline uint16_t float_to_half(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  const uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude >= 0x7f800000) {
+    // infinity, or a (quiet) NaN
+    return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+  }
+  if (magnitude >= 0x477ff000) {
+    // at least 65520, which rounds past the largest half
+    return sign | 0x7c00;
+  }
+  uint32_t half, remainder, halfway;
+  if (magnitude >= 0x38800000) {
+    // normal: rebias the exponent, and drop 13 bits of the mantissa
+    half = (magnitude - 0x38000000) >> 13;
+    remainder = magnitude & 0x1fff;
+    halfway = 0x1000;
+  } else {
+    // subnormal: a multiple of 2^-24
+    const uint32_t shift = 126 - (magnitude >> 23);
+    if (shift > 24) {
+      return sign;
+    }
+    const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+    half = mantissa >> shift;
+    remainder = mantissa & ((1u << shift) - 1);
+    halfway = 1u << (shift - 1);
+  }
+  // (a carry out of the mantissa correctly bumps the exponent)
+  if (remainder > halfway || (remainder == halfway && (half & 1))) {
+    half++;
+  }
+  return sign | static_cast<uint16_t>(half);
+}
+
+inline float half_to_float(uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1f;
+  const uint32_t mantissa = half & 0x3ff;
+  if (exponent == 0) {
+    float value = std::ldexp(static_cast<float>(mantissa), -24);
+    return sign ? -value : value;
+  }
+  uint32_t bits = sign | (exponent == 0x1f
+                              ? 0x7f800000 | (mantissa << 13)
+                              : ((exponent + 112) << 23) | (mantissa << 13));
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// Round a float to the nearest bfloat16 (ties to even)
+inline uint16_t float_to_bfloat16(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  if ((bits & 0x7fffffff) > 0x7f800000) {
+    // keep NaNs NaN (and quiet)
+    return static_cast<uint16_t>((bits >> 16) | 0x40);
+  }
+  bits += 0x7fff + ((bits >> 16) & 1);
+  return static_cast<uint16_t>(bits >> 16);
+}
+
+inline float bfloat16_to_float(uint16_t bfloat) {
+  uint32_t bits = static_cast<uint32_t>(bfloat) << 16;
+  float value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+}
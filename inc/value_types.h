@@ -0,0 +1,22 @@
+#pragma once
+
+// Names for the value types the harness is instantiated for. These are used
+// to key on-disk caches, so that (for example) an int BFS harness and a float
+// SPMV harness working on the same matrix don't trample each other's data.
+template <typename T> struct ValueType;
+
+template <> struct ValueType<float> {
+  static const char *name() { return "float"; }
+};
+
+template <> struct ValueType<double> {
+  static const char *name() { return "double"; }
+};
+
+template <> struct ValueType<int> {
+  static const char *name() { return "int"; }
+};
+
+template <> struct ValueType<bool> {
+  static const char *name() { return "bool"; }
+};
@@ -24,6 +24,18 @@ public:
     });
     return v;
   };
+
+  // generate a vector for a reordered matrix: element i is the element the
+  // original matrix had at order[i] (elements past the end of the order are
+  // left where they were)
+  std::vector<T> generate(int length, const std::vector<int> &order) {
+    start_timer(generate_ordered, VectorGenerator);
+    std::vector<T> v(length);
+    for (int i = 0; i < length; i++) {
+      v[i] = get(static_cast<size_t>(i) < order.size() ? order[i] : i);
+    }
+    return v;
+  };
 };
 
 //////// More specific generators:
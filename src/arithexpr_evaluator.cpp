@@ -6,25 +6,40 @@ typedef exprtk::symbol_table<double> symbol_table_t;
 typedef exprtk::expression<double> expression_t;
 typedef exprtk::parser<double> parser_t;
 
+std::string Evaluator::variable(const std::string &size) {
+  // the numbering the generated kernels use
+  static const std::map<std::string, int> numbers = {
+      {"MWidthC", 1},     {"MHeight", 2}, {"VLength", 3},
+      {"SliceHeight", 4}, {"CooLength", 5}, {"Nnz", 6},
+      {"RowPtrLength", 7}, {"RowOffset", 8}, {"SegmentWidth", 9},
+      {"SegmentCount", 10}, {"DictLength", 11}, {"EscapeLength", 12},
+      {"BlockRows", 13}, {"BlockCols", 14}, {"SegmentRows", 15},
+  };
+  auto number = numbers.find(size);
+  if (number == numbers.end()) {
+    return "v_" + size;
+  }
+  return "v_" + size + "_" + std::to_string(number->second);
+}
+
 // todo, do I need to make some of this stuff static for performance?
-int Evaluator::evaluate(std::string expr, int v_MWidth_1, int v_MHeight_2,
-                        int v_VLength_3) {
+long Evaluator::evaluate(std::string expr, const SizeMap &sizes) {
   start_timer(evaluate, Evaluator);
   symbol_table_t symbol_table;
   parser_t parser;
   expression_t expression;
 
-  double dv_MWidth_1 = static_cast<double>(v_MWidth_1);
-  double dv_MHeight_2 = static_cast<double>(v_MHeight_2);
-  double dv_VLength_3 = static_cast<double>(v_VLength_3);
-
-  symbol_table.add_variable("v_MWidthC_1", dv_MWidth_1);
-  symbol_table.add_variable("v_MHeight_2", dv_MHeight_2);
-  symbol_table.add_variable("v_VLength_3", dv_VLength_3);
+  std::map<std::string, double> values;
+  for (auto &size : sizes) {
+    values[variable(size.first)] = static_cast<double>(size.second);
+  }
+  for (auto &value : values) {
+    symbol_table.add_variable(value.first, value.second);
+  }
 
   expression.register_symbol_table(symbol_table);
   parser.compile(expr, expression);
   double result = expression.value();
 
-  return static_cast<int>(result);
-}
\ No newline at end of file
+  return static_cast<long>(result);
+}
@@ -24,6 +24,7 @@ template <typename T> KernelConfig<T>::KernelConfig(std::string filename) {
   auto splitSize = properties.get_optional<std::string>("splitSize");
   auto chunkSize = properties.get_optional<std::string>("chunkSize");
   auto arrayType = properties.get_optional<std::string>("arrayType");
+  auto indexBits = properties.get_optional<std::string>("indexBits");
 
   auto unwrap_map = [](boost::optional<std::string> value) {
     return value ? value.get() : std::string("nothing");
@@ -35,7 +36,61 @@ template <typename T> KernelConfig<T>::KernelConfig(std::string filename) {
 
   kprops = KernelProperties(unwrap_map(outerMap), unwrap_map(innerMap),
                             unwrap_map(innerMap2), unwrap_map(arrayType),
-                            unwrap_param(splitSize), unwrap_param(chunkSize));
+                            unwrap_param(splitSize), unwrap_param(chunkSize),
+                            indexBits ? std::stoi(indexBits.get()) : 32);
+  auto sliceHeight = properties.get_optional<std::string>("sliceHeight");
+  auto sortWindow = properties.get_optional<std::string>("sortWindow");
+  if (sliceHeight) {
+    kprops.sliceHeight = std::stoi(sliceHeight.get());
+  }
+  if (sortWindow) {
+    kprops.sortWindow = std::stoi(sortWindow.get());
+  }
+  auto layout = properties.get_optional<std::string>("layout");
+  if (layout) {
+    kprops.layout = layout.get();
+  }
+  auto hybridCoverage = properties.get_optional<std::string>("hybridCoverage");
+  auto hybridWidth = properties.get_optional<std::string>("hybridWidth");
+  if (hybridCoverage) {
+    kprops.hybridCoverage = std::stod(hybridCoverage.get());
+  }
+  if (hybridWidth) {
+    kprops.hybridWidth = std::stoi(hybridWidth.get());
+  }
+  auto segmentWidth = properties.get_optional<std::string>("segmentWidth");
+  if (segmentWidth) {
+    kprops.segmentWidth = std::stoi(segmentWidth.get());
+  }
+  auto diagonalCoverage =
+      properties.get_optional<std::string>("diagonalCoverage");
+  if (diagonalCoverage) {
+    kprops.diagonalCoverage = std::stod(diagonalCoverage.get());
+  }
+  auto blockRows = properties.get_optional<std::string>("blockRows");
+  auto blockCols = properties.get_optional<std::string>("blockCols");
+  if (blockRows) {
+    kprops.blockRows = std::stoi(blockRows.get());
+  }
+  if (blockCols) {
+    kprops.blockCols = std::stoi(blockCols.get());
+  }
+  auto symmetric = properties.get_optional<std::string>("symmetric");
+  if (symmetric) {
+    kprops.symmetric = symmetric.get() == "true";
+  }
+  auto valueEncoding = properties.get_optional<std::string>("valueEncoding");
+  auto codeBits = properties.get_optional<std::string>("codeBits");
+  if (valueEncoding) {
+    kprops.valueEncoding = valueEncoding.get();
+  }
+  if (codeBits) {
+    kprops.codeBits = std::stoi(codeBits.get());
+  }
+  auto valueType = properties.get_optional<std::string>("valueType");
+  if (valueType) {
+    kprops.valueType = valueType.get();
+  }
 
   std::cout << "Kernel: " << name << ", source: \n" << source << ENDL;
 
@@ -93,6 +148,15 @@ template <typename T> KernelConfig<T>::KernelConfig(std::string filename) {
     paramVars.push_back(paramvar);
     std::cout << "param var: " << paramvar << "\n";
   }
+  auto extraArgs = tree.get_child_optional("extraMatrixArgs");
+  if (extraArgs) {
+    std::cerr << "Extra matrix arguments: " << ENDL;
+    for (auto &arg : extraArgs.get()) {
+      std::string extra = arg.second.get_value<std::string>();
+      extraMatrixArgs.push_back(extra);
+      std::cout << "extra matrix arg: " << extra << "\n";
+    }
+  }
 }
 
 template <typename T> std::string &KernelConfig<T>::getSource() {
@@ -117,6 +181,11 @@ template <typename T> std::vector<std::string> KernelConfig<T>::getParamVars() {
   return paramVars;
 }
 
+template <typename T>
+std::vector<std::string> KernelConfig<T>::getExtraMatrixArgs() {
+  return extraMatrixArgs;
+}
+
 template <typename T> ArgDescr *KernelConfig<T>::getOutputArg() {
   return outputArg;
 }
@@ -125,6 +194,16 @@ template <typename T> KernelProperties KernelConfig<T>::getProperties() {
   return kprops;
 }
 
+template <typename T> void KernelConfig<T>::setSegmentWidth(int columns) {
+  kprops.segmentWidth = columns;
+}
+
+template <typename T>
+void KernelConfig<T>::setBlockSize(int rows, int cols) {
+  kprops.blockRows = rows;
+  kprops.blockCols = cols;
+}
+
 // from
 // https://stackoverflow.com/questions/38874605/generic-method-for-flattening-2d-vectors
 template <typename T>
@@ -147,9 +226,9 @@ KernelProperties::KernelProperties(std::string kname) : argcache(kname) {
 
 KernelProperties::KernelProperties(std::string om, std::string im,
                                    std::string im2, std::string at, int ss,
-                                   int cs)
+                                   int cs, int ib)
     : outerMap(om), innerMap(im), innerMap2(im2), arrayType(at), splitSize(ss),
-      chunkSize(cs) {
+      chunkSize(cs), indexBits(ib) {
   // do nothing else for now
 }
 
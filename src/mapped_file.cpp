@@ -0,0 +1,40 @@
+#include "mapped_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string &filename)
+    : _fd(-1), _data(nullptr), _size(0) {
+  _fd = open(filename.c_str(), O_RDONLY);
+  if (_fd < 0) {
+    return;
+  }
+  struct stat st;
+  if (fstat(_fd, &st) != 0 || st.st_size == 0) {
+    return;
+  }
+  _size = static_cast<size_t>(st.st_size);
+  void *addr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0);
+  if (addr == MAP_FAILED) {
+    _size = 0;
+    return;
+  }
+  _data = static_cast<const char *>(addr);
+}
+
+MappedFile::~MappedFile() {
+  if (_data != nullptr) {
+    munmap(const_cast<char *>(_data), _size);
+  }
+  if (_fd >= 0) {
+    close(_fd);
+  }
+}
+
+void MappedFile::adviseSequential() {
+  if (_data != nullptr) {
+    madvise(const_cast<char *>(_data), _size, MADV_SEQUENTIAL);
+  }
+}
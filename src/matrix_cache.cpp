@@ -0,0 +1,177 @@
+#include "matrix_cache.h"
+
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Logger.h"
+#include "csds_timer.h"
+#include "mapped_file.h"
+
+#define MATRIX_CACHE_MAGIC "SPMVMTX"
+#define ENCODED_CACHE_MAGIC "SPMVENC"
+
+// fingerprinting parameters (see FileIdentity::of)
+#define FINGERPRINT_EDGE_BYTES (1024 * 1024)
+#define FINGERPRINT_BLOCK_BYTES 4096
+#define FINGERPRINT_BLOCKS 64
+
+uint64_t hash_combine(uint64_t hash, uint64_t value) {
+  const uint64_t m = 0xc6a4a7935bd1e995ULL;
+  value *= m;
+  value ^= value >> 47;
+  value *= m;
+  hash ^= value;
+  hash *= m;
+  return hash;
+}
+
+uint64_t hash_bytes(const char *data, size_t length, uint64_t seed) {
+  uint64_t hash = seed ^ (length * 0xc6a4a7935bd1e995ULL);
+  size_t words = length / sizeof(uint64_t);
+  for (size_t i = 0; i < words; i++) {
+    uint64_t value;
+    memcpy(&value, data + i * sizeof(uint64_t), sizeof(uint64_t));
+    hash = hash_combine(hash, value);
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + words * sizeof(uint64_t),
+         length - words * sizeof(uint64_t));
+  return hash_combine(hash, tail);
+}
+
+bool FileIdentity::of(const std::string &filename, FileIdentity &identity) {
+  start_timer(of, FileIdentity);
+  struct stat st;
+  if (stat(filename.c_str(), &st) != 0) {
+    return false;
+  }
+  identity.size = static_cast<uint64_t>(st.st_size);
+  identity.mtime_ns =
+      static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL +
+      static_cast<int64_t>(st.st_mtim.tv_nsec);
+
+  MappedFile file(filename);
+  if (!file.valid()) {
+    return false;
+  }
+  const char *data = file.data();
+  size_t size = file.size();
+  uint64_t hash = hash_combine(0, size);
+  if (size <= 2 * FINGERPRINT_EDGE_BYTES +
+                  FINGERPRINT_BLOCKS * FINGERPRINT_BLOCK_BYTES) {
+    // small enough to just hash the whole thing
+    hash = hash_bytes(data, size, hash);
+  } else {
+    hash = hash_bytes(data, FINGERPRINT_EDGE_BYTES, hash);
+    hash = hash_bytes(data + size - FINGERPRINT_EDGE_BYTES,
+                      FINGERPRINT_EDGE_BYTES, hash);
+    size_t stride = (size - FINGERPRINT_BLOCK_BYTES) / FINGERPRINT_BLOCKS;
+    for (size_t b = 0; b < FINGERPRINT_BLOCKS; b++) {
+      hash = hash_bytes(data + b * stride, FINGERPRINT_BLOCK_BYTES, hash);
+    }
+  }
+  identity.fingerprint = hash;
+  return true;
+}
+
+MatrixCacheHeader MatrixCache::make_header(const FileIdentity &source,
+                                           const char *type,
+                                           uint32_t value_size) {
+  MatrixCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, MATRIX_CACHE_MAGIC, sizeof(header.magic));
+  header.version = MATRIX_CACHE_VERSION;
+  header.value_size = value_size;
+  strncpy(header.value_type, type, sizeof(header.value_type) - 1);
+  header.source_size = source.size;
+  header.source_mtime_ns = source.mtime_ns;
+  header.source_fingerprint = source.fingerprint;
+  return header;
+}
+
+bool MatrixCache::header_matches(const MatrixCacheHeader &header,
+                                 const FileIdentity &source, const char *type,
+                                 uint32_t value_size) {
+  return strncmp(header.magic, MATRIX_CACHE_MAGIC, sizeof(header.magic)) ==
+             0 &&
+         header.version == MATRIX_CACHE_VERSION &&
+         header.value_size == value_size &&
+         strncmp(header.value_type, type, sizeof(header.value_type)) == 0 &&
+         header.source_size == source.size &&
+         header.source_mtime_ns == source.mtime_ns &&
+         header.source_fingerprint == source.fingerprint;
+}
+
+EncodedCacheHeader MatrixCache::make_encoded_header(uint64_t key,
+                                                    const char *type,
+                                                    uint32_t value_size) {
+  EncodedCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  strncpy(header.magic, ENCODED_CACHE_MAGIC, sizeof(header.magic));
+  header.version = MATRIX_CACHE_VERSION;
+  header.value_size = value_size;
+  strncpy(header.value_type, type, sizeof(header.value_type) - 1);
+  header.key = key;
+  return header;
+}
+
+bool MatrixCache::encoded_header_matches(const EncodedCacheHeader &header,
+                                         uint64_t key, const char *type,
+                                         uint32_t value_size) {
+  return strncmp(header.magic, ENCODED_CACHE_MAGIC, sizeof(header.magic)) ==
+             0 &&
+         header.version == MATRIX_CACHE_VERSION &&
+         header.value_size == value_size &&
+         strncmp(header.value_type, type, sizeof(header.value_type)) == 0 &&
+         header.key == key;
+}
+
+std::string MatrixCache::encoded_filename(const std::string &matrix_filename,
+                                          const char *type, uint64_t key) {
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+  return matrix_filename + "." + type + ".encoded." + hex + ".cache";
+}
+
+bool MatrixCache::write(
+    const std::string &filename, const void *header, size_t header_size,
+    const std::vector<std::pair<const void *, size_t>> &arrays) {
+  start_timer(write, MatrixCache);
+  std::string temp_filename =
+      filename + ".tmp." + std::to_string(static_cast<long>(getpid()));
+  FILE *f = fopen(temp_filename.c_str(), "wb");
+  if (f == NULL) {
+    LOG_WARNING("Could not open cache file ", temp_filename, " for writing");
+    return false;
+  }
+  const char padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  std::vector<std::pair<const void *, size_t>> blocks;
+  blocks.push_back(std::make_pair(header, header_size));
+  blocks.insert(blocks.end(), arrays.begin(), arrays.end());
+  bool ok = true;
+  size_t offset = 0;
+  for (auto &array : blocks) {
+    if (!ok) {
+      break;
+    }
+    if (array.second > 0) {
+      ok = fwrite(array.first, 1, array.second, f) == array.second;
+    }
+    offset += array.second;
+    size_t aligned = align(offset);
+    if (ok && aligned != offset) {
+      ok = fwrite(padding, 1, aligned - offset, f) == aligned - offset;
+    }
+    offset = aligned;
+  }
+  ok = (fclose(f) == 0) && ok;
+  if (ok) {
+    ok = rename(temp_filename.c_str(), filename.c_str()) == 0;
+  }
+  if (!ok) {
+    LOG_WARNING("Failed to write cache file ", filename);
+    unlink(temp_filename.c_str());
+  }
+  return ok;
+}
@@ -0,0 +1,307 @@
+#include "mtx_parser.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "Logger.h"
+#include "common.h"
+#include "csds_timer.h"
+#include "parallel_utils.h"
+
+// =========================================================================
+// Hand written scanners. These work on [p, end) ranges of the mapped file,
+// which (unlike the strings fscanf/strtod expect) are not null terminated.
+// =========================================================================
+namespace {
+
+inline bool is_blank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *skip_blanks(const char *p, const char *end) {
+  while (p < end && is_blank(*p)) {
+    p++;
+  }
+  return p;
+}
+
+inline const char *skip_line(const char *p, const char *end) {
+  const char *nl =
+      static_cast<const char *>(memchr(p, '\n', static_cast<size_t>(end - p)));
+  return nl == nullptr ? end : nl + 1;
+}
+
+// parse a (possibly signed) decimal integer, returns nullptr on failure
+inline const char *scan_int(const char *p, const char *end, int &out) {
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  const char *start = p;
+  long value = 0;
+  while (p < end && *p >= '0' && *p <= '9') {
+    value = value * 10 + (*p - '0');
+    p++;
+  }
+  if (p == start) {
+    return nullptr;
+  }
+  out = static_cast<int>(negative ? -value : value);
+  return p;
+}
+
+// exactly representable powers of ten, for the fast path below
+const double exact_powers_of_ten[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+// parse a floating point value. When the mantissa fits in 53 bits, and the
+// decimal exponent is small, a single multiply/divide by an exact power of
+// ten is correctly rounded (Clinger's fast path), which covers almost every
+// value in the matrices we use. Anything else falls back to strtod.
+inline const char *scan_real(const char *p, const char *end, double &out) {
+  const char *token = p;
+  bool negative = false;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = *p == '-';
+    p++;
+  }
+  uint64_t mantissa = 0;
+  int digits = 0;
+  int exponent = 0;
+  bool any_digits = false;
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + static_cast<uint64_t>(*p - '0');
+      if (mantissa != 0) {
+        digits++;
+      }
+    } else {
+      exponent++;
+      digits++;
+    }
+    any_digits = true;
+    p++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + static_cast<uint64_t>(*p - '0');
+        exponent--;
+        if (mantissa != 0) {
+          digits++;
+        }
+      } else {
+        digits++;
+      }
+      any_digits = true;
+      p++;
+    }
+  }
+  if (any_digits && p < end && (*p == 'e' || *p == 'E')) {
+    p++;
+    int exp_value = 0;
+    const char *exp_end = scan_int(p, end, exp_value);
+    if (exp_end == nullptr) {
+      any_digits = false;
+    } else {
+      exponent += exp_value;
+      p = exp_end;
+    }
+  }
+  if (any_digits && digits <= 19 && mantissa < (uint64_t(1) << 53) &&
+      exponent >= -22 && exponent <= 22) {
+    double value = static_cast<double>(mantissa);
+    if (exponent < 0) {
+      value /= exact_powers_of_ten[-exponent];
+    } else {
+      value *= exact_powers_of_ten[exponent];
+    }
+    out = negative ? -value : value;
+    return p;
+  }
+  // slow path: copy the token somewhere null terminated, and use strtod
+  const char *token_end = token;
+  while (token_end < end && !is_blank(*token_end) && *token_end != '\n') {
+    token_end++;
+  }
+  char buffer[MM_MAX_TOKEN_LENGTH];
+  size_t length = std::min<size_t>(token_end - token, sizeof(buffer) - 1);
+  memcpy(buffer, token, length);
+  buffer[length] = '\0';
+  char *parsed_end = nullptr;
+  out = strtod(buffer, &parsed_end);
+  if (parsed_end == buffer) {
+    return nullptr;
+  }
+  return token + (parsed_end - buffer);
+}
+
+// per-thread output of the body parse
+template <typename T> struct ParsedChunk {
+  std::vector<int> xs;
+  std::vector<int> ys;
+  std::vector<T> vals;
+  size_t lines = 0;
+  size_t bad_lines = 0;
+};
+
+} // namespace
+
+MTXParser::MTXParser(const std::string &filename)
+    : _file(filename), _rows(0), _cols(0), _nonz(0), _body_offset(0) {
+  FILE *f;
+  // Open the file descriptor
+  if ((f = fopen(filename.c_str(), "r")) == NULL || !_file.valid()) {
+    std::cerr << "Failed to open matrix file " << filename << ENDL;
+    exit(-1);
+  }
+  // Read in the banner
+  if (mm_read_banner(f, &_matcode) != 0) {
+    std::cerr << "Could not read matrix market banner" << ENDL;
+    exit(-1);
+  }
+  char *typecode = mm_typecode_to_str(_matcode);
+  std::cerr << "Matcode: " << (typecode ? typecode : "unknown") << ENDL;
+  // Check the banner properties
+  if (!(mm_is_matrix(_matcode) && mm_is_coordinate(_matcode) &&
+        (mm_is_real(_matcode) || mm_is_integer(_matcode) ||
+         mm_is_pattern(_matcode)))) {
+    std::cerr << "Cannot process this matrix type. Typecode: "
+              << (typecode ? typecode : "unknown") << ENDL;
+    exit(-1);
+  }
+  free(typecode);
+  // Find size of matrix
+  if (mm_read_mtx_crd_size(f, &_rows, &_cols, &_nonz) != 0) {
+    std::cerr << "Cannot read matrix sizes and number of non-zeros" << ENDL;
+    exit(-1);
+  }
+  // everything after the size line is the body, which we parse from the map
+  _body_offset = static_cast<size_t>(ftell(f));
+  fclose(f);
+  std::cerr << "Rows " << _rows << " cols " << _cols << " non-zeros " << _nonz
+            << ENDL;
+}
+
+template <typename T>
+void MTXParser::parse(std::vector<int> &xs, std::vector<int> &ys,
+                      std::vector<T> &vals, unsigned int threads,
+                      bool mirror) {
+  start_timer(parse, MTXParser);
+  _file.adviseSequential();
+
+  const char *body = _file.data() + _body_offset;
+  const char *body_end = _file.data() + _file.size();
+  size_t body_length = static_cast<size_t>(body_end - body);
+
+  const bool pat = pattern();
+  const bool sym = symmetric() && mirror;
+  // rough estimate of the bytes per line, so that chunks can reserve memory
+  const size_t line_bytes =
+      _nonz > 0 ? std::max<size_t>(1, body_length / _nonz) : 1;
+
+  std::vector<ParsedChunk<T>> chunks(block_count(0, body_length, threads));
+
+  parallel_for_blocks(
+      0, body_length,
+      [&](size_t begin, size_t end, unsigned int chunk_id) {
+        ParsedChunk<T> &chunk = chunks[chunk_id];
+        // align the chunk to whole lines: a chunk owns every line that
+        // *starts* within [begin, end)
+        const char *p = body + begin;
+        if (begin != 0 && *(p - 1) != '\n') {
+          p = skip_line(p, body_end);
+        }
+        const char *chunk_end = body + end;
+
+        size_t expected = ((end - begin) / line_bytes + 1) * (sym ? 2 : 1);
+        chunk.xs.reserve(expected);
+        chunk.ys.reserve(expected);
+        chunk.vals.reserve(expected);
+
+        while (p < chunk_end) {
+          p = skip_blanks(p, body_end);
+          if (p >= body_end) {
+            break;
+          }
+          // skip empty lines, and comments
+          if (*p == '\n' || *p == '%') {
+            p = skip_line(p, body_end);
+            continue;
+          }
+          int I, J;
+          double val = 1.0;
+          const char *q = scan_int(p, body_end, I);
+          if (q != nullptr) {
+            q = scan_int(skip_blanks(q, body_end), body_end, J);
+          }
+          if (q != nullptr && !pat) {
+            q = scan_real(skip_blanks(q, body_end), body_end, val);
+          }
+          if (q == nullptr) {
+            chunk.bad_lines++;
+            p = skip_line(p, body_end);
+            continue;
+          }
+          // adjust from 1 based to 0 based
+          I--;
+          J--;
+          chunk.xs.push_back(I);
+          chunk.ys.push_back(J);
+          chunk.vals.push_back(static_cast<T>(val));
+          if (sym && I != J) {
+            chunk.xs.push_back(J);
+            chunk.ys.push_back(I);
+            chunk.vals.push_back(static_cast<T>(val));
+          }
+          chunk.lines++;
+          p = skip_line(q, body_end);
+        }
+      },
+      threads);
+
+  // stitch the chunks together, in order
+  std::vector<size_t> offsets(chunks.size() + 1, 0);
+  size_t lines = 0;
+  size_t bad_lines = 0;
+  for (unsigned int c = 0; c < chunks.size(); c++) {
+    offsets[c + 1] = offsets[c] + chunks[c].xs.size();
+    lines += chunks[c].lines;
+    bad_lines += chunks[c].bad_lines;
+  }
+  if (bad_lines > 0) {
+    LOG_WARNING("Skipped ", bad_lines, " malformed lines in matrix body");
+  }
+  if (lines != static_cast<size_t>(_nonz)) {
+    LOG_WARNING("Matrix header declares ", _nonz, " non-zeros, but found ",
+                lines);
+  }
+  xs.resize(offsets.back());
+  ys.resize(offsets.back());
+  vals.resize(offsets.back());
+  parallel_for(0, chunks.size(),
+               [&](size_t c) {
+                 std::copy(chunks[c].xs.begin(), chunks[c].xs.end(),
+                           xs.begin() + offsets[c]);
+                 std::copy(chunks[c].ys.begin(), chunks[c].ys.end(),
+                           ys.begin() + offsets[c]);
+                 std::copy(chunks[c].vals.begin(), chunks[c].vals.end(),
+                           vals.begin() + offsets[c]);
+                 // free each chunk as soon as it's been copied
+                 chunks[c] = ParsedChunk<T>();
+               },
+               value_thread_count<T>(threads));
+}
+
+template void MTXParser::parse<float>(std::vector<int> &, std::vector<int> &,
+                                      std::vector<float> &, unsigned int, bool);
+template void MTXParser::parse<int>(std::vector<int> &, std::vector<int> &,
+                                    std::vector<int> &, unsigned int, bool);
+template void MTXParser::parse<bool>(std::vector<int> &, std::vector<int> &,
+                                     std::vector<bool> &, unsigned int, bool);
+template void MTXParser::parse<double>(std::vector<int> &, std::vector<int> &,
+                                       std::vector<double> &, unsigned int,
+                                       bool);
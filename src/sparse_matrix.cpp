@@ -1,74 +1,305 @@
 #include "sparse_matrix.h"
 
-// CONSTRUCTORS
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <type_traits>
+
+namespace {
+
+// std::vector<bool> has no data() - so go through a byte array when moving
+// values to and from the cache files
+template <typename T>
+const void *raw_values(const std::vector<T> &vals, std::vector<char> &) {
+  return vals.data();
+}
 
-template <typename T> SparseMatrix<T>::SparseMatrix(std::string filename) {
-  // Constructor from file
-  load_from_file(filename);
+inline const void *raw_values(const std::vector<bool> &vals,
+                              std::vector<char> &scratch) {
+  scratch.assign(vals.begin(), vals.end());
+  return scratch.data();
 }
 
 template <typename T>
-void SparseMatrix<T>::load_from_file(std::string filename) {
-  start_timer(load_from_file, SparseMatrix);
-  int ret_code;
-  MM_typecode matcode;
-  FILE *f;
+void assign_raw_values(std::vector<T> &vals, const char *data, size_t n) {
+  vals.resize(n);
+  memcpy(vals.data(), data, n * sizeof(T));
+}
+
+inline void assign_raw_values(std::vector<bool> &vals, const char *data,
+                              size_t n) {
+  vals.assign(data, data + n);
+}
+
+// write an encoded row of indices: the entries, then -1 padding
+template <typename Index>
+void write_index_row(char *row, const int *cols, size_t entries,
+                     size_t length) {
+  Index *ixs = reinterpret_cast<Index *>(row);
+  std::copy(cols, cols + entries, ixs);
+  std::fill_n(ixs + entries, length - entries, static_cast<Index>(-1));
+}
+
+// write an encoded row of indices whose elements are `stride` apart (for
+// transposed layouts)
+template <typename Index>
+void write_strided_index_row(char *row, const int *cols, size_t entries,
+                             size_t length, size_t stride) {
+  Index *ixs = reinterpret_cast<Index *>(row);
+  for (size_t j = 0; j < length; j++) {
+    ixs[j * stride] = j < entries ? static_cast<Index>(cols[j]) : -1;
+  }
+}
+
+// the encodings of a matrix, to distinguish them in the encoded cache
+enum MatrixEncoding : uint64_t {
+  ENCODING_ELLPACK = 1,
+  ENCODING_SLICED = 2,
+  ENCODING_HYBRID = 3,
+  ENCODING_SEGMENTED = 4,
+  // (not an encoding, but cached like one)
+  ENCODING_PROFILE = 5,
+  ENCODING_DIA = 6,
+  ENCODING_BCSR = 7,
+};
+
+// the encoding parameters that a MatrixProfile reports the padding of (the
+// defaults of KernelProperties)
+const int PROFILE_SLICE_HEIGHT = 32;
+const int PROFILE_SORT_WINDOW = 256;
+const double PROFILE_HYBRID_COVERAGE = 0.95;
 
-  // Open the file descriptor
-  if ((f = fopen(filename.c_str(), "r")) == NULL) {
-    std::cerr << "Failed to open matrix file " << filename << ENDL;
+// the bit pattern of a value, so that values can be compared exactly (and
+// ordered) whatever their type
+template <typename T> uint64_t value_bits(T value) {
+  uint64_t bits = 0;
+  memcpy(&bits, &value, sizeof(T));
+  return bits;
+}
+
+template <typename T> T bits_value(uint64_t bits) {
+  T value;
+  memcpy(&value, &bits, sizeof(T));
+  return value;
+}
+
+// When DIA diagonals are chosen automatically, a diagonal is stored if at
+// least this fraction of it is occupied - any sparser, and its entries take
+// less space in the COO tail (three words each) than the dense diagonal.
+const double DIA_MIN_FILL = 1.0 / 3;
+
+// The block sizes (rows x columns) that bcsr_block_size chooses between: 1x1
+// (i.e. CSR, for matrices without any block structure), the small square
+// blocks of 2 and 3 degree of freedom finite element problems, and tall
+// blocks, which need no more of x than CSR does.
+const int BCSR_CANDIDATES[][2] = {{1, 1}, {2, 1}, {2, 2}, {3, 3},
+                                  {4, 1}, {4, 4}, {8, 1}};
+
+// the delta of a column gap that doesn't fit in 16 bits, in delta encodings
+const uint32_t DELTA_ESCAPE = 0xFFFF;
+
+inline void check_index_bits(int index_bits) {
+  if (index_bits != 32 && index_bits != 64) {
+    std::cerr << "Unsupported index width: " << index_bits
+              << " bits (expected 32 or 64)" << ENDL;
     exit(-1);
   }
-  // Read in the banner
-  if (mm_read_banner(f, &matcode) != 0) {
-    std::cerr << "Could not read matrix market banner" << ENDL;
+}
+
+// only padded matrices can be transposed, and interleaving needs chunks
+inline void check_layout(EllLayout layout, bool rsa, bool pad_height) {
+  if (layout != EllLayout::ROW_MAJOR && rsa) {
+    std::cerr << "The " << ell_layout_name(layout)
+              << " layout needs a padded (non RSA) matrix" << ENDL;
     exit(-1);
   }
-  std::cerr << "Matcode: " << matcode << ENDL;
-  // Check the banner properties
-  if (mm_is_matrix(matcode) && mm_is_coordinate(matcode) &&
-      (mm_is_real(matcode) || mm_is_integer(matcode) ||
-       mm_is_pattern(matcode))) {
-    // TODO: Need to use float/integer conversions
-    // TODO: Need to check if the matrix is general/symmetric etc
-    // do matrix reading
-    // Find size of matrix
-    if ((ret_code = mm_read_mtx_crd_size(f, &rows, &cols, &nonz)) != 0) {
-      std::cerr << "Cannot read matrix sizes and number of non-zeros" << ENDL;
-      return;
-    }
-    std::cerr << "Rows " << rows << " cols " << cols << " non-zeros " << nonz
+  if (layout == EllLayout::INTERLEAVED && !pad_height) {
+    std::cerr << "The interleaved layout needs a chunk size (chunkSize)"
               << ENDL;
-    // read the entries from the file
-    int I, J;
-    double val;
-    int pat = mm_is_pattern(matcode);
-    // reserve nonz entries for nz_entries to size nonz so that it's faster to
-    // call push_back on
-    nz_entries.reserve(mm_is_symmetric(matcode) ? nonz : nonz * 2);
-    for (int i = 0; i < nonz; i++) {
-      if (pat) {
-        fscanf(f, "%d %d\n", &I, &J);
-        val = 1.0;
-      } else {
-        fscanf(f, "%d %d %lg\n", &I, &J, &val);
-      }
-      // adjust from 1 based to 0 based
-      I--;
-      J--;
-      nz_entries.push_back(std::make_tuple(I, J, static_cast<T>(val)));
-      if (mm_is_symmetric(matcode) && I != J) {
-        nz_entries.push_back(std::make_tuple(J, I, static_cast<T>(val)));
+    exit(-1);
+  }
+}
+
+// transformations of a loaded matrix, for SparseMatrix::record_transform
+enum MatrixTransform : uint64_t {
+  TRANSFORM_COALESCE = 1,
+  TRANSFORM_PAGERANK_NORMALISE = 2,
+  TRANSFORM_SCC_NORMALISE = 3,
+  TRANSFORM_ROW_BLOCK = 4,
+  TRANSFORM_REORDER = 5,
+  TRANSFORM_HALF_STORAGE = 6,
+};
+
+// The vertices of a graph in the order reached by breadth first searches
+// from each unreached vertex in turn, in order of degree. Each vertex's
+// unreached neighbours are visited in order of degree too - lowest first
+// (as in Cuthill-McKee) or highest first.
+std::vector<int> breadth_first_order(const std::vector<size_t> &adj_ptr,
+                                     const std::vector<int> &adj,
+                                     bool lowest_first) {
+  const size_t n = adj_ptr.size() - 1;
+  auto degree = [&](int v) { return adj_ptr[v + 1] - adj_ptr[v]; };
+  auto before = [&](int a, int b) {
+    return lowest_first ? degree(a) < degree(b) : degree(a) > degree(b);
+  };
+  std::vector<int> starts(n);
+  std::iota(starts.begin(), starts.end(), 0);
+  std::stable_sort(starts.begin(), starts.end(), before);
+
+  std::vector<int> order;
+  order.reserve(n);
+  std::vector<char> reached(n, 0);
+  std::vector<int> neighbours;
+  for (int start : starts) {
+    if (reached[start]) {
+      continue;
+    }
+    reached[start] = 1;
+    order.push_back(start);
+    for (size_t next = order.size() - 1; next < order.size(); next++) {
+      int v = order[next];
+      neighbours.clear();
+      for (size_t i = adj_ptr[v]; i < adj_ptr[v + 1]; i++) {
+        if (!reached[adj[i]]) {
+          reached[adj[i]] = 1;
+          neighbours.push_back(adj[i]);
+        }
       }
+      std::stable_sort(neighbours.begin(), neighbours.end(), before);
+      order.insert(order.end(), neighbours.begin(), neighbours.end());
     }
-    nz_entries.shrink_to_fit();
+  }
+  return order;
+}
+
+} // namespace
+
+// CONSTRUCTORS
+
+template <typename T>
+SparseMatrix<T>::SparseMatrix(std::string filename, bool use_cache,
+                              bool half_storage)
+    : filename(filename), use_cache(use_cache) {
+  // Constructor from file - try the cache first, as it's far faster
+  FileIdentity source;
+  std::string cache_filename = filename + "." + ValueType<T>::name() +
+                               (half_storage ? ".half" : "") + ".cache";
+  bool have_identity = use_cache && FileIdentity::of(filename, source);
+  if (!have_identity) {
+    // without an identity we can't key any caches
+    this->use_cache = false;
   } else {
-    std::cerr << "Cannot process this matrix type. Typecode: " << matcode
+    content_hash = hash_combine(
+        hash_combine(hash_combine(0, source.size), source.mtime_ns),
+        source.fingerprint);
+  }
+  if (!have_identity || !load_from_cache(cache_filename, source)) {
+    load_from_file(filename, half_storage);
+    if (have_identity) {
+      write_cache(cache_filename, source);
+    }
+  }
+  // (only symmetric matrices have a half to store)
+  lower_only = half_storage && symmetric;
+  if (lower_only) {
+    record_transform(TRANSFORM_HALF_STORAGE, 0);
+    std::cerr << "Storing the lower triangle of the symmetric matrix: "
+              << entries() << " of its " << full_entries() << " entries"
               << ENDL;
-    exit(-1);
   }
 }
 
+template <typename T>
+void SparseMatrix<T>::load_from_file(std::string filename, bool half_storage) {
+  start_timer(load_from_file, SparseMatrix);
+  // read the header, and parse the body of the file in parallel
+  MTXParser parser(filename);
+  rows = parser.rows();
+  cols = parser.cols();
+  nonz = parser.nonZeros();
+  symmetric = parser.symmetric();
+  pattern = parser.pattern();
+
+  // the parser gives us (x, y) coordinates, i.e. (column, row), in file
+  // order - sort them into rows
+  std::vector<int> coo_rows;
+  std::vector<int> coo_cols;
+  std::vector<T> coo_vals;
+  parser.parse<T>(coo_cols, coo_rows, coo_vals, 0, !half_storage);
+  if (half_storage && symmetric) {
+    // files should only store one triangle, but make sure it's the lower
+    parallel_for(0, coo_rows.size(), [&](size_t i) {
+      if (coo_cols[i] > coo_rows[i]) {
+        std::swap(coo_cols[i], coo_rows[i]);
+      }
+    });
+  }
+  build_csr(rows, coo_rows, coo_cols, coo_vals, row_ptr, col_idx, vals);
+}
+
+template <typename T>
+bool SparseMatrix<T>::load_from_cache(const std::string &cache_filename,
+                                      const FileIdentity &source) {
+  start_timer(load_from_cache, SparseMatrix);
+  MappedFile cache(cache_filename);
+  if (!cache.valid() || cache.size() < sizeof(MatrixCacheHeader)) {
+    return false;
+  }
+  MatrixCacheHeader header;
+  memcpy(&header, cache.data(), sizeof(header));
+  if (!MatrixCache::header_matches(header, source, ValueType<T>::name(),
+                                   sizeof(T))) {
+    LOG_INFO("Ignoring stale matrix cache ", cache_filename);
+    return false;
+  }
+  // find the arrays within the file
+  size_t entries = header.entries;
+  size_t row_ptr_length = static_cast<size_t>(header.rows) + 1;
+  size_t row_ptr_offset = sizeof(header);
+  size_t cols_offset =
+      MatrixCache::align(row_ptr_offset + row_ptr_length * sizeof(size_t));
+  size_t vals_offset = MatrixCache::align(cols_offset + entries * sizeof(int));
+  if (cache.size() < vals_offset + entries * sizeof(T)) {
+    LOG_WARNING("Truncated matrix cache ", cache_filename);
+    return false;
+  }
+  LOG_INFO("Loading matrix from cache ", cache_filename);
+  rows = header.rows;
+  cols = header.cols;
+  nonz = header.nonz;
+  symmetric = (header.flags & MATRIX_CACHE_SYMMETRIC) != 0;
+  pattern = (header.flags & MATRIX_CACHE_PATTERN) != 0;
+
+  const size_t *ptrs =
+      reinterpret_cast<const size_t *>(cache.data() + row_ptr_offset);
+  const int *cs = reinterpret_cast<const int *>(cache.data() + cols_offset);
+  row_ptr.assign(ptrs, ptrs + row_ptr_length);
+  col_idx.assign(cs, cs + entries);
+  assign_raw_values(vals, cache.data() + vals_offset, entries);
+  return true;
+}
+
+template <typename T>
+void SparseMatrix<T>::write_cache(const std::string &cache_filename,
+                                  const FileIdentity &source) {
+  start_timer(write_cache, SparseMatrix);
+  MatrixCacheHeader header =
+      MatrixCache::make_header(source, ValueType<T>::name(), sizeof(T));
+  header.rows = rows;
+  header.cols = cols;
+  header.nonz = nonz;
+  header.flags = (symmetric ? MATRIX_CACHE_SYMMETRIC : 0) |
+                 (pattern ? MATRIX_CACHE_PATTERN : 0);
+  header.entries = col_idx.size();
+
+  size_t entries = col_idx.size();
+  std::vector<char> scratch;
+  MatrixCache::write(cache_filename, header,
+                     {{row_ptr.data(), row_ptr.size() * sizeof(size_t)},
+                      {col_idx.data(), entries * sizeof(int)},
+                      {raw_values(vals, scratch), entries * sizeof(T)}});
+}
+
 template <typename T> void SparseMatrix<T>::calculate_ellpack() {
   if (ellpack_calculated) {
     return;
@@ -76,54 +307,872 @@ template <typename T> void SparseMatrix<T>::calculate_ellpack() {
     ellpack_calculated = true;
   }
   start_timer(calculate_ellpack, sparse_matrix);
-  // start off by doing a histogram sum of the values in the sparse matrix,
-  // and (simultaneously) calculate the maximum row length (we might use this
-  // when we're padding the width later)
-  // std::vector<unsigned int> row_lengths(height(), 0);
+  // get the row lengths from the row pointers, and calculate the maximum
+  // row length (we might use this when we're padding the width later)
   row_lengths.resize(height(), 0);
-  // unsigned int max_width = 0;
-  for (unsigned int i = 0; i < nz_entries.size(); i++) {
-    int y = std::get<1>(nz_entries[i]);
-    row_lengths[y]++;
-    if (row_lengths[y] > max_width) {
-      max_width = row_lengths[y];
+  parallel_for(0, row_lengths.size(), [&](size_t row) {
+    row_lengths[row] =
+        static_cast<unsigned int>(row_ptr[row + 1] - row_ptr[row]);
+  });
+  max_width = row_lengths.empty()
+                  ? 0
+                  : *std::max_element(row_lengths.begin(), row_lengths.end());
+  LOG_DEBUG("max width: ", max_width);
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode(size_t device_max_alloc_bytes, T zero,
+                                     bool pad_height, bool pad_width, bool rsa,
+                                     int height_pad_modulo,
+                                     int width_pad_modulo, int index_bits,
+                                     EllLayout layout) {
+  start_timer(cl_encode, sparse_matrix);
+  check_index_bits(index_bits);
+  check_layout(layout, rsa, pad_height);
+  uint64_t key = encoding_key(
+      zero, {ENCODING_ELLPACK, rsa,
+             static_cast<uint64_t>(pad_height ? height_pad_modulo : 0),
+             static_cast<uint64_t>(pad_width ? width_pad_modulo : 0),
+             static_cast<uint64_t>(index_bits),
+             static_cast<uint64_t>(layout)});
+  return cached_encode(key, device_max_alloc_bytes, [&]() {
+    return encode(device_max_alloc_bytes, zero, pad_height, pad_width, rsa,
+                  height_pad_modulo, width_pad_modulo, index_bits, layout);
+  });
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode_sliced(size_t device_max_alloc_bytes,
+                                            T zero, int slice_height,
+                                            int sort_window, int index_bits) {
+  start_timer(cl_encode_sliced, sparse_matrix);
+  check_index_bits(index_bits);
+  if (slice_height < 1 || sort_window < 1) {
+    std::cerr << "Invalid sliced ELLPACK parameters: slice height "
+              << slice_height << ", sort window " << sort_window << ENDL;
+    exit(-1);
+  }
+  uint64_t key = encoding_key(zero, {ENCODING_SLICED,
+                                     static_cast<uint64_t>(slice_height),
+                                     static_cast<uint64_t>(sort_window),
+                                     static_cast<uint64_t>(index_bits)});
+  return cached_encode(key, device_max_alloc_bytes, [&]() {
+    return encode_sliced(device_max_alloc_bytes, zero, slice_height,
+                         sort_window, index_bits);
+  });
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode_hybrid(size_t device_max_alloc_bytes,
+                                            T zero, bool pad_height,
+                                            bool pad_width,
+                                            int height_pad_modulo,
+                                            int width_pad_modulo,
+                                            int ell_width, int index_bits,
+                                            EllLayout layout) {
+  start_timer(cl_encode_hybrid, sparse_matrix);
+  check_index_bits(index_bits);
+  check_layout(layout, false, pad_height);
+  if (ell_width < 0) {
+    std::cerr << "Invalid hybrid ELL width: " << ell_width << ENDL;
+    exit(-1);
+  }
+  uint64_t key = encoding_key(
+      zero, {ENCODING_HYBRID,
+             static_cast<uint64_t>(pad_height ? height_pad_modulo : 0),
+             static_cast<uint64_t>(pad_width ? width_pad_modulo : 0),
+             static_cast<uint64_t>(ell_width),
+             static_cast<uint64_t>(index_bits),
+             static_cast<uint64_t>(layout)});
+  return cached_encode(key, device_max_alloc_bytes, [&]() {
+    return encode_hybrid(device_max_alloc_bytes, zero, pad_height, pad_width,
+                         height_pad_modulo, width_pad_modulo, ell_width,
+                         index_bits, layout);
+  });
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode_segmented(size_t device_max_alloc_bytes,
+                                               T zero, int segment_width,
+                                               bool pad_height,
+                                               int height_pad_modulo,
+                                               int index_bits) {
+  start_timer(cl_encode_segmented, sparse_matrix);
+  check_index_bits(index_bits);
+  if (segment_width < 1 || (pad_height && height_pad_modulo < 1)) {
+    std::cerr << "Invalid segmented parameters: segment width "
+              << segment_width << ", chunk size " << height_pad_modulo
+              << ENDL;
+    exit(-1);
+  }
+  uint64_t key = encoding_key(
+      zero, {ENCODING_SEGMENTED, static_cast<uint64_t>(segment_width),
+             static_cast<uint64_t>(pad_height ? height_pad_modulo : 0),
+             static_cast<uint64_t>(index_bits)});
+  return cached_encode(key, device_max_alloc_bytes, [&]() {
+    return encode_segmented(device_max_alloc_bytes, zero, segment_width,
+                            pad_height, height_pad_modulo, index_bits);
+  });
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode_dia(size_t device_max_alloc_bytes,
+                                         T zero, double coverage,
+                                         bool pad_height,
+                                         int height_pad_modulo,
+                                         int index_bits) {
+  start_timer(cl_encode_dia, sparse_matrix);
+  check_index_bits(index_bits);
+  if (!(coverage <= 1.0) || (pad_height && height_pad_modulo < 1)) {
+    std::cerr << "Invalid DIA parameters: coverage " << coverage
+              << ", chunk size " << height_pad_modulo << ENDL;
+    exit(-1);
+  }
+  uint64_t coverage_bits = 0;
+  memcpy(&coverage_bits, &coverage, sizeof(double));
+  uint64_t key = encoding_key(
+      zero, {ENCODING_DIA, coverage_bits,
+             static_cast<uint64_t>(pad_height ? height_pad_modulo : 0),
+             static_cast<uint64_t>(index_bits)});
+  return cached_encode(key, device_max_alloc_bytes, [&]() {
+    return encode_dia(device_max_alloc_bytes, zero, coverage, pad_height,
+                      height_pad_modulo, index_bits);
+  });
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode_bcsr(size_t device_max_alloc_bytes,
+                                          T zero, int block_rows,
+                                          int block_cols, int index_bits) {
+  start_timer(cl_encode_bcsr, sparse_matrix);
+  check_index_bits(index_bits);
+  if (block_rows < 1 || block_cols < 1) {
+    std::cerr << "Invalid BCSR block size: " << block_rows << "x"
+              << block_cols << ENDL;
+    exit(-1);
+  }
+  uint64_t key = encoding_key(zero, {ENCODING_BCSR,
+                                     static_cast<uint64_t>(block_rows),
+                                     static_cast<uint64_t>(block_cols),
+                                     static_cast<uint64_t>(index_bits)});
+  return cached_encode(key, device_max_alloc_bytes, [&]() {
+    return encode_bcsr(device_max_alloc_bytes, zero, block_rows, block_cols,
+                       index_bits);
+  });
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode_csr(size_t device_max_alloc_bytes,
+                                         int index_bits) {
+  start_timer(cl_encode_csr, sparse_matrix);
+  check_index_bits(index_bits);
+  calculate_ellpack();
+  typedef unsigned long byte_size;
+
+  const bool wide = index_bits == 64;
+  const byte_size index_size = wide ? sizeof(int64_t) : sizeof(int);
+  const size_t h = static_cast<size_t>(height());
+  const size_t entries = col_idx.size();
+  byte_size ixs_arr_size = entries * index_size;
+  byte_size vals_arr_size = entries * sizeof(T);
+  byte_size largest_arr_size =
+      std::max({ixs_arr_size, vals_arr_size, (h + 1) * index_size});
+  if (largest_arr_size > device_max_alloc_bytes) {
+    throw largest_arr_size;
+  }
+  if (!wide && entries > (size_t)std::numeric_limits<int>::max()) {
+    LOG_ERROR("CSR matrix of ", entries,
+              " entries is too large for 32 bit row pointers - use a kernel "
+              "with 64 bit indices (indexBits: 64)");
+    throw ixs_arr_size;
+  }
+
+  CL_matrix matrix(ixs_arr_size, vals_arr_size, static_cast<int>(max_width),
+                   static_cast<int>(h));
+  raw_buffer &row_ptr_buffer = matrix.extras["rowPtr"];
+  row_ptr_buffer.resize((h + 1) * index_size);
+  if (wide) {
+    std::copy(col_idx.begin(), col_idx.end(),
+              reinterpret_cast<int64_t *>(matrix.indices.data()));
+    std::copy(row_ptr.begin(), row_ptr.end(),
+              reinterpret_cast<int64_t *>(row_ptr_buffer.data()));
+  } else {
+    std::copy(col_idx.begin(), col_idx.end(),
+              reinterpret_cast<int *>(matrix.indices.data()));
+    std::copy(row_ptr.begin(), row_ptr.end(),
+              reinterpret_cast<int *>(row_ptr_buffer.data()));
+  }
+  std::copy(vals.begin(), vals.end(),
+            reinterpret_cast<T *>(matrix.values.data()));
+  return matrix;
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode_dcsr(size_t device_max_alloc_bytes,
+                                          int index_bits) {
+  start_timer(cl_encode_dcsr, sparse_matrix);
+  check_index_bits(index_bits);
+  typedef unsigned long byte_size;
+  const size_t h = static_cast<size_t>(height());
+  std::vector<int> row_ids;
+  std::vector<size_t> pointers(1, 0);
+  for (size_t r = 0; r < h; r++) {
+    if (row_ptr[r] < row_ptr[r + 1]) {
+      row_ids.push_back(static_cast<int>(r));
+      pointers.push_back(row_ptr[r + 1]);
     }
   }
-  LOG_DEBUG("max width: ", max_width);
+  const byte_size index_size =
+      index_bits == 64 ? sizeof(int64_t) : sizeof(int);
+  byte_size largest_arr_size = std::max(
+      {col_idx.size() * index_size, col_idx.size() * sizeof(T),
+       pointers.size() * index_size, row_ids.size() * sizeof(int)});
+  if (largest_arr_size > device_max_alloc_bytes) {
+    throw largest_arr_size;
+  }
+  // the non-zeros are exactly those of CSR - only the rows change (so its
+  // full height row pointers, which we replace, aren't checked)
+  CL_matrix matrix =
+      cl_encode_csr(std::numeric_limits<size_t>::max(), index_bits);
+  raw_buffer &row_ptr_buffer = matrix.extras["rowPtr"];
+  if (index_bits == 64) {
+    row_ptr_buffer.resize(pointers.size() * sizeof(int64_t));
+    std::copy(pointers.begin(), pointers.end(),
+              reinterpret_cast<int64_t *>(row_ptr_buffer.data()));
+  } else {
+    row_ptr_buffer.resize(pointers.size() * sizeof(int));
+    std::copy(pointers.begin(), pointers.end(),
+              reinterpret_cast<int *>(row_ptr_buffer.data()));
+  }
+  raw_buffer &row_ids_buffer = matrix.extras["rowIds"];
+  row_ids_buffer.resize(row_ids.size() * sizeof(int));
+  memcpy(row_ids_buffer.data(), row_ids.data(), row_ids_buffer.size());
+  matrix.cl_height = static_cast<int>(row_ids.size());
+  std::cerr << "DCSR: " << row_ids.size() << " of " << h
+            << " rows have entries" << ENDL;
+  return matrix;
+}
 
-  // based on that, create a "standard" AOS ragged std::vector based structure
-  // to fill with values from the sparse matrix. Reserve the rows to the lengths
-  // we've just calculated with the histogram
-  // SparseMatrix::ellpack_matrix<T> ellpackMatrix(height(), ellpack_row<T>(0));
-  ellpackMatrix.resize(height(), ellpack_row<T>(0));
-  for (int i = 0; i < height(); i++) {
-    ellpackMatrix[i].reserve(row_lengths[i]);
+template <typename T>
+CL_matrix SparseMatrix<T>::cl_encode_delta(size_t device_max_alloc_bytes,
+                                           int index_bits) {
+  start_timer(cl_encode_delta, sparse_matrix);
+  check_index_bits(index_bits);
+  calculate_ellpack();
+  typedef unsigned long byte_size;
+
+  const bool wide = index_bits == 64;
+  const byte_size index_size = wide ? sizeof(int64_t) : sizeof(int);
+  const size_t h = static_cast<size_t>(height());
+  const size_t entries = col_idx.size();
+  std::vector<size_t> escape_ptr = delta_escapes();
+  const size_t escapes = escape_ptr[h];
+  byte_size ixs_arr_size = entries * sizeof(uint16_t);
+  byte_size vals_arr_size = entries * sizeof(T);
+  // (the row and escape pointers are the same size)
+  byte_size largest_arr_size =
+      std::max({ixs_arr_size, vals_arr_size, (h + 1) * index_size,
+                h * sizeof(int), escapes * sizeof(int)});
+  if (largest_arr_size > device_max_alloc_bytes) {
+    throw largest_arr_size;
+  }
+  if (!wide && entries > (size_t)std::numeric_limits<int>::max()) {
+    LOG_ERROR("Delta matrix of ", entries,
+              " entries is too large for 32 bit row pointers - use a kernel "
+              "with 64 bit indices (indexBits: 64)");
+    throw ixs_arr_size;
   }
 
-  // fill the ellpackMatrix using standard push_back etc from the nz_entries
-  for (unsigned int i = 0; i < nz_entries.size(); i++) {
-    int x = std::get<0>(nz_entries[i]);
-    int y = std::get<1>(nz_entries[i]);
-    int val = std::get<2>(nz_entries[i]);
-    std::pair<int, T> r_entry(x, val);
-    ellpackMatrix[y].push_back(r_entry);
+  CL_matrix matrix(ixs_arr_size, vals_arr_size, static_cast<int>(max_width),
+                   static_cast<int>(h));
+  raw_buffer &row_base = matrix.extras["rowBase"];
+  raw_buffer &escape_cols = matrix.extras["escapeCols"];
+  row_base.resize(h * sizeof(int));
+  escape_cols.resize(escapes * sizeof(int));
+  uint16_t *deltas = reinterpret_cast<uint16_t *>(matrix.indices.data());
+  int *bases = reinterpret_cast<int *>(row_base.data());
+  int *escaped = reinterpret_cast<int *>(escape_cols.data());
+  parallel_for(0, h, [&](size_t r) {
+    int previous = row_ptr[r] < row_ptr[r + 1] ? col_idx[row_ptr[r]] : 0;
+    bases[r] = previous;
+    size_t e = escape_ptr[r];
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      uint32_t delta = static_cast<uint32_t>(col_idx[i] - previous);
+      if (delta >= DELTA_ESCAPE) {
+        deltas[i] = static_cast<uint16_t>(DELTA_ESCAPE);
+        escaped[e++] = col_idx[i];
+      } else {
+        deltas[i] = static_cast<uint16_t>(delta);
+      }
+      previous = col_idx[i];
+    }
+  });
+  std::copy(vals.begin(), vals.end(),
+            reinterpret_cast<T *>(matrix.values.data()));
+
+  // the row pointers, into the non-zeros and into the escapes
+  auto write_pointers = [&](raw_buffer &buffer,
+                            const std::vector<size_t> &pointers) {
+    buffer.resize(pointers.size() * index_size);
+    if (wide) {
+      std::copy(pointers.begin(), pointers.end(),
+                reinterpret_cast<int64_t *>(buffer.data()));
+    } else {
+      std::copy(pointers.begin(), pointers.end(),
+                reinterpret_cast<int *>(buffer.data()));
+    }
+  };
+  write_pointers(matrix.extras["rowPtr"], row_ptr);
+  write_pointers(matrix.extras["escapePtr"], escape_ptr);
+
+  std::cerr << "Delta encoded indices: " << 100.0 * narrow_delta_rows()
+            << "% of rows need no escapes, " << escapes
+            << " escaped columns, indices " << entries * sizeof(int) << " -> "
+            << ixs_arr_size + row_base.size() + escape_cols.size() << " bytes"
+            << ENDL;
+  return matrix;
+}
+
+template <typename T> std::vector<size_t> SparseMatrix<T>::delta_escapes() {
+  const size_t h = static_cast<size_t>(height());
+  std::vector<size_t> escape_ptr(h + 1, 0);
+  parallel_for(0, h, [&](size_t r) {
+    size_t escapes = 0;
+    for (size_t i = row_ptr[r] + 1; i < row_ptr[r + 1]; i++) {
+      if (static_cast<uint32_t>(col_idx[i] - col_idx[i - 1]) >= DELTA_ESCAPE) {
+        escapes++;
+      }
+    }
+    escape_ptr[r + 1] = escapes;
+  });
+  std::partial_sum(escape_ptr.begin(), escape_ptr.end(), escape_ptr.begin());
+  return escape_ptr;
+}
+
+template <typename T> double SparseMatrix<T>::narrow_delta_rows() {
+  start_timer(narrow_delta_rows, sparse_matrix);
+  std::vector<size_t> escape_ptr = delta_escapes();
+  size_t rows = 0;
+  size_t narrow = 0;
+  for (size_t r = 0; r + 1 < escape_ptr.size(); r++) {
+    if (row_ptr[r] == row_ptr[r + 1]) {
+      continue;
+    }
+    rows++;
+    if (escape_ptr[r] == escape_ptr[r + 1]) {
+      narrow++;
+    }
   }
+  return rows == 0 ? 1.0 : static_cast<double>(narrow) / rows;
+}
+
+template <typename T>
+void SparseMatrix<T>::segment_block_counts(
+    int segment_width, std::vector<std::vector<size_t>> &rows,
+    std::vector<std::vector<size_t>> &entries) {
+  const size_t h = static_cast<size_t>(height());
+  const size_t w = static_cast<size_t>(segment_width);
+  const size_t segments =
+      std::max<size_t>(1, (static_cast<size_t>(width()) + w - 1) / w);
+  rows.assign(block_count(0, h), std::vector<size_t>(segments, 0));
+  entries.assign(block_count(0, h), std::vector<size_t>(segments, 0));
+  // rows are sorted by column, so each row's entries fall into the segments
+  // in order
+  parallel_for_blocks(0, h, [&](size_t begin, size_t end, unsigned int b) {
+    for (size_t r = begin; r < end; r++) {
+      size_t i = row_ptr[r];
+      while (i < row_ptr[r + 1]) {
+        size_t s = static_cast<size_t>(col_idx[i]) / w;
+        size_t first = i;
+        while (i < row_ptr[r + 1] &&
+               static_cast<size_t>(col_idx[i]) / w == s) {
+          i++;
+        }
+        rows[b][s]++;
+        entries[b][s] += i - first;
+      }
+    }
+  });
+}
 
-  // sort each row by the x values
-  for (auto row : ellpackMatrix) {
-    std::sort(row.begin(), row.end(),
-              [](std::pair<int, T> a, std::pair<int, T> b) {
-                return a.first < b.first;
-              });
+template <typename T>
+std::vector<size_t> SparseMatrix<T>::segment_rows(int segment_width) {
+  std::vector<std::vector<size_t>> block_rows;
+  std::vector<std::vector<size_t>> block_entries;
+  segment_block_counts(segment_width, block_rows, block_entries);
+  std::vector<size_t> rows(block_rows.empty() ? 1 : block_rows[0].size(), 0);
+  for (auto &block : block_rows) {
+    for (size_t s = 0; s < rows.size(); s++) {
+      rows[s] += block[s];
+    }
   }
+  return rows;
 }
 
 template <typename T>
-CL_matrix SparseMatrix<T>::cl_encode(unsigned int device_max_alloc_bytes,
-                                     T zero, bool pad_height, bool pad_width,
-                                     bool rsa, int height_pad_modulo,
-                                     int width_pad_modulo) {
-  start_timer(cl_encode, sparse_matrix);
+std::vector<int> SparseMatrix<T>::dia_offsets(double coverage) {
+  start_timer(dia_offsets, sparse_matrix);
+  const size_t h = static_cast<size_t>(height());
+  const size_t entries = col_idx.size();
+  // count the entries on each diagonal - diagonal k has offset k - (h - 1)
+  std::vector<size_t> counts(h + static_cast<size_t>(width()), 0);
+  for (size_t r = 0; r < h; r++) {
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      counts[col_idx[i] + (h - 1) - r]++;
+    }
+  }
+  std::vector<size_t> occupied;
+  for (size_t k = 0; k < counts.size(); k++) {
+    if (counts[k] > 0) {
+      occupied.push_back(k);
+    }
+  }
+  std::stable_sort(occupied.begin(), occupied.end(),
+                   [&](size_t a, size_t b) { return counts[a] > counts[b]; });
+
+  // take the densest diagonals until they cover enough of the entries, or
+  // (automatically) while they're full enough to be worth storing
+  const double target = coverage * static_cast<double>(entries);
+  auto length = [&](size_t k) -> size_t {
+    long offset = static_cast<long>(k) - static_cast<long>(h - 1);
+    return static_cast<size_t>(
+        std::min<long>(height(), width() - offset) - std::max(0L, -offset));
+  };
+  size_t covered = 0;
+  std::vector<int> offsets;
+  for (size_t k : occupied) {
+    if (coverage < 0 ? counts[k] < DIA_MIN_FILL * length(k)
+                     : static_cast<double>(covered) >= target) {
+      continue;
+    }
+    covered += counts[k];
+    offsets.push_back(static_cast<int>(k) - static_cast<int>(h - 1));
+  }
+  std::sort(offsets.begin(), offsets.end());
+
+  std::cerr << "Diagonals: " << offsets.size() << " of " << occupied.size()
+            << " occupied diagonals hold "
+            << (entries == 0 ? 100.0 : 100.0 * covered / entries)
+            << "% of the non-zeros (DIA would store "
+            << (entries == 0 ? 0.0
+                             : static_cast<double>(offsets.size() * h +
+                                                   entries - covered) /
+                                   entries)
+            << " elements per non-zero)" << ENDL;
+  return offsets;
+}
+
+template <typename T>
+size_t SparseMatrix<T>::bcsr_padded_height(int block_rows, int block_cols) {
+  // the kernel reads a whole block's worth of x, so the vectors must reach
+  // the end of the last block column, as well as the last block row
+  const size_t r = static_cast<size_t>(block_rows);
+  const size_t c = static_cast<size_t>(block_cols);
+  const size_t w = ((static_cast<size_t>(width()) + c - 1) / c) * c;
+  return ((std::max(static_cast<size_t>(height()), w) + r - 1) / r) * r;
+}
+
+template <typename T>
+std::vector<int> SparseMatrix<T>::bcsr_block_columns(size_t block_row,
+                                                     int block_rows,
+                                                     int block_cols) {
+  const size_t h = static_cast<size_t>(height());
+  const size_t first = block_row * static_cast<size_t>(block_rows);
+  const size_t last = std::min(h, first + static_cast<size_t>(block_rows));
+  std::vector<int> columns;
+  if (first >= last) {
+    return columns;
+  }
+  columns.reserve(row_ptr[last] - row_ptr[first]);
+  for (size_t i = row_ptr[first]; i < row_ptr[last]; i++) {
+    columns.push_back(col_idx[i] / block_cols);
+  }
+  std::sort(columns.begin(), columns.end());
+  columns.erase(std::unique(columns.begin(), columns.end()), columns.end());
+  return columns;
+}
+
+template <typename T>
+std::vector<size_t> SparseMatrix<T>::bcsr_blocks(int block_rows,
+                                                 int block_cols) {
+  const size_t block_height =
+      bcsr_padded_height(block_rows, block_cols) / block_rows;
+  std::vector<size_t> blocks(block_height, 0);
+  parallel_for(0, block_height, [&](size_t br) {
+    blocks[br] = bcsr_block_columns(br, block_rows, block_cols).size();
+  });
+  return blocks;
+}
+
+template <typename T>
+std::pair<int, int> SparseMatrix<T>::bcsr_block_size(int index_bits) {
+  start_timer(bcsr_block_size, sparse_matrix);
+  const size_t index_size = index_bits == 64 ? sizeof(int64_t) : sizeof(int);
+  const size_t entries = col_idx.size();
+  std::pair<int, int> best(1, 1);
+  size_t best_bytes = std::numeric_limits<size_t>::max();
+  std::cerr << "BCSR fill ratios (stored elements per non-zero):";
+  for (auto &candidate : BCSR_CANDIDATES) {
+    const int r = candidate[0];
+    const int c = candidate[1];
+    auto row_blocks = bcsr_blocks(r, c);
+    const size_t blocks =
+        std::accumulate(row_blocks.begin(), row_blocks.end(), (size_t)0);
+    const size_t block_height = row_blocks.size();
+    // the values and block columns, and the block row pointers
+    const size_t bytes = blocks * (r * c * sizeof(T) + index_size) +
+                         (block_height + 1) * index_size;
+    std::cerr << " " << r << "x" << c << " "
+              << (entries == 0 ? 1.0
+                               : static_cast<double>(blocks * r * c) /
+                                     entries);
+    if (bytes < best_bytes) {
+      best_bytes = bytes;
+      best = std::make_pair(r, c);
+    }
+  }
+  std::cerr << " - " << best.first << "x" << best.second
+            << " is smallest, at " << best_bytes << " bytes" << ENDL;
+  return best;
+}
+
+template <typename T> int SparseMatrix<T>::hybrid_width(double coverage) {
+  calculate_ellpack();
+  // histogram the row lengths
+  std::vector<size_t> histogram(max_width + 1, 0);
+  for (auto length : row_lengths) {
+    histogram[length]++;
+  }
+  // an ELL width of k holds min(length, k) entries of each row, so widening
+  // it by one adds an entry for every row longer than k
+  const double target = coverage * static_cast<double>(col_idx.size());
+  size_t covered = 0;
+  size_t longer = row_lengths.size() - histogram[0];
+  int width = 0;
+  while (static_cast<double>(covered) < target && width < (int)max_width) {
+    covered += longer;
+    width++;
+    longer -= histogram[width];
+  }
+  LOG_DEBUG("hybrid width for ", coverage, " coverage: ", width);
+  return width;
+}
+
+template <typename T>
+std::vector<T> SparseMatrix<T>::distinct_values(size_t limit) {
+  start_timer(distinct_values, sparse_matrix);
+  // collect the values of each block of entries, and give up as soon as any
+  // block finds too many
+  const size_t n = vals.size();
+  std::vector<std::set<uint64_t>> block_values(block_count(0, n));
+  std::atomic<bool> too_many(false);
+  parallel_for_blocks(0, n, [&](size_t begin, size_t end, unsigned int b) {
+    auto &values = block_values[b];
+    for (size_t i = begin; i < end && !too_many; i++) {
+      uint64_t bits = value_bits<T>(vals[i]);
+      // values often come in runs (e.g. along a row), so skip the lookup
+      if (i > begin && bits == value_bits<T>(vals[i - 1])) {
+        continue;
+      }
+      values.insert(bits);
+      if (values.size() > limit) {
+        too_many = true;
+      }
+    }
+  });
+  std::set<uint64_t> all;
+  for (auto &values : block_values) {
+    all.insert(values.begin(), values.end());
+    if (too_many || all.size() > limit) {
+      return std::vector<T>();
+    }
+  }
+  std::vector<T> distinct;
+  for (uint64_t bits : all) {
+    distinct.push_back(bits_value<T>(bits));
+  }
+  return distinct;
+}
+
+template <typename T>
+void SparseMatrix<T>::compress_values(CL_matrix &matrix, T zero,
+                                      ValueEncoding encoding, int code_bits) {
+  if (encoding == ValueEncoding::PLAIN) {
+    return;
+  }
+  start_timer(compress_values, sparse_matrix);
+  const size_t elements = matrix.values.size() / sizeof(T);
+  const size_t old_bytes = matrix.values.size();
+
+  if (encoding == ValueEncoding::PATTERN) {
+    std::vector<T> distinct = distinct_values(1);
+    if (distinct.size() != 1) {
+      std::cerr << "The pattern value encoding needs every entry of the matrix "
+                   "to have the same value"
+                << ENDL;
+      exit(-1);
+    }
+    T value = distinct[0];
+    matrix.values.resize(sizeof(T));
+    memcpy(matrix.values.data(), &value, sizeof(T));
+    std::cerr << "Pattern values (every entry is " << value
+              << "): values buffer " << old_bytes << " -> "
+              << matrix.values.size() << " bytes" << ENDL;
+    return;
+  }
+
+  if (encoding == ValueEncoding::HALF || encoding == ValueEncoding::BFLOAT16) {
+    if (!std::is_floating_point<T>::value) {
+      std::cerr << "The " << value_encoding_name(encoding)
+                << " value encoding needs floating point values, not "
+                << ValueType<T>::name() << ENDL;
+      exit(-1);
+    }
+    const bool half = encoding == ValueEncoding::HALF;
+    auto round = [half](double value) {
+      float single = static_cast<float>(value);
+      return half ? half_to_float(float_to_half(single))
+                  : bfloat16_to_float(float_to_bfloat16(single));
+    };
+    const T *values = reinterpret_cast<const T *>(matrix.values.data());
+    // a finite value too big for the precision would become infinite
+    // (rounding is monotonic, so checking the biggest is enough)
+    double largest = 0.0;
+    for (size_t i = 0; i < elements; i++) {
+      double magnitude = std::fabs(static_cast<double>(values[i]));
+      if (std::isfinite(magnitude)) {
+        largest = std::max(largest, magnitude);
+      }
+    }
+    if (std::isinf(round(largest))) {
+      std::cerr << "The matrix has a value of magnitude " << largest
+                << ", too big for the " << value_encoding_name(encoding)
+                << " value encoding"
+                << (half ? " - try bfloat16, which has the range of a float"
+                         : "")
+                << ENDL;
+      exit(-1);
+    }
+
+    // round each value, and keep track of how far that moved it
+    raw_buffer rounded(elements * sizeof(uint16_t));
+    std::vector<double> errors(elements);
+    parallel_for(0, elements, [&](size_t i) {
+      float value = static_cast<float>(values[i]);
+      uint16_t bits = half ? float_to_half(value) : float_to_bfloat16(value);
+      reinterpret_cast<uint16_t *>(rounded.data())[i] = bits;
+      double stored = half ? half_to_float(bits) : bfloat16_to_float(bits);
+      // (infinite values - e.g. the padding of a min-plus semiring - stay
+      // exactly infinite)
+      errors[i] = stored == values[i]
+                      ? 0.0
+                      : values[i] == 0
+                            ? std::fabs(stored)
+                            : std::fabs((stored - values[i]) / values[i]);
+    });
+    double max_error = 0.0;
+    for (double error : errors) {
+      max_error = std::max(max_error, error);
+    }
+    matrix.values.swap(rounded);
+    std::cerr << "Rounded values to " << value_encoding_name(encoding)
+              << " (largest relative error " << max_error
+              << "): values buffer " << old_bytes << " -> "
+              << matrix.values.size() << " bytes" << ENDL;
+    return;
+  }
+
+  if (code_bits != 8 && code_bits != 16) {
+    std::cerr << "Unsupported dictionary code width: " << code_bits
+              << " bits (expected 8 or 16)" << ENDL;
+    exit(-1);
+  }
+  // the dictionary holds every value, and the zero used for padding
+  const size_t capacity = size_t(1) << code_bits;
+  std::vector<T> distinct = distinct_values(capacity);
+  std::vector<uint64_t> dictionary;
+  for (size_t d = 0; d < distinct.size(); d++) {
+    dictionary.push_back(value_bits<T>(distinct[d]));
+  }
+  auto zero_position =
+      std::lower_bound(dictionary.begin(), dictionary.end(), value_bits(zero));
+  if (zero_position == dictionary.end() || *zero_position != value_bits(zero)) {
+    dictionary.insert(zero_position, value_bits(zero));
+  }
+  if ((distinct.empty() && !vals.empty()) || dictionary.size() > capacity) {
+    std::cerr << "The matrix has more than " << capacity
+              << " distinct values, too many for " << code_bits
+              << " bit dictionary codes" << ENDL;
+    exit(-1);
+  }
+
+  // replace each value with its position in the dictionary
+  const T *values = reinterpret_cast<const T *>(matrix.values.data());
+  raw_buffer codes(elements * (code_bits / 8));
+  parallel_for(0, elements, [&](size_t i) {
+    size_t code = std::lower_bound(dictionary.begin(), dictionary.end(),
+                                   value_bits<T>(values[i])) -
+                  dictionary.begin();
+    if (code_bits == 8) {
+      reinterpret_cast<uint8_t *>(codes.data())[i] = static_cast<uint8_t>(code);
+    } else {
+      reinterpret_cast<uint16_t *>(codes.data())[i] =
+          static_cast<uint16_t>(code);
+    }
+  });
+  matrix.values.swap(codes);
+  raw_buffer &dictionary_buffer = matrix.extras["valueDict"];
+  dictionary_buffer.resize(dictionary.size() * sizeof(T));
+  for (size_t d = 0; d < dictionary.size(); d++) {
+    T value = bits_value<T>(dictionary[d]);
+    memcpy(dictionary_buffer.data() + d * sizeof(T), &value, sizeof(T));
+  }
+  std::cerr << "Dictionary values (" << dictionary.size() << " distinct, "
+            << code_bits << " bit codes): values buffer " << old_bytes
+            << " -> " << matrix.values.size() + dictionary_buffer.size()
+            << " bytes" << ENDL;
+}
+
+template <typename T>
+uint64_t
+SparseMatrix<T>::encoding_key(T zero,
+                              std::initializer_list<uint64_t> parameters) {
+  // key the encoding on the matrix and every parameter that changes it
+  uint64_t zero_bits = 0;
+  memcpy(&zero_bits, &zero, sizeof(T));
+  uint64_t key = content_hash;
+  key = hash_combine(key, sizeof(T));
+  key = hash_combine(key, zero_bits);
+  for (uint64_t parameter : parameters) {
+    key = hash_combine(key, parameter);
+  }
+  return key;
+}
+
+template <typename T>
+template <typename Encoder>
+CL_matrix SparseMatrix<T>::cached_encode(uint64_t key,
+                                         size_t device_max_alloc_bytes,
+                                         Encoder encoder) {
+  if (!use_cache) {
+    return encoder();
+  }
+  std::string encoded_filename =
+      MatrixCache::encoded_filename(filename, ValueType<T>::name(), key);
+  CL_matrix matrix(0, 0, -1, -1);
+  if (load_encoded(encoded_filename, key, device_max_alloc_bytes, matrix)) {
+    return matrix;
+  }
+  matrix = encoder();
+  write_encoded(encoded_filename, key, matrix);
+  return matrix;
+}
+
+template <typename T>
+bool SparseMatrix<T>::load_encoded(const std::string &encoded_filename,
+                                   uint64_t key,
+                                   size_t device_max_alloc_bytes,
+                                   CL_matrix &matrix) {
+  start_timer(load_encoded, sparse_matrix);
+  MappedFile cache(encoded_filename);
+  if (!cache.valid() || cache.size() < sizeof(EncodedCacheHeader)) {
+    return false;
+  }
+  EncodedCacheHeader header;
+  memcpy(&header, cache.data(), sizeof(header));
+  if (!MatrixCache::encoded_header_matches(header, key, ValueType<T>::name(),
+                                           sizeof(T))) {
+    return false;
+  }
+  // find the buffers within the file
+  size_t table_offset = MatrixCache::align(sizeof(header));
+  size_t table_bytes = header.extra_count * sizeof(EncodedCacheExtra);
+  if (cache.size() < table_offset + table_bytes) {
+    LOG_WARNING("Truncated encoded matrix cache ", encoded_filename);
+    return false;
+  }
+  std::vector<EncodedCacheExtra> table(header.extra_count);
+  memcpy(table.data(), cache.data() + table_offset, table_bytes);
+  size_t indices_offset = MatrixCache::align(table_offset + table_bytes);
+  size_t values_offset =
+      MatrixCache::align(indices_offset + header.indices_bytes);
+  size_t end = MatrixCache::align(values_offset + header.values_bytes);
+  std::vector<size_t> extra_offsets;
+  for (auto &extra : table) {
+    extra_offsets.push_back(end);
+    end = MatrixCache::align(end + extra.bytes);
+  }
+  if (cache.size() < values_offset + header.values_bytes ||
+      (!table.empty() && cache.size() < extra_offsets.back() +
+                                            table.back().bytes)) {
+    LOG_WARNING("Truncated encoded matrix cache ", encoded_filename);
+    return false;
+  }
+  // the same check that we make when encoding, over every buffer
+  unsigned long largest_bytes =
+      std::max(header.indices_bytes, header.values_bytes);
+  for (auto &extra : table) {
+    largest_bytes = std::max<unsigned long>(largest_bytes, extra.bytes);
+  }
+  if (largest_bytes > device_max_alloc_bytes) {
+    throw largest_bytes;
+  }
+  LOG_INFO("Loading encoded matrix from cache ", encoded_filename);
+  auto copy_buffer = [&](raw_buffer &buffer, size_t offset, size_t bytes) {
+    buffer.resize(bytes);
+    memcpy(buffer.data(), cache.data() + offset, bytes);
+  };
+  copy_buffer(matrix.indices, indices_offset, header.indices_bytes);
+  copy_buffer(matrix.values, values_offset, header.values_bytes);
+  for (size_t e = 0; e < table.size(); e++) {
+    std::string name(table[e].name,
+                     strnlen(table[e].name, sizeof(table[e].name)));
+    copy_buffer(matrix.extras[name], extra_offsets[e], table[e].bytes);
+  }
+  matrix.cl_width = header.cl_width;
+  matrix.cl_height = header.cl_height;
+  return true;
+}
+
+template <typename T>
+void SparseMatrix<T>::write_encoded(const std::string &encoded_filename,
+                                    uint64_t key, const CL_matrix &matrix) {
+  start_timer(write_encoded, sparse_matrix);
+  EncodedCacheHeader header = MatrixCache::make_encoded_header(
+      key, ValueType<T>::name(), sizeof(T));
+  header.cl_width = matrix.cl_width;
+  header.cl_height = matrix.cl_height;
+  header.indices_bytes = matrix.indices.size();
+  header.values_bytes = matrix.values.size();
+  header.extra_count = static_cast<uint32_t>(matrix.extras.size());
+
+  std::vector<EncodedCacheExtra> table;
+  for (auto &extra : matrix.extras) {
+    EncodedCacheExtra entry;
+    memset(&entry, 0, sizeof(entry));
+    strncpy(entry.name, extra.first.c_str(), sizeof(entry.name) - 1);
+    entry.bytes = extra.second.size();
+    table.push_back(entry);
+  }
+  std::vector<std::pair<const void *, size_t>> arrays = {
+      {table.data(), table.size() * sizeof(EncodedCacheExtra)},
+      {matrix.indices.data(), matrix.indices.size()},
+      {matrix.values.data(), matrix.values.size()}};
+  for (auto &extra : matrix.extras) {
+    arrays.push_back(std::make_pair(static_cast<const void *>(
+                                        extra.second.data()),
+                                    extra.second.size()));
+  }
+  MatrixCache::write(encoded_filename, header, arrays);
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::encode(size_t device_max_alloc_bytes, T zero,
+                                  bool pad_height, bool pad_width, bool rsa,
+                                  int height_pad_modulo, int width_pad_modulo,
+                                  int index_bits, EllLayout layout,
+                                  size_t ell_width) {
+  start_timer(encode, sparse_matrix);
   // =========================================================================
   // STEP ONE: CREATE AN ELLPACK MATRIX (AS SIMPLE AS POSSIBLE), WHICH
   //           WE CAN ANALYSE TO ACTUALLY BUILD THE ENCODED ARGUMENTS
@@ -134,6 +1183,14 @@ CL_matrix SparseMatrix<T>::cl_encode(unsigned int device_max_alloc_bytes,
   typedef unsigned long byte_size;
   typedef unsigned int value_size;
 
+  // the width of column indices, and of the RSA offsets, sizes and capacities
+  const bool wide = index_bits == 64;
+  const byte_size index_size = wide ? sizeof(int64_t) : sizeof(int);
+  const byte_size header_size = rsa ? 2 * index_size : 0;
+  // rows are cut to ell_width entries (for hybrid encodings)
+  const value_size width_limit =
+      static_cast<value_size>(std::min<size_t>(max_width, ell_width));
+
   // =========================================================================
   // STEP TWO: CALCULATE THE SIZE OF OUR FINAL ENCODED MATRIX - THIS IS OUR
   //           CHANCE TO BAIL OUT OF WE'RE GOING TO ALLOCATE TOO MUCH MEMORY
@@ -156,22 +1213,23 @@ CL_matrix SparseMatrix<T>::cl_encode(unsigned int device_max_alloc_bytes,
   // now we have the height, create an array for the actual lengths, and copy
   // the row lengths - copy them along one later if we're rsa
   std::vector<value_size> concrete_lengths(concrete_height, 0);
-  std::copy(row_lengths.begin(), row_lengths.end(),
-            concrete_lengths.begin() + (rsa ? 1 : 0));
+  std::transform(row_lengths.begin(), row_lengths.end(),
+                 concrete_lengths.begin() + (rsa ? 1 : 0),
+                 [&](value_size l) { return std::min(l, width_limit); });
 
   // -------------------------------------------------------------------------
   // Step 2.2: Horizontal padding, for "splitting" optimisations
   // -------------------------------------------------------------------------
   // next, pad the sizes horizontally, with behavior dependent on whether
   // we're in RSA or not
-  int regular_width = max_width;
+  int regular_width = width_limit;
   if (rsa) {
     // we just need to pad each width to the modulo
     // TODO: IMPLEMENT WHEN WE NEED TO!
   } else {
     if (pad_width) {
       regular_width =
-          max_width + (width_pad_modulo - (max_width % width_pad_modulo));
+          width_limit + (width_pad_modulo - (width_limit % width_pad_modulo));
       LOG_DEBUG("Padding to regular width: ", regular_width,
                 " mod modulo: ", regular_width % width_pad_modulo);
     }
@@ -185,22 +1243,20 @@ CL_matrix SparseMatrix<T>::cl_encode(unsigned int device_max_alloc_bytes,
   // first, transform the concrete lengths into two lengths arrays that encode
   // the concrete lengths in terms of the number of bytes, if we're generating
   // for a runtime size array, also add on space for the lengths
-  std::vector<value_size> byte_lengths_indices(concrete_lengths);
-  std::vector<value_size> byte_lengths_values(concrete_lengths);
-  std::transform(byte_lengths_indices.begin(), byte_lengths_indices.end(),
-                 byte_lengths_indices.begin(),
-                 [rsa](value_size l) -> value_size {
-                   return (l * sizeof(int)) + (rsa ? 2 * sizeof(int) : 0);
+  std::vector<byte_size> byte_lengths_indices(concrete_height);
+  std::vector<byte_size> byte_lengths_values(concrete_height);
+  std::transform(concrete_lengths.begin(), concrete_lengths.end(),
+                 byte_lengths_indices.begin(), [&](value_size l) -> byte_size {
+                   return (l * index_size) + header_size;
                  });
-  std::transform(byte_lengths_values.begin(), byte_lengths_values.end(),
-                 byte_lengths_values.begin(),
-                 [rsa](value_size l) -> value_size {
-                   return (l * sizeof(T)) + (rsa ? 2 * sizeof(int) : 0);
+  std::transform(concrete_lengths.begin(), concrete_lengths.end(),
+                 byte_lengths_values.begin(), [&](value_size l) -> byte_size {
+                   return (l * sizeof(T)) + header_size;
                  });
   // set the offset sizes if we're RSA, and append size for the offsets
   // essentially, correct for whatever we just did :P
   if (rsa) {
-    int offset_array_size = (concrete_height - 1) * sizeof(int);
+    byte_size offset_array_size = (concrete_height - 1) * index_size;
     byte_lengths_indices[0] = offset_array_size;
     byte_lengths_values[0] = offset_array_size;
   }
@@ -228,31 +1284,39 @@ CL_matrix SparseMatrix<T>::cl_encode(unsigned int device_max_alloc_bytes,
   LOG_DEBUG("ixs_arr_size: (GB) - ",
             (double)vals_arr_size / (double)(1024 * 1024 * 1024));
 
-  if (ixs_arr_size > device_max_alloc_bytes) {
-    throw ixs_arr_size;
+  if (std::max(ixs_arr_size, vals_arr_size) > device_max_alloc_bytes) {
+    throw std::max(ixs_arr_size, vals_arr_size);
   }
 
   if (!rsa && !pad_height &&
-      ((regular_width * concrete_height * sizeof(int)) != ixs_arr_size)) {
+      ((byte_size)regular_width * concrete_height * index_size) !=
+          ixs_arr_size) {
     LOG_ERROR("Something has gone catastrophically wrong building the regular "
               "size! Expected array size to be ",
-              (regular_width * concrete_height * sizeof(int)), " is actually ",
-              ixs_arr_size);
+              ((byte_size)regular_width * concrete_height * index_size),
+              " is actually ", ixs_arr_size);
+    throw ixs_arr_size;
+  }
+
+  // RSA offsets are byte offsets into the arrays, so have to fit an index
+  if (rsa && !wide &&
+      std::max(ixs_arr_size, vals_arr_size) >
+          (byte_size)std::numeric_limits<int>::max()) {
+    LOG_ERROR("Ragged matrix of ", std::max(ixs_arr_size, vals_arr_size),
+              " bytes is too large for 32 bit offsets - use a kernel with "
+              "64 bit indices (indexBits: 64)");
     throw ixs_arr_size;
   }
   // =========================================================================
   // STEP THREE: CREATE THE TWO ARRAYS, AND FILL WITH MATRIX INFORMATION
   // =========================================================================
-  // Create the matrix structure that we're going to fill with data
+  // Create the matrix structure that we're going to fill with data. The
+  // buffers are left uninitialised, as every byte is written exactly once
+  // below.
   CL_matrix matrix(ixs_arr_size, vals_arr_size, cl_width, cl_height);
 
-  // fill the matrix with garbage
-  std::fill(matrix.indices.begin(), matrix.indices.end(), 0);
-  std::fill(matrix.values.begin(), matrix.values.end(), 0);
-
   // -------------------------------------------------------------------------
-  // Step 3.1 build offset information and a lambda to quickly access it
-  //          for each array
+  // Step 3.1 build offset information for each array
   // -------------------------------------------------------------------------
   // Perform a scan/inclusive scan over each of the data arrays
   // to figure out the offsets. This shouldn't change whether we're in rsa
@@ -264,18 +1328,6 @@ CL_matrix SparseMatrix<T>::cl_encode(unsigned int device_max_alloc_bytes,
   std::partial_sum(byte_lengths_values.begin(), byte_lengths_values.end() - 1,
                    values_offsets.begin() + 1);
 
-  // std::cout << "indices offsets: [";
-  // for (auto i : indices_offsets) {
-  //   std::cout << i << ",";
-  // }
-  // std::cout << "]\n";
-
-  // std::cout << "value offsets: [";
-  // for (auto i : values_offsets) {
-  //   std::cout << i << ",";
-  // }
-  // std::cout << "]\n";
-
   if (vals_arr_size % sizeof(T) != 0) {
     LOG_DEBUG("Potential alignment issue writing to vals buffer!");
   } else {
@@ -284,114 +1336,635 @@ CL_matrix SparseMatrix<T>::cl_encode(unsigned int device_max_alloc_bytes,
   }
 
   // -------------------------------------------------------------------------
-  // Step 3.1 use the above information to actually input data into the array!
+  // Step 3.2 use the above information to actually input data into the array!
   // -------------------------------------------------------------------------
-  // if we're RSA, write the offset information, and the row sizes + capacities
+  // if we're RSA, the first "row" is a header of offsets to each of the rows
   if (rsa) {
-    LOG_DEBUG("Writing RSA offsets and lengths");
-    // take a pointer to each array,as an integer
-    int *ixptr = reinterpret_cast<int *>(matrix.indices.data());
-    int *valptr = reinterpret_cast<int *>(matrix.values.data());
-    for (int i = 0; i < concrete_height - 1; i++) {
-      // write an offset to ixptr and valptr to the header
-      ixptr[i] = static_cast<int>(indices_offsets[i + 1]);
-      valptr[i] = static_cast<int>(values_offsets[i + 1]);
-      // write size and capacity information to the headers
-      {
-        // write the index
-        byte_size row_offset = indices_offsets[i + 1];
-        // std::cout << "@ " << row_offset << "\n";
-        int *cixptr =
-            reinterpret_cast<int *>(matrix.indices.data() + row_offset);
-        int row_length =
-            (byte_lengths_indices[i + 1] - (2 * sizeof(int))) / sizeof(int);
-        cixptr[0] = row_length;
-        cixptr[1] = row_length;
+    LOG_DEBUG("Writing RSA offsets");
+    if (wide) {
+      int64_t *ixptr = reinterpret_cast<int64_t *>(matrix.indices.data());
+      int64_t *valptr = reinterpret_cast<int64_t *>(matrix.values.data());
+      parallel_for(0, concrete_height - 1, [&](size_t i) {
+        ixptr[i] = static_cast<int64_t>(indices_offsets[i + 1]);
+        valptr[i] = static_cast<int64_t>(values_offsets[i + 1]);
+      });
+    } else {
+      int *ixptr = reinterpret_cast<int *>(matrix.indices.data());
+      int *valptr = reinterpret_cast<int *>(matrix.values.data());
+      parallel_for(0, concrete_height - 1, [&](size_t i) {
+        ixptr[i] = static_cast<int>(indices_offsets[i + 1]);
+        valptr[i] = static_cast<int>(values_offsets[i + 1]);
+      });
+    }
+  }
+
+  // Write the rows, in parallel blocks of rows. Each row is the row's
+  // entries, followed by padding (-1 for indices, zero for values) up to its
+  // concrete length - and, for RSA, preceded by its size and capacity.
+  LOG_DEBUG("Writing array values");
+  const value_size first_row = rsa ? 1 : 0;
+  const value_size matrix_height = static_cast<value_size>(height());
+  // For transposed layouts, the rows are interleaved in chunks of this many
+  // rows: element j of row r is at ((r / chunk) * width + j) * chunk +
+  // (r % chunk)
+  const size_t interleave =
+      layout == EllLayout::COLUMN_MAJOR
+          ? concrete_height
+          : (layout == EllLayout::INTERLEAVED ? height_pad_modulo : 0);
+  if (interleave > 0) {
+    LOG_DEBUG("Interleaving rows in chunks of ", interleave);
+    parallel_for_blocks(
+        0, concrete_height, [&](size_t begin, size_t end, unsigned int) {
+          for (size_t r = begin; r < end; r++) {
+            value_size entries =
+                r < matrix_height ? std::min(row_lengths[r], width_limit) : 0;
+            size_t first = r < matrix_height ? row_ptr[r] : 0;
+            size_t element =
+                ((r / interleave) * regular_width) * interleave +
+                (r % interleave);
+            if (wide) {
+              write_strided_index_row<int64_t>(
+                  matrix.indices.data() + element * index_size,
+                  col_idx.data() + first, entries, regular_width, interleave);
+            } else {
+              write_strided_index_row<int>(
+                  matrix.indices.data() + element * index_size,
+                  col_idx.data() + first, entries, regular_width, interleave);
+            }
+            T *tvals = reinterpret_cast<T *>(matrix.values.data()) + element;
+            for (size_t j = 0; j < (size_t)regular_width; j++) {
+              tvals[j * interleave] =
+                  j < entries ? static_cast<T>(vals[first + j]) : zero;
+            }
+          }
+        });
+  } else {
+    parallel_for_blocks(
+        first_row, concrete_height,
+        [&](size_t begin, size_t end, unsigned int) {
+          for (size_t r = begin; r < end; r++) {
+            value_size y = static_cast<value_size>(r - first_row);
+            value_size length = concrete_lengths[r];
+            value_size entries =
+                y < matrix_height ? std::min(row_lengths[y], width_limit) : 0;
+            size_t first = y < matrix_height ? row_ptr[y] : 0;
+
+            char *ixrow = matrix.indices.data() + indices_offsets[r];
+            char *valrow = matrix.values.data() + values_offsets[r];
+            if (rsa && wide) {
+              int64_t *ixheader = reinterpret_cast<int64_t *>(ixrow);
+              int64_t *valheader = reinterpret_cast<int64_t *>(valrow);
+              ixheader[0] = ixheader[1] = static_cast<int64_t>(length);
+              valheader[0] = valheader[1] = static_cast<int64_t>(length);
+            } else if (rsa) {
+              int *ixheader = reinterpret_cast<int *>(ixrow);
+              int *valheader = reinterpret_cast<int *>(valrow);
+              ixheader[0] = ixheader[1] = static_cast<int>(length);
+              valheader[0] = valheader[1] = static_cast<int>(length);
+            }
+            ixrow += header_size;
+            valrow += header_size;
+
+            if (wide) {
+              write_index_row<int64_t>(ixrow, col_idx.data() + first, entries,
+                                       length);
+            } else {
+              write_index_row<int>(ixrow, col_idx.data() + first, entries,
+                                   length);
+            }
+
+            T *tvals = reinterpret_cast<T *>(valrow);
+            std::copy(vals.begin() + first, vals.begin() + first + entries,
+                      tvals);
+            std::fill_n(tvals + entries, length - entries, zero);
+          }
+        });
+  }
+
+#ifdef DUMP_ENCODED_MATRIX
+  if (wide) {
+    printc_vec<int64_t>(matrix.indices, matrix.indices.size());
+  } else if (rsa) {
+    print_rsa_matrix<int>(matrix.indices, indices_offsets,
+                          byte_lengths_indices.back());
+    print_rsa_matrix<T>(matrix.values, values_offsets,
+                        byte_lengths_values.back());
+  } else {
+    printc_vec<int>(matrix.indices, matrix.indices.size());
+    printc_vec<T>(matrix.values, matrix.values.size());
+  }
+#endif
+
+  LOG_DEBUG("Done encoding");
+  return matrix;
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::encode_hybrid(size_t device_max_alloc_bytes,
+                                         T zero, bool pad_height,
+                                         bool pad_width, int height_pad_modulo,
+                                         int width_pad_modulo, int ell_width,
+                                         int index_bits, EllLayout layout) {
+  start_timer(encode_hybrid, sparse_matrix);
+  CL_matrix matrix =
+      encode(device_max_alloc_bytes, zero, pad_height, pad_width, false,
+             height_pad_modulo, width_pad_modulo, index_bits, layout,
+             static_cast<size_t>(ell_width));
+  typedef unsigned long byte_size;
+
+  // find where each row's tail (the entries past ell_width) goes
+  const size_t h = static_cast<size_t>(height());
+  const size_t width = static_cast<size_t>(ell_width);
+  std::vector<size_t> tail_ptr(h + 1, 0);
+  for (size_t r = 0; r < h; r++) {
+    tail_ptr[r + 1] =
+        tail_ptr[r] + (row_lengths[r] > width ? row_lengths[r] - width : 0);
+  }
+  const size_t tail = tail_ptr[h];
+
+  const bool wide = index_bits == 64;
+  const byte_size index_size = wide ? sizeof(int64_t) : sizeof(int);
+  byte_size tail_arr_size = tail * std::max<byte_size>(index_size, sizeof(T));
+  if (tail_arr_size > device_max_alloc_bytes) {
+    throw tail_arr_size;
+  }
+  std::cerr << "Hybrid ELL + COO (width " << width << " of " << max_width
+            << "): " << col_idx.size() - tail << " non-zeros in "
+            << (size_t)matrix.cl_width * matrix.cl_height
+            << " ELL elements, " << tail << " in the COO tail" << ENDL;
+
+  raw_buffer &coo_rows = matrix.extras["cooRows"];
+  raw_buffer &coo_cols = matrix.extras["cooCols"];
+  raw_buffer &coo_vals = matrix.extras["cooVals"];
+  coo_rows.resize(tail * index_size);
+  coo_cols.resize(tail * index_size);
+  coo_vals.resize(tail * sizeof(T));
+  T *tvals = reinterpret_cast<T *>(coo_vals.data());
+  parallel_for(0, h, [&](size_t r) {
+    size_t first = row_ptr[r] + width;
+    for (size_t i = tail_ptr[r]; i < tail_ptr[r + 1]; i++) {
+      size_t entry = first + (i - tail_ptr[r]);
+      if (wide) {
+        reinterpret_cast<int64_t *>(coo_rows.data())[i] = r;
+        reinterpret_cast<int64_t *>(coo_cols.data())[i] = col_idx[entry];
+      } else {
+        reinterpret_cast<int *>(coo_rows.data())[i] = static_cast<int>(r);
+        reinterpret_cast<int *>(coo_cols.data())[i] = col_idx[entry];
       }
-      {
-        // write the value
-        byte_size row_offset = values_offsets[i + 1];
-        // std::cout << "@p " << row_offset << "\n";
-        int *cvalptr =
-            reinterpret_cast<int *>(matrix.values.data() + row_offset);
-        int row_length =
-            (byte_lengths_values[i + 1] - (2 * sizeof(int))) / sizeof(int);
-        cvalptr[0] = row_length;
-        cvalptr[1] = row_length;
+      tvals[i] = vals[entry];
+    }
+  });
+  return matrix;
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::encode_sliced(size_t device_max_alloc_bytes,
+                                         T zero, int slice_height,
+                                         int sort_window, int index_bits) {
+  start_timer(encode_sliced, sparse_matrix);
+  calculate_ellpack();
+  typedef unsigned long byte_size;
+
+  const bool wide = index_bits == 64;
+  const byte_size index_size = wide ? sizeof(int64_t) : sizeof(int);
+  const size_t h = static_cast<size_t>(height());
+  const size_t c = static_cast<size_t>(slice_height);
+  const size_t slices = (h + c - 1) / c;
+  const size_t padded_height = slices * c;
+
+  // -------------------------------------------------------------------------
+  // Step 1: sort the rows by length (longest first) within each window of
+  //         sort_window rows. Padding rows (past the end of the matrix) stay
+  //         where they are, so perm is a permutation of [0, padded_height).
+  // -------------------------------------------------------------------------
+  std::vector<int> perm(padded_height);
+  std::iota(perm.begin(), perm.end(), 0);
+  const size_t window = static_cast<size_t>(sort_window);
+  parallel_for(0, (h + window - 1) / window, [&](size_t w) {
+    std::stable_sort(perm.begin() + w * window,
+                     perm.begin() + std::min(h, (w + 1) * window),
+                     [&](int a, int b) {
+                       return row_lengths[a] > row_lengths[b];
+                     });
+  });
+  auto length_of = [&](size_t position) -> size_t {
+    size_t row = static_cast<size_t>(perm[position]);
+    return row < h ? row_lengths[row] : 0;
+  };
+
+  // -------------------------------------------------------------------------
+  // Step 2: each slice of slice_height rows is padded to its longest row.
+  //         slice_ptr holds the element offset of each slice.
+  // -------------------------------------------------------------------------
+  std::vector<size_t> slice_ptr(slices + 1, 0);
+  parallel_for(0, slices, [&](size_t s) {
+    size_t width = 0;
+    for (size_t l = 0; l < c; l++) {
+      width = std::max(width, length_of(s * c + l));
+    }
+    slice_ptr[s + 1] = width;
+  });
+  size_t max_slice_width =
+      slices == 0 ? 0
+                  : *std::max_element(slice_ptr.begin() + 1, slice_ptr.end());
+  std::transform(slice_ptr.begin() + 1, slice_ptr.end(),
+                 slice_ptr.begin() + 1,
+                 [c](size_t width) { return width * c; });
+  std::partial_sum(slice_ptr.begin(), slice_ptr.end(), slice_ptr.begin());
+  const size_t elements = slice_ptr.back();
+
+  byte_size ixs_arr_size = elements * index_size;
+  byte_size vals_arr_size = elements * sizeof(T);
+  LOG_DEBUG("ixs_arr_size: (GB) - ",
+            (double)ixs_arr_size / (double)(1024 * 1024 * 1024));
+  byte_size largest_arr_size =
+      std::max({ixs_arr_size, vals_arr_size, (slices + 1) * index_size,
+                padded_height * sizeof(int)});
+  if (largest_arr_size > device_max_alloc_bytes) {
+    throw largest_arr_size;
+  }
+  if (!wide && elements > (size_t)std::numeric_limits<int>::max()) {
+    LOG_ERROR("Sliced matrix of ", elements,
+              " elements is too large for 32 bit slice offsets - use a kernel "
+              "with 64 bit indices (indexBits: 64)");
+    throw ixs_arr_size;
+  }
+  std::cerr << "Sliced ELLPACK (C = " << c << ", sigma = " << window
+            << "): " << elements << " stored elements for "
+            << col_idx.size() << " non-zeros (ELLPACK would store "
+            << h * max_width << ")" << ENDL;
+
+  // -------------------------------------------------------------------------
+  // Step 3: write the slices. Within a slice, elements are stored column
+  //         major - element j of the slice's row l is at
+  //         slice_ptr[s] + j * C + l - so that neighbouring work items read
+  //         neighbouring elements.
+  // -------------------------------------------------------------------------
+  CL_matrix matrix(ixs_arr_size, vals_arr_size,
+                   static_cast<int>(max_slice_width),
+                   static_cast<int>(padded_height));
+  int *ixs32 = reinterpret_cast<int *>(matrix.indices.data());
+  int64_t *ixs64 = reinterpret_cast<int64_t *>(matrix.indices.data());
+  T *tvals = reinterpret_cast<T *>(matrix.values.data());
+  parallel_for(0, slices, [&](size_t s) {
+    size_t width = (slice_ptr[s + 1] - slice_ptr[s]) / c;
+    for (size_t l = 0; l < c; l++) {
+      size_t row = static_cast<size_t>(perm[s * c + l]);
+      size_t entries = length_of(s * c + l);
+      size_t first = row < h ? row_ptr[row] : 0;
+      for (size_t j = 0; j < width; j++) {
+        size_t position = slice_ptr[s] + j * c + l;
+        bool present = j < entries;
+        int column = present ? col_idx[first + j] : -1;
+        if (wide) {
+          ixs64[position] = column;
+        } else {
+          ixs32[position] = column;
+        }
+        tvals[position] = present ? static_cast<T>(vals[first + j]) : zero;
       }
-      // write_ix(0, i + 1, byte_lengths_indices[i + 1]);
-      // write_ix(1, i + 1, byte_lengths_indices[i + 1]);
-      // // todo - replace with proper solution!
-      // write_val(0, i + 1, byte_lengths_values[i + 1]);
-      // write_val(1, i + 1, byte_lengths_values[i + 1]);
     }
+  });
 
-  } else {
-    LOG_DEBUG("Filling with -1 and zero");
-    // if not, fill the ixs array with -1, and the vals array with 0
-    int *ixptr = reinterpret_cast<int *>(matrix.indices.data());
-    T *valptr = reinterpret_cast<T *>(matrix.values.data());
-    for (byte_size i = 0; i < ixs_arr_size / sizeof(int); ++i) {
-      *(ixptr + i) = -1;
+  // the extra buffers - slice offsets (as indices), and the permutation
+  raw_buffer &slice_ptr_buffer = matrix.extras["slicePtr"];
+  slice_ptr_buffer.resize((slices + 1) * index_size);
+  for (size_t s = 0; s <= slices; s++) {
+    if (wide) {
+      reinterpret_cast<int64_t *>(slice_ptr_buffer.data())[s] =
+          static_cast<int64_t>(slice_ptr[s]);
+    } else {
+      reinterpret_cast<int *>(slice_ptr_buffer.data())[s] =
+          static_cast<int>(slice_ptr[s]);
     }
-    for (byte_size i = 0; i < vals_arr_size / sizeof(T); ++i) {
-      *(valptr + i) = zero;
+  }
+  raw_buffer &perm_buffer = matrix.extras["rowPerm"];
+  perm_buffer.resize(padded_height * sizeof(int));
+  memcpy(perm_buffer.data(), perm.data(), padded_height * sizeof(int));
+
+  LOG_DEBUG("Done encoding");
+  return matrix;
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::encode_segmented(size_t device_max_alloc_bytes,
+                                            T zero, int segment_width,
+                                            bool pad_height,
+                                            int height_pad_modulo,
+                                            int index_bits) {
+  start_timer(encode_segmented, sparse_matrix);
+  calculate_ellpack();
+  typedef unsigned long byte_size;
+
+  const bool wide = index_bits == 64;
+  const byte_size index_size = wide ? sizeof(int64_t) : sizeof(int);
+  const size_t h = static_cast<size_t>(height());
+  const size_t w = static_cast<size_t>(segment_width);
+  const size_t segments =
+      std::max<size_t>(1, (static_cast<size_t>(width()) + w - 1) / w);
+  const size_t m = pad_height ? static_cast<size_t>(height_pad_modulo) : 1;
+  const size_t padded_height = ((h + m - 1) / m) * m;
+  const size_t entries = col_idx.size();
+
+  // -------------------------------------------------------------------------
+  // Step 1: count the rows and entries of each segment in each block of
+  //         rows, and work out where each block's part of each segment goes
+  //         (segment by segment, and block by block within a segment).
+  // -------------------------------------------------------------------------
+  std::vector<std::vector<size_t>> row_offsets;
+  std::vector<std::vector<size_t>> entry_offsets;
+  segment_block_counts(segment_width, row_offsets, entry_offsets);
+  std::vector<size_t> segment_ptr(segments + 1, 0);
+  size_t segment_rows = 0;
+  size_t position = 0;
+  for (size_t s = 0; s < segments; s++) {
+    segment_ptr[s] = segment_rows;
+    for (size_t b = 0; b < row_offsets.size(); b++) {
+      size_t rows = row_offsets[b][s];
+      size_t block_entries = entry_offsets[b][s];
+      row_offsets[b][s] = segment_rows;
+      entry_offsets[b][s] = position;
+      segment_rows += rows;
+      position += block_entries;
     }
   }
-  // actually write the matrix data (finally!)
-  LOG_DEBUG("Writing array values");
-  bool ixs_out_of_bounds = false;
-  bool vals_out_of_bounds = false;
-
-  // iterate over rows
-  for (value_size y = 0; y < ellpackMatrix.size(); y++) {
-    // get the row, and iterate over the values
-    std::vector<std::pair<int, T>> &row = (ellpackMatrix[y]);
-    for (value_size i = 0; i < row.size(); i++) {
-      std::pair<int, T> t = row[i];
-      {
-        // write the index
-        byte_size row_offset = indices_offsets[rsa ? y + 1 : y];
-        byte_size column_offset =
-            (sizeof(int) * i) + (rsa ? sizeof(int) * 2 : 0);
-        byte_size offset = row_offset + column_offset;
-        if (offset > ixs_arr_size) {
-          ixs_out_of_bounds = true;
+  segment_ptr[segments] = segment_rows;
+
+  byte_size ixs_arr_size = entries * index_size;
+  byte_size vals_arr_size = entries * sizeof(T);
+  LOG_DEBUG("ixs_arr_size: (GB) - ",
+            (double)ixs_arr_size / (double)(1024 * 1024 * 1024));
+  if (std::max(ixs_arr_size, vals_arr_size) > device_max_alloc_bytes) {
+    throw std::max(ixs_arr_size, vals_arr_size);
+  }
+  if (!wide && entries > (size_t)std::numeric_limits<int>::max()) {
+    LOG_ERROR("Segmented matrix of ", entries,
+              " entries is too large for 32 bit segment row pointers - use a "
+              "kernel with 64 bit indices (indexBits: 64)");
+    throw ixs_arr_size;
+  }
+  std::cerr << "Segmented CSR (" << segments << " segments of " << w
+            << " columns): " << segment_rows << " segment rows for " << h
+            << " rows and " << entries << " non-zeros" << ENDL;
+
+  // -------------------------------------------------------------------------
+  // Step 2: write each row's part of each segment - its row, where its
+  //         entries start, and its entries, with their columns relative to
+  //         the start of the segment.
+  // -------------------------------------------------------------------------
+  CL_matrix matrix(ixs_arr_size, vals_arr_size, static_cast<int>(max_width),
+                   static_cast<int>(padded_height));
+  raw_buffer &rows_buffer = matrix.extras["segmentRows"];
+  rows_buffer.resize(segment_rows * sizeof(int));
+  raw_buffer &row_ptr_buffer = matrix.extras["segmentRowPtr"];
+  row_ptr_buffer.resize((segment_rows + 1) * index_size);
+  int *ixs32 = reinterpret_cast<int *>(matrix.indices.data());
+  int64_t *ixs64 = reinterpret_cast<int64_t *>(matrix.indices.data());
+  T *tvals = reinterpret_cast<T *>(matrix.values.data());
+  int *row_ids = reinterpret_cast<int *>(rows_buffer.data());
+  auto set_index = [wide](raw_buffer &buffer, size_t i, size_t value) {
+    if (wide) {
+      reinterpret_cast<int64_t *>(buffer.data())[i] =
+          static_cast<int64_t>(value);
+    } else {
+      reinterpret_cast<int *>(buffer.data())[i] = static_cast<int>(value);
+    }
+  };
+  parallel_for_blocks(0, h, [&](size_t begin, size_t end, unsigned int b) {
+    auto &next_row = row_offsets[b];
+    auto &next_entry = entry_offsets[b];
+    for (size_t r = begin; r < end; r++) {
+      size_t i = row_ptr[r];
+      while (i < row_ptr[r + 1]) {
+        size_t s = static_cast<size_t>(col_idx[i]) / w;
+        row_ids[next_row[s]] = static_cast<int>(r);
+        set_index(row_ptr_buffer, next_row[s], next_entry[s]);
+        next_row[s]++;
+        for (; i < row_ptr[r + 1] && static_cast<size_t>(col_idx[i]) / w == s;
+             i++) {
+          int64_t column = static_cast<int64_t>(col_idx[i] - s * w);
+          if (wide) {
+            ixs64[next_entry[s]] = column;
+          } else {
+            ixs32[next_entry[s]] = static_cast<int>(column);
+          }
+          tvals[next_entry[s]] = static_cast<T>(vals[i]);
+          next_entry[s]++;
         }
+      }
+    }
+  });
+  set_index(row_ptr_buffer, segment_rows, entries);
+
+  // the offsets of the segments (as indices)
+  raw_buffer &segment_ptr_buffer = matrix.extras["segmentPtr"];
+  segment_ptr_buffer.resize((segments + 1) * index_size);
+  for (size_t s = 0; s <= segments; s++) {
+    set_index(segment_ptr_buffer, s, segment_ptr[s]);
+  }
+
+  LOG_DEBUG("Done encoding");
+  return matrix;
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::encode_dia(size_t device_max_alloc_bytes, T zero,
+                                      double coverage, bool pad_height,
+                                      int height_pad_modulo, int index_bits) {
+  start_timer(encode_dia, sparse_matrix);
+  typedef unsigned long byte_size;
 
-        char *cixptr = matrix.indices.data() + offset;
-        *reinterpret_cast<int *>(cixptr) = t.first;
+  const bool wide = index_bits == 64;
+  const byte_size index_size = wide ? sizeof(int64_t) : sizeof(int);
+  const size_t h = static_cast<size_t>(height());
+  const size_t m = pad_height ? static_cast<size_t>(height_pad_modulo) : 1;
+  const size_t padded_height = ((h + m - 1) / m) * m;
+
+  // -------------------------------------------------------------------------
+  // Step 1: choose the diagonals, and find which entries are on them. The
+  //         rest - including any duplicates of an entry, which can't share
+  //         its element - go into the tail.
+  // -------------------------------------------------------------------------
+  std::vector<int> offsets = dia_offsets(coverage);
+  const size_t diagonals = offsets.size();
+  std::vector<int> diagonal_of(h + static_cast<size_t>(width()), -1);
+  for (size_t d = 0; d < diagonals; d++) {
+    diagonal_of[offsets[d] + (h - 1)] = static_cast<int>(d);
+  }
+  auto stored_diagonal = [&](size_t r, size_t i) -> int {
+    if (i > row_ptr[r] && col_idx[i] == col_idx[i - 1]) {
+      return -1;
+    }
+    return diagonal_of[col_idx[i] + (h - 1) - r];
+  };
+  std::vector<size_t> tail_ptr(h + 1, 0);
+  parallel_for(0, h, [&](size_t r) {
+    size_t tail = 0;
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      if (stored_diagonal(r, i) < 0) {
+        tail++;
       }
-      {
-        // start off with our offset at zero
-        byte_size row_offset = values_offsets[rsa ? y + 1 : y];
-        byte_size column_offset = (sizeof(T) * i) + (rsa ? sizeof(int) * 2 : 0);
-        byte_size offset = row_offset + column_offset;
-        if (offset > vals_arr_size) {
-          vals_out_of_bounds = true;
-        }
-        // NEVER EVER EVER EVER DO THIS IN REAL LIFE
-        char *cvalptr = matrix.values.data() + offset;
-        *(reinterpret_cast<T *>(cvalptr)) = t.second;
+    }
+    tail_ptr[r + 1] = tail;
+  });
+  std::partial_sum(tail_ptr.begin(), tail_ptr.end(), tail_ptr.begin());
+  const size_t tail = tail_ptr[h];
+  const size_t elements = diagonals * padded_height;
+
+  byte_size vals_arr_size = elements * sizeof(T);
+  if (std::max(vals_arr_size, tail * index_size) > device_max_alloc_bytes) {
+    throw std::max(vals_arr_size, tail * index_size);
+  }
+  std::cerr << "DIA (" << diagonals << " diagonals): "
+            << col_idx.size() - tail << " non-zeros in " << elements
+            << " elements, " << tail << " in the COO tail" << ENDL;
+
+  // -------------------------------------------------------------------------
+  // Step 2: write the diagonals - element r of diagonal d is at
+  //         d * padded_height + r - and the tail.
+  // -------------------------------------------------------------------------
+  CL_matrix matrix(diagonals * sizeof(int), vals_arr_size,
+                   static_cast<int>(diagonals),
+                   static_cast<int>(padded_height));
+  std::copy(offsets.begin(), offsets.end(),
+            reinterpret_cast<int *>(matrix.indices.data()));
+  T *tvals = reinterpret_cast<T *>(matrix.values.data());
+  std::fill(tvals, tvals + elements, zero);
+  raw_buffer &coo_rows = matrix.extras["cooRows"];
+  raw_buffer &coo_cols = matrix.extras["cooCols"];
+  raw_buffer &coo_vals = matrix.extras["cooVals"];
+  coo_rows.resize(tail * index_size);
+  coo_cols.resize(tail * index_size);
+  coo_vals.resize(tail * sizeof(T));
+  T *tail_vals = reinterpret_cast<T *>(coo_vals.data());
+  parallel_for(0, h, [&](size_t r) {
+    size_t t = tail_ptr[r];
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      int d = stored_diagonal(r, i);
+      if (d >= 0) {
+        tvals[static_cast<size_t>(d) * padded_height + r] =
+            static_cast<T>(vals[i]);
+        continue;
+      }
+      if (wide) {
+        reinterpret_cast<int64_t *>(coo_rows.data())[t] = r;
+        reinterpret_cast<int64_t *>(coo_cols.data())[t] = col_idx[i];
+      } else {
+        reinterpret_cast<int *>(coo_rows.data())[t] = static_cast<int>(r);
+        reinterpret_cast<int *>(coo_cols.data())[t] = col_idx[i];
       }
+      tail_vals[t] = static_cast<T>(vals[i]);
+      t++;
     }
+  });
+
+  LOG_DEBUG("Done encoding");
+  return matrix;
+}
+
+template <typename T>
+CL_matrix SparseMatrix<T>::encode_bcsr(size_t device_max_alloc_bytes, T zero,
+                                       int block_rows, int block_cols,
+                                       int index_bits) {
+  start_timer(encode_bcsr, sparse_matrix);
+  typedef unsigned long byte_size;
+
+  const bool wide = index_bits == 64;
+  const byte_size index_size = wide ? sizeof(int64_t) : sizeof(int);
+  const size_t h = static_cast<size_t>(height());
+  const size_t r = static_cast<size_t>(block_rows);
+  const size_t c = static_cast<size_t>(block_cols);
+  const size_t padded_height = bcsr_padded_height(block_rows, block_cols);
+  const size_t block_height = padded_height / r;
+
+  // a block has one element per position, so can't hold a duplicate
+  size_t duplicates = 0;
+  for (size_t row = 0; row < h; row++) {
+    for (size_t i = row_ptr[row] + 1; i < row_ptr[row + 1]; i++) {
+      duplicates += col_idx[i] == col_idx[i - 1] ? 1 : 0;
+    }
+  }
+  if (duplicates > 0) {
+    std::cerr << "A BCSR matrix can't hold the " << duplicates
+              << " duplicate entries of this matrix - merge them (with a "
+                 "duplicates policy other than keep) first"
+              << ENDL;
+    exit(-1);
   }
 
-  if (ixs_out_of_bounds) {
-    LOG_WARNING("At least one index was written out of bounds!");
+  // -------------------------------------------------------------------------
+  // Step 1: count the blocks in each block row - the distinct block columns
+  //         of its rows.
+  // -------------------------------------------------------------------------
+  std::vector<size_t> row_blocks = bcsr_blocks(block_rows, block_cols);
+  std::vector<size_t> block_ptr(block_height + 1, 0);
+  std::copy(row_blocks.begin(), row_blocks.end(), block_ptr.begin() + 1);
+  const size_t max_blocks =
+      row_blocks.empty()
+          ? 0
+          : *std::max_element(row_blocks.begin(), row_blocks.end());
+  std::partial_sum(block_ptr.begin(), block_ptr.end(), block_ptr.begin());
+  const size_t blocks = block_ptr[block_height];
+  const size_t elements = blocks * r * c;
+
+  byte_size ixs_arr_size = blocks * index_size;
+  byte_size vals_arr_size = elements * sizeof(T);
+  if (std::max(ixs_arr_size, vals_arr_size) > device_max_alloc_bytes) {
+    throw std::max(ixs_arr_size, vals_arr_size);
   }
-  if (vals_out_of_bounds) {
-    LOG_WARNING("At least one value was written out of bounds!");
+  if (!wide && blocks > (size_t)std::numeric_limits<int>::max()) {
+    LOG_ERROR("BCSR matrix of ", blocks,
+              " blocks is too large for 32 bit block pointers - use a kernel "
+              "with 64 bit indices (indexBits: 64)");
+    throw ixs_arr_size;
   }
+  std::cerr << "BCSR (" << r << "x" << c << " blocks): " << blocks
+            << " blocks, " << elements << " stored elements for "
+            << col_idx.size() << " non-zeros" << ENDL;
 
-  if (rsa) {
-    print_rsa_matrix<int>(matrix.indices, indices_offsets,
-                          byte_lengths_indices.back());
-    print_rsa_matrix<T>(matrix.values, values_offsets,
-                        byte_lengths_values.back());
+  // -------------------------------------------------------------------------
+  // Step 2: write each block row - element (i, j) of block b is at
+  //         b * r * c + i * c + j, and is the entry in row br * r + i and
+  //         column (block column) * c + j, or zero if there isn't one.
+  // -------------------------------------------------------------------------
+  CL_matrix matrix(ixs_arr_size, vals_arr_size, static_cast<int>(max_blocks),
+                   static_cast<int>(padded_height));
+  int *ixs32 = reinterpret_cast<int *>(matrix.indices.data());
+  int64_t *ixs64 = reinterpret_cast<int64_t *>(matrix.indices.data());
+  T *tvals = reinterpret_cast<T *>(matrix.values.data());
+  std::fill(tvals, tvals + elements, zero);
+  parallel_for(0, block_height, [&](size_t br) {
+    auto columns = bcsr_block_columns(br, block_rows, block_cols);
+    const size_t base = block_ptr[br];
+    for (size_t k = 0; k < columns.size(); k++) {
+      if (wide) {
+        ixs64[base + k] = columns[k];
+      } else {
+        ixs32[base + k] = columns[k];
+      }
+    }
+    for (size_t row = br * r; row < std::min(h, (br + 1) * r); row++) {
+      for (size_t i = row_ptr[row]; i < row_ptr[row + 1]; i++) {
+        const int column = col_idx[i];
+        const size_t k =
+            std::lower_bound(columns.begin(), columns.end(),
+                             column / block_cols) -
+            columns.begin();
+        tvals[(base + k) * r * c + (row - br * r) * c + column % c] =
+            static_cast<T>(vals[i]);
+      }
+    }
+  });
+
+  // the extra buffer - the block row pointers (as indices)
+  raw_buffer &block_ptr_buffer = matrix.extras["blockPtr"];
+  block_ptr_buffer.resize((block_height + 1) * index_size);
+  if (wide) {
+    std::copy(block_ptr.begin(), block_ptr.end(),
+              reinterpret_cast<int64_t *>(block_ptr_buffer.data()));
   } else {
-    printc_vec<int>(matrix.indices, matrix.indices.size());
-    printc_vec<T>(matrix.values, matrix.values.size());
+    std::copy(block_ptr.begin(), block_ptr.end(),
+              reinterpret_cast<int *>(block_ptr_buffer.data()));
   }
 
   LOG_DEBUG("Done encoding");
@@ -399,59 +1972,496 @@ CL_matrix SparseMatrix<T>::cl_encode(unsigned int device_max_alloc_bytes,
 }
 
 template <typename T>
-SparseMatrix<T>::ellpack_matrix<T> &SparseMatrix<T>::ellpack_encode() {
+typename SparseMatrix<T>::ellpack_matrix_view
+SparseMatrix<T>::ellpack_encode() {
   if (!ellpack_calculated) {
     calculate_ellpack();
   }
-  return ellpackMatrix;
+  return ellpack_matrix_view(col_idx, vals, row_ptr);
+}
+
+template <typename T>
+void SparseMatrix<T>::coalesce(DuplicatePolicy policy, bool drop_self_loops) {
+  if (policy == DuplicatePolicy::KEEP && !drop_self_loops) {
+    return;
+  }
+  start_timer(coalesce, sparse_matrix);
+  calculate_ellpack();
+  const size_t h = static_cast<size_t>(height());
+  const bool merge = policy != DuplicatePolicy::KEEP;
+  const unsigned int old_width = max_width;
+  const size_t old_entries = col_idx.size();
+
+  // first pass: count the entries we keep in each row. The rows are sorted
+  // by column, so duplicates are always next to each other.
+  std::vector<size_t> new_row_ptr(h + 1, 0);
+  std::vector<size_t> block_self_loops(block_count(0, h), 0);
+  parallel_for_blocks(
+      0, h, [&](size_t begin, size_t end, unsigned int b) {
+        for (size_t y = begin; y < end; y++) {
+          size_t kept = 0;
+          for (size_t i = row_ptr[y]; i < row_ptr[y + 1]; i++) {
+            if (drop_self_loops && static_cast<size_t>(col_idx[i]) == y) {
+              block_self_loops[b]++;
+              continue;
+            }
+            if (merge && kept > 0 && col_idx[i] == col_idx[i - 1]) {
+              continue;
+            }
+            kept++;
+          }
+          new_row_ptr[y + 1] = kept;
+        }
+      });
+  std::partial_sum(new_row_ptr.begin(), new_row_ptr.end(),
+                   new_row_ptr.begin());
+
+  // second pass: copy the entries we keep, merging duplicates
+  std::vector<int> new_col_idx(new_row_ptr.back());
+  std::vector<T> new_vals(new_row_ptr.back());
+  parallel_for(0, h,
+               [&](size_t y) {
+                 size_t out = new_row_ptr[y];
+                 for (size_t i = row_ptr[y]; i < row_ptr[y + 1]; i++) {
+                   if (drop_self_loops &&
+                       static_cast<size_t>(col_idx[i]) == y) {
+                     continue;
+                   }
+                   T val = vals[i];
+                   if (merge && out > new_row_ptr[y] &&
+                       new_col_idx[out - 1] == col_idx[i]) {
+                     T merged = new_vals[out - 1];
+                     new_vals[out - 1] =
+                         combine_duplicates<T>(policy, merged, val);
+                   } else {
+                     new_col_idx[out] = col_idx[i];
+                     new_vals[out] = val;
+                     out++;
+                   }
+                 }
+               },
+               value_thread_count<T>());
+  row_ptr.swap(new_row_ptr);
+  col_idx.swap(new_col_idx);
+  vals.swap(new_vals);
+  record_transform(TRANSFORM_COALESCE, static_cast<uint64_t>(policy) * 2 +
+                                           (drop_self_loops ? 1 : 0));
+
+  // recalculate the row lengths, and report what we saved
+  ellpack_calculated = false;
+  calculate_ellpack();
+  size_t self_loops = std::accumulate(block_self_loops.begin(),
+                                      block_self_loops.end(), (size_t)0);
+  size_t duplicates = old_entries - col_idx.size() - self_loops;
+  const size_t entry_bytes = sizeof(int) + sizeof(T);
+  size_t old_bytes = old_entries * entry_bytes;
+  size_t new_bytes = col_idx.size() * entry_bytes;
+  size_t old_padded_bytes = h * old_width * entry_bytes;
+  size_t new_padded_bytes = h * max_width * entry_bytes;
+  std::cerr << "Coalesced matrix (duplicates: "
+            << duplicate_policy_name(policy)
+            << ", self loops: " << (drop_self_loops ? "dropped" : "kept")
+            << "): merged " << duplicates << " duplicate entries, dropped "
+            << self_loops << " self loops, entries " << old_bytes << " -> "
+            << new_bytes << " bytes (saved " << (old_bytes - new_bytes)
+            << "), max width " << old_width << " -> " << max_width
+            << ", padded ELLPACK " << old_padded_bytes << " -> "
+            << new_padded_bytes << " bytes (saved "
+            << (old_padded_bytes - new_padded_bytes) << ")" << ENDL;
+}
+
+template <typename T> void SparseMatrix<T>::reorder(Reordering reordering) {
+  if (reordering == Reordering::NONE) {
+    return;
+  }
+  if (rows != cols) {
+    LOG_WARNING("Can't reorder a matrix that isn't square");
+    return;
+  }
+  start_timer(reorder, sparse_matrix);
+  auto start = std::chrono::steady_clock::now();
+  const size_t n = static_cast<size_t>(rows);
+  const size_t old_bandwidth = bandwidth();
+  const size_t old_profile = profile();
+
+  // the (undirected) graph of the matrix, without self loops
+  std::vector<size_t> adj_ptr(n + 1, 0);
+  for (size_t r = 0; r < n; r++) {
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      if (static_cast<size_t>(col_idx[i]) != r) {
+        adj_ptr[r + 1]++;
+        adj_ptr[col_idx[i] + 1]++;
+      }
+    }
+  }
+  std::partial_sum(adj_ptr.begin(), adj_ptr.end(), adj_ptr.begin());
+  std::vector<int> adj(adj_ptr.back());
+  std::vector<size_t> fill(adj_ptr.begin(), adj_ptr.end() - 1);
+  for (size_t r = 0; r < n; r++) {
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      if (static_cast<size_t>(col_idx[i]) != r) {
+        adj[fill[r]++] = col_idx[i];
+        adj[fill[col_idx[i]]++] = static_cast<int>(r);
+      }
+    }
+  }
+
+  // the old number of each new vertex
+  std::vector<int> order;
+  switch (reordering) {
+  case Reordering::RCM:
+    order = breadth_first_order(adj_ptr, adj, true);
+    std::reverse(order.begin(), order.end());
+    break;
+  case Reordering::BFS:
+    order = breadth_first_order(adj_ptr, adj, false);
+    break;
+  case Reordering::DEGREE:
+  default:
+    order.resize(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) {
+      return adj_ptr[a + 1] - adj_ptr[a] > adj_ptr[b + 1] - adj_ptr[b];
+    });
+    break;
+  }
+  std::vector<int> new_number(n);
+  for (size_t v = 0; v < n; v++) {
+    new_number[order[v]] = static_cast<int>(v);
+  }
+
+  // renumber the rows and columns, keeping each row sorted by column
+  std::vector<size_t> new_row_ptr(n + 1, 0);
+  for (size_t r = 0; r < n; r++) {
+    new_row_ptr[r + 1] = row_ptr[order[r] + 1] - row_ptr[order[r]];
+  }
+  std::partial_sum(new_row_ptr.begin(), new_row_ptr.end(),
+                   new_row_ptr.begin());
+  std::vector<int> new_col_idx(col_idx.size());
+  std::vector<T> new_vals(vals.size());
+  parallel_for(0, n,
+               [&](size_t r) {
+                 size_t old_row = static_cast<size_t>(order[r]);
+                 std::vector<std::pair<int, T>> entries;
+                 for (size_t i = row_ptr[old_row]; i < row_ptr[old_row + 1];
+                      i++) {
+                   entries.push_back(
+                       std::make_pair(new_number[col_idx[i]], vals[i]));
+                 }
+                 std::stable_sort(entries.begin(), entries.end(),
+                                  [](const std::pair<int, T> &a,
+                                     const std::pair<int, T> &b) {
+                                    return a.first < b.first;
+                                  });
+                 size_t out = new_row_ptr[r];
+                 for (auto &entry : entries) {
+                   new_col_idx[out] = entry.first;
+                   new_vals[out] = entry.second;
+                   out++;
+                 }
+               },
+               value_thread_count<T>());
+  row_ptr.swap(new_row_ptr);
+  col_idx.swap(new_col_idx);
+  vals.swap(new_vals);
+  if (lower_only) {
+    fold_lower_triangle();
+  }
+  record_transform(TRANSFORM_REORDER, static_cast<uint64_t>(reordering));
+  ellpack_calculated = false;
+
+  // compose with any earlier reordering
+  if (!row_order.empty()) {
+    for (auto &v : order) {
+      v = row_order[v];
+    }
+  }
+  row_order.swap(order);
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cerr << "Reordered matrix (" << reordering_name(reordering) << ") in "
+            << elapsed.count() * 1000.0 << " ms: bandwidth " << old_bandwidth
+            << " -> " << bandwidth() << ", profile " << old_profile << " -> "
+            << profile() << ENDL;
+}
+
+template <typename T> void SparseMatrix<T>::fold_lower_triangle() {
+  start_timer(fold_lower_triangle, sparse_matrix);
+  const size_t h = static_cast<size_t>(height());
+  std::vector<int> coo_rows(col_idx.size());
+  std::vector<int> coo_cols(col_idx.size());
+  parallel_for(0, h, [&](size_t r) {
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      coo_rows[i] = std::max(static_cast<int>(r), col_idx[i]);
+      coo_cols[i] = std::min(static_cast<int>(r), col_idx[i]);
+    }
+  });
+  std::vector<T> coo_vals;
+  coo_vals.swap(vals);
+  build_csr(rows, coo_rows, coo_cols, coo_vals, row_ptr, col_idx, vals);
+}
+
+template <typename T> size_t SparseMatrix<T>::bandwidth() {
+  size_t widest = 0;
+  for (size_t r = 0; r + 1 < row_ptr.size(); r++) {
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      size_t c = static_cast<size_t>(col_idx[i]);
+      widest = std::max(widest, c > r ? c - r : r - c);
+    }
+  }
+  return widest;
+}
+
+template <typename T> size_t SparseMatrix<T>::profile() {
+  size_t total = 0;
+  for (size_t r = 0; r + 1 < row_ptr.size(); r++) {
+    if (row_ptr[r] == row_ptr[r + 1]) {
+      continue;
+    }
+    // the columns are sorted, so the furthest entry is at one end
+    size_t first = static_cast<size_t>(col_idx[row_ptr[r]]);
+    size_t last = static_cast<size_t>(col_idx[row_ptr[r + 1] - 1]);
+    total += std::max(first < r ? r - first : 0, last > r ? last - r : 0);
+  }
+  return total;
+}
+
+template <typename T> MatrixProfile SparseMatrix<T>::structure_profile() {
+  start_timer(structure_profile, sparse_matrix);
+  if (!use_cache) {
+    return calculate_profile();
+  }
+  // the profile is cached like an encoding - as the "values" of an encoded
+  // matrix cache file
+  uint64_t key = encoding_key(T(), {ENCODING_PROFILE});
+  std::string profile_filename =
+      MatrixCache::encoded_filename(filename, ValueType<T>::name(), key);
+  MatrixProfile profile;
+  EncodedCacheHeader header;
+  const size_t profile_offset = MatrixCache::align(sizeof(header));
+  {
+    MappedFile cache(profile_filename);
+    if (cache.valid() && cache.size() >= profile_offset + sizeof(profile)) {
+      memcpy(&header, cache.data(), sizeof(header));
+      if (MatrixCache::encoded_header_matches(header, key, ValueType<T>::name(),
+                                              sizeof(T)) &&
+          header.values_bytes == sizeof(profile)) {
+        LOG_INFO("Loading matrix profile from cache ", profile_filename);
+        memcpy(&profile, cache.data() + profile_offset, sizeof(profile));
+        return profile;
+      }
+    }
+  }
+  profile = calculate_profile();
+  header =
+      MatrixCache::make_encoded_header(key, ValueType<T>::name(), sizeof(T));
+  header.values_bytes = sizeof(profile);
+  MatrixCache::write(profile_filename, header, {{&profile, sizeof(profile)}});
+  return profile;
+}
+
+template <typename T> MatrixProfile SparseMatrix<T>::calculate_profile() {
+  start_timer(calculate_profile, sparse_matrix);
+  calculate_ellpack();
+  const size_t h = static_cast<size_t>(height());
+  const size_t entries = col_idx.size();
+  MatrixProfile profile;
+  memset(&profile, 0, sizeof(profile));
+  profile.rows = rows;
+  profile.cols = cols;
+  profile.entries = entries;
+  profile.max_row = max_width;
+
+  // gather what we can in a single pass over the rows, in parallel blocks
+  struct BlockStats {
+    double sum_squares = 0.0;
+    size_t bandwidth = 0;
+    size_t profile = 0;
+    size_t dominant = 0;
+    uint64_t histogram[PROFILE_HISTOGRAM_BUCKETS] = {};
+  };
+  std::vector<BlockStats> blocks(block_count(0, h));
+  parallel_for_blocks(0, h, [&](size_t begin, size_t end, unsigned int b) {
+    BlockStats &stats = blocks[b];
+    for (size_t r = begin; r < end; r++) {
+      size_t length = row_lengths[r];
+      stats.sum_squares += static_cast<double>(length) * length;
+      unsigned int bucket = 0;
+      while (bucket + 1 < PROFILE_HISTOGRAM_BUCKETS && (length >> bucket)) {
+        bucket++;
+      }
+      stats.histogram[bucket]++;
+      if (length == 0) {
+        continue;
+      }
+      // the columns are sorted, so the furthest entry is at one end
+      size_t first = static_cast<size_t>(col_idx[row_ptr[r]]);
+      size_t last = static_cast<size_t>(col_idx[row_ptr[r + 1] - 1]);
+      size_t widest = std::max(first < r ? r - first : 0,
+                               last > r ? last - r : 0);
+      stats.bandwidth = std::max(stats.bandwidth, widest);
+      stats.profile += widest;
+      bool has_diagonal = false;
+      double diagonal = 0.0;
+      double rest = 0.0;
+      for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+        double magnitude = std::fabs(static_cast<double>(vals[i]));
+        if (static_cast<size_t>(col_idx[i]) == r) {
+          has_diagonal = true;
+          diagonal += magnitude;
+        } else {
+          rest += magnitude;
+        }
+      }
+      if (has_diagonal && diagonal >= rest) {
+        stats.dominant++;
+      }
+    }
+  });
+  double sum_squares = 0.0;
+  size_t dominant = 0;
+  for (auto &stats : blocks) {
+    sum_squares += stats.sum_squares;
+    profile.bandwidth = std::max<uint64_t>(profile.bandwidth, stats.bandwidth);
+    profile.profile += stats.profile;
+    dominant += stats.dominant;
+    for (int b = 0; b < PROFILE_HISTOGRAM_BUCKETS; b++) {
+      profile.row_histogram[b] += stats.histogram[b];
+    }
+  }
+  if (h == 0) {
+    return profile;
+  }
+  const double n = static_cast<double>(h);
+  profile.mean_row = entries / n;
+  profile.stddev_row = std::sqrt(
+      std::max(0.0, sum_squares / n - profile.mean_row * profile.mean_row));
+  profile.empty_rows = profile.row_histogram[0] / n;
+  profile.diagonal_dominance = dominant / n;
+
+  // The Gini coefficient, from the rows sorted by length: with 1-based
+  // ranks i, G = 2 * sum(i * length_i) / (n * entries) - (n + 1) / n. Rows
+  // of the same length have consecutive ranks, so go through a histogram of
+  // the lengths rather than sorting.
+  std::vector<size_t> lengths(max_width + 1, 0);
+  for (auto length : row_lengths) {
+    lengths[length]++;
+  }
+  double ranked = 0.0;
+  double rank = 0.0;
+  for (size_t length = 0; length < lengths.size(); length++) {
+    double count = static_cast<double>(lengths[length]);
+    ranked += length * (count * rank + count * (count + 1) / 2);
+    rank += count;
+  }
+  if (entries > 0) {
+    profile.gini_row = 2 * ranked / (n * entries) - (n + 1) / n;
+  }
+
+  // and the padding of each encoding
+  if (entries > 0) {
+    size_t ell_width =
+        static_cast<size_t>(hybrid_width(PROFILE_HYBRID_COVERAGE));
+    size_t tail = 0;
+    for (auto length : row_lengths) {
+      tail += length > ell_width ? length - ell_width : 0;
+    }
+    profile.ellpack_padding = n * max_width / entries;
+    profile.sliced_padding =
+        static_cast<double>(
+            sliced_elements(PROFILE_SLICE_HEIGHT, PROFILE_SORT_WINDOW)) /
+        entries;
+    profile.hybrid_padding = (n * ell_width + tail) / entries;
+  }
+
+  std::cerr << "Matrix profile: rows " << profile.mean_row << " +- "
+            << profile.stddev_row << " long (max " << profile.max_row
+            << ", gini " << profile.gini_row << ", "
+            << 100.0 * profile.empty_rows << "% empty), bandwidth "
+            << profile.bandwidth << ", diagonally dominant rows "
+            << 100.0 * profile.diagonal_dominance << "%, padding ELLPACK "
+            << profile.ellpack_padding << "x, sliced " << profile.sliced_padding
+            << "x, hybrid " << profile.hybrid_padding << "x" << ENDL;
+  return profile;
+}
+
+template <typename T>
+size_t SparseMatrix<T>::sliced_elements(int slice_height, int sort_window) {
+  calculate_ellpack();
+  // sort the row lengths within each window (as encode_sliced does), and
+  // pad each slice to its longest row
+  const size_t h = static_cast<size_t>(height());
+  const size_t c = static_cast<size_t>(slice_height);
+  const size_t window = static_cast<size_t>(sort_window);
+  const size_t slices = (h + c - 1) / c;
+  std::vector<unsigned int> lengths(slices * c, 0);
+  std::copy(row_lengths.begin(), row_lengths.end(), lengths.begin());
+  parallel_for(0, (h + window - 1) / window, [&](size_t w) {
+    std::sort(lengths.begin() + w * window,
+              lengths.begin() + std::min(h, (w + 1) * window),
+              std::greater<unsigned int>());
+  });
+  size_t elements = 0;
+  for (size_t s = 0; s < slices; s++) {
+    elements += c * *std::max_element(lengths.begin() + s * c,
+                                      lengths.begin() + (s + 1) * c);
+  }
+  return elements;
 }
 
 template <typename T>
 void SparseMatrix<T>::pagerank_normalise(float dampingFactor, T zero) {
   start_timer(pagerank_normalise, sparse_matrix);
+  check_whole("PageRank normalisation");
+  uint64_t parameters = 0;
+  memcpy(&parameters, &dampingFactor, sizeof(float));
+  record_transform(TRANSFORM_PAGERANK_NORMALISE, parameters);
   // first, calculate the transposed sums
   // (i.e. sum the columns)
   std::vector<T> column_sums(width(), zero);
-  for (unsigned int i = 0; i < nz_entries.size(); i++) {
-    int x = std::get<0>(nz_entries[i]);
-    T val = std::get<2>(nz_entries[i]);
-    column_sums[x] = column_sums[x] + val;
+  for (size_t i = 0; i < col_idx.size(); i++) {
+    column_sums[col_idx[i]] = column_sums[col_idx[i]] + vals[i];
   }
 
   // next, iterate over all the values, divide them by the column size
   // and apply a damping factor
-  std::transform(nz_entries.begin(), nz_entries.end(), nz_entries.begin(),
-                 [&column_sums, &dampingFactor](std::tuple<int, int, T> elem) {
-                   int x = std::get<0>(elem);
-                   int y = std::get<1>(elem);
-                   T val = std::get<2>(elem);
-                   T new_val = (fabs(val) / column_sums[x]) * dampingFactor;
-                   return std::make_tuple(x, y, new_val);
-                 });
+  parallel_for(0, vals.size(),
+               [&](size_t i) {
+                 T val = vals[i];
+                 vals[i] =
+                     (fabs(val) / column_sums[col_idx[i]]) * dampingFactor;
+               },
+               value_thread_count<T>());
 }
 
 template <typename T> void SparseMatrix<T>::scc_normalise() {
   start_timer(scc_normalise, sparse_matrix);
-  // iterate over the tuples, setting the nz entries values to the row
-  // std::transform(nz_entries.begin(), nz_entries.end(), nz_entries.begin(),
-  //                [](std::tuple<int, int, T> elem) {
-  //                  int x = std::get<0>(elem);
-  //                  int y = std::get<1>(elem);
-  //                  // T val = std::get<2>(elem);
-  //                  return std::make_tuple(x, y, (int)y);
-  //                });
-  for (unsigned int i = 0; i < nz_entries.size(); i++) {
-    auto elem = nz_entries[i];
-    int x = std::get<0>(elem);
-    int y = std::get<1>(elem);
-    // T val = std::get<2>(elem);
-    std::tuple<int, int, T> new_tuple;
-    if (x == y) {
-      new_tuple = std::make_tuple(x, y, std::numeric_limits<T>::min());
-    } else {
-      new_tuple = std::make_tuple(x, y, (int)y);
-    }
-    nz_entries[i] = new_tuple;
+  check_whole("SCC normalisation");
+  record_transform(TRANSFORM_SCC_NORMALISE, 0);
+  // iterate over the rows, setting the values of the entries to the row (or
+  // to the minimum value, if we're on the diagonal)
+  parallel_for(0, static_cast<size_t>(height()),
+               [&](size_t y) {
+                 for (size_t i = row_ptr[y]; i < row_ptr[y + 1]; i++) {
+                   if (static_cast<size_t>(col_idx[i]) == y) {
+                     vals[i] = std::numeric_limits<T>::min();
+                   } else {
+                     vals[i] = static_cast<T>(y);
+                   }
+                 }
+               },
+               value_thread_count<T>());
+}
+
+template <typename T>
+void SparseMatrix<T>::check_whole(const std::string &transform) {
+  if (lower_only) {
+    std::cerr << transform
+              << " gives the two halves of a symmetric matrix different "
+                 "values, so it can't be applied to half storage"
+              << ENDL;
+    exit(-1);
   }
 }
 
@@ -459,18 +2469,63 @@ template <typename T> void SparseMatrix<T>::calculate_transposed_sum() {
   start_timer(calculate_transposed_sum, sparse_matrix);
   // make a container for the sums
   column_sums.resize(width(), 0);
-  for (unsigned int i = 0; i < nz_entries.size(); i++) {
-    int x = std::get<0>(nz_entries[i]);
-    column_sums[x] = column_sums[x] + std::get<2>(nz_entries[i]);
+  for (size_t i = 0; i < col_idx.size(); i++) {
+    column_sums[col_idx[i]] = column_sums[col_idx[i]] + vals[i];
   }
 }
 
+template <typename T>
+SparseMatrix<T> SparseMatrix<T>::row_block(size_t begin, size_t end) {
+  start_timer(row_block, sparse_matrix);
+  SparseMatrix<T> block;
+  const size_t first = row_ptr[begin];
+  const size_t last = row_ptr[end];
+  block.row_ptr.resize(end - begin + 1);
+  std::transform(row_ptr.begin() + begin, row_ptr.begin() + end + 1,
+                 block.row_ptr.begin(),
+                 [first](size_t offset) { return offset - first; });
+  block.col_idx.assign(col_idx.begin() + first, col_idx.begin() + last);
+  block.vals.assign(vals.begin() + first, vals.begin() + last);
+  block.rows = static_cast<int>(end - begin);
+  block.cols = cols;
+  block.nonz = static_cast<int>(last - first);
+  block.pattern = pattern;
+  block.filename = filename;
+  block.use_cache = use_cache;
+  block.content_hash = content_hash;
+  block.record_transform(TRANSFORM_ROW_BLOCK, hash_combine(begin, end));
+  return block;
+}
+
+template <typename T>
+void SparseMatrix<T>::record_transform(uint64_t transform, uint64_t parameter) {
+  content_hash = hash_combine(hash_combine(content_hash, transform), parameter);
+}
+
 template <typename T> int SparseMatrix<T>::width() { return cols; }
 
 template <typename T> inline int SparseMatrix<T>::height() { return rows; }
 
 template <typename T> int SparseMatrix<T>::nonZeros() { return nonz; }
 
+template <typename T> size_t SparseMatrix<T>::entries() {
+  return col_idx.size();
+}
+
+template <typename T> size_t SparseMatrix<T>::full_entries() {
+  if (!lower_only) {
+    return entries();
+  }
+  // every entry off the diagonal stands for itself and its mirror
+  size_t diagonal = 0;
+  for (size_t r = 0; r + 1 < row_ptr.size(); r++) {
+    for (size_t i = row_ptr[r]; i < row_ptr[r + 1]; i++) {
+      diagonal += static_cast<size_t>(col_idx[i]) == r ? 1 : 0;
+    }
+  }
+  return 2 * entries() - diagonal;
+}
+
 template class SparseMatrix<float>;
 template class SparseMatrix<int>;
 template class SparseMatrix<bool>;